@@ -97,8 +97,10 @@ struct graphics_context {
     double angle;
     long framecount;
     double lastframe;
+	wander::IPal* pal;
 	wander::IRuntime* runtime;
 	const wander::RenderTree* tree;
+	wander::DrawList draws;
 };
 
 const float SQUARE[] = {
@@ -134,6 +136,9 @@ render(struct graphics_context *context)
     glClearColor(0.15, 0.15, 0.15, 1);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // The host binds its own VAO below, so the PAL can't trust its cached state
+    context->pal->BeginFrame();
+
     glUseProgram(context->program);
     glUniform1f(context->uniform_angle, context->angle);
     glBindVertexArray(context->vao_point);
@@ -171,26 +176,36 @@ render(struct graphics_context *context)
 
     
 
+    glActiveTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
+    GLuint bound_texture = 0;
+
+    // Material is the texture picked for the node, sorting groups nodes that share one
+    const GLuint textures[] = {context->texture_white, context->texture_window, context->texture_roof};
+
+    context->draws.Clear();
     for (auto i = 0; i < context->tree->Length(); ++i)
 	{
         auto node = context->tree->NodeAt(i);
+        uint32_t material = 0;
         if (node->Metadata().find("roof") != std::string::npos)
-        {
-            //printf("texture %d", context->texture_roof);
-            //glBindTexture(GL_TEXTURE_2D, context->texture_roof);
-            glActiveTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
-            glBindTexture(GL_TEXTURE_2D, context->texture_roof);
-        }
+            material = 2;
         else if (node->Metadata().find("window") != std::string::npos)
+            material = 1;
+
+        context->draws.Add(node, material);
+    }
+    context->draws.Sort();
+
+    for (const auto &draw : context->draws)
+	{
+        auto node = draw.node;
+        auto texture = textures[wander::DrawList::Material(draw.key)];
+
+        // Sorted, so a texture is bound once per frame
+        if (texture != bound_texture)
         {
-            //printf("texture %d", context->texture_window);
-            glActiveTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
-            glBindTexture(GL_TEXTURE_2D, context->texture_window);
-        }
-        else
-        {
-            glActiveTexture(GL_TEXTURE0); // activate the texture unit first before binding texture
-            glBindTexture(GL_TEXTURE_2D, context->texture_white);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            bound_texture = texture;
         }
         
         //glBindTexture(GL_TEXTURE_2D, context->texture_window);
@@ -404,6 +419,7 @@ int main(int argc, char **argv)
     //bmpread_free(&bitmap2);
 
 	const auto pal = wander::Factory::CreatePal(wander::EPalType::OpenGL, (void*)context.window);
+	context.pal = pal;
 	context.runtime = wander::Factory::CreateRuntime(pal);
 
 	auto renderlet_id = context.runtime->LoadFromFile(L"../Building.rlt", "start");
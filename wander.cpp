@@ -7,11 +7,24 @@
 
 #include <array>
 #include <cassert>
+#include <iomanip>
 #include <sstream>
 #include <string>
 #include <locale>
 #include <algorithm>
 #include <string_view>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RLT_SSE2
+#endif
 
 
 //#include "wasmtime.h"
@@ -25,6 +38,14 @@
 #include <GLES3/gl3platform.h> 
 #endif
 
+// S3TC is an extension, core GL headers leave these out
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
 
 
 #ifdef _WIN32
@@ -299,7 +320,7 @@ private:
 
 #ifndef __EMSCRIPTEN__
 
-static void exit_with_error(const char *message, wasmtime_error_t *error, wasm_trap_t *trap)
+static void print_error(const char *message, wasmtime_error_t *error, wasm_trap_t *trap)
 {
 	fprintf(stderr, "error: %s\n", message);
 	wasm_byte_vec_t error_message;
@@ -308,13 +329,22 @@ static void exit_with_error(const char *message, wasmtime_error_t *error, wasm_t
 		wasmtime_error_message(error, &error_message);
 		wasmtime_error_delete(error);
 	}
-	else
+	else if (trap != NULL)
 	{
 		wasm_trap_message(trap, &error_message);
 		wasm_trap_delete(trap);
 	}
+	else
+	{
+		return;
+	}
 	fprintf(stderr, "%.*s\n", (int)error_message.size, error_message.data);
 	wasm_byte_vec_delete(&error_message);
+}
+
+static void exit_with_error(const char *message, wasmtime_error_t *error, wasm_trap_t *trap)
+{
+	print_error(message, error, trap);
 	exit(1);
 }
 
@@ -346,942 +376,5732 @@ auto split_fixed(char separator, std::string_view input)
 	return results;
 }
 
-#ifdef _WIN32
+typedef VectorLoader::Point Point;
 
-PalD3D11::PalD3D11(ID3D11Device *device, ID3D11DeviceContext *context) :
-	m_device(device), m_device_context(context), m_swapchain(nullptr)
+static Point operator+(Point a, Point b) { return {a.x + b.x, a.y + b.y}; }
+static Point operator-(Point a, Point b) { return {a.x - b.x, a.y - b.y}; }
+static Point operator*(Point a, float s) { return {a.x * s, a.y * s}; }
+
+static float length(Point a)
 {
+	return std::sqrt(a.x * a.x + a.y * a.y);
 }
 
-PalD3D11::PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context, IDXGISwapChain* swapchain) :
-	m_device(device), m_device_context(context), m_swapchain(swapchain)
+static Point normalize(Point a)
 {
-#ifdef RLT_RIVE
-	PLSRenderContextD3DImpl::ContextOptions contextOptions{};
-
-	m_plsContext = PLSRenderContextD3DImpl::MakeContext(m_device, m_device_context, contextOptions);
-#endif
+	const auto l = length(a);
+	return l > 0.0f ? a * (1.0f / l) : Point{0.0f, 0.0f};
 }
 
-PalD3D11::~PalD3D11() {};
+static Point perpendicular(Point a)
+{
+	return {-a.y, a.x};
+}
 
-ObjectID PalD3D11::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+static void push_triangle(std::vector<Point> &vertices, Point a, Point b, Point c)
 {
-	m_buffers.emplace_back(nullptr);
+	vertices.push_back(a);
+	vertices.push_back(b);
+	vertices.push_back(c);
+}
 
-	D3D11_BUFFER_DESC vbd = {};
-	vbd.Usage = D3D11_USAGE_IMMUTABLE;
-	vbd.ByteWidth = length;
-	vbd.CPUAccessFlags = 0;
-	vbd.MiscFlags = 0;
-	D3D11_SUBRESOURCE_DATA vinitData;
-	vinitData.pSysMem = data;
+VectorTessellator::Mesh VectorTessellator::Tessellate(const VectorLoader::CommandList &commands)
+{
+	Mesh mesh;
 
-	switch (desc.Type())
+	for (size_t c = 0; c < commands.Size(); ++c)
 	{
-	case BufferType::Vertex:
-		vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-		break;
-	case BufferType::Index:
-		vbd.BindFlags = D3D11_BIND_INDEX_BUFFER;
-		break;
-	case BufferType::Texture2D:
-		exit_with_error("Texture2D not supported in D3D11 Buffers", nullptr, nullptr);
-		break;
-	case BufferType::DynamicMaterial:
-		vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-		vbd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-		vbd.Usage = D3D11_USAGE_DYNAMIC;
-		break;
+		Append(commands, c, mesh);
 	}
 
-	if (m_device->CreateBuffer(&vbd, &vinitData, &m_buffers.back()) != 0)
-		return -1;
-
-	return m_buffers.size() - 1;
+	return mesh;
 }
 
-ObjectID PalD3D11::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+void VectorTessellator::Append(const VectorLoader::CommandList &commands, size_t command, Mesh &mesh)
 {
-	m_textures.emplace_back(nullptr);
+	const auto &paint = commands.paints[command];
 
-	DXGI_FORMAT format{};
-	auto pitch = 0;
+	Flatten(commands, commands.commands[command]);
 
-	switch (desc.Format())
-	{
-	case BufferFormat::Unknown:
-	case BufferFormat::Custom:
-	case BufferFormat::CustomVertex:
-	case BufferFormat::Index16:
-	case BufferFormat::Index32:
-	default:
-		return -1;
-	case BufferFormat::R8:
-		format = DXGI_FORMAT_R8_UNORM;
-		pitch = 1;
-		break;
-	case BufferFormat::RG8:
-		format = DXGI_FORMAT_R8G8_UNORM;
-		pitch = 2;
-		break;
-	case BufferFormat::RGB8:
-		format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		pitch = 3; // legacy
-		break;
-	case BufferFormat::RGBA8:
-		format = DXGI_FORMAT_R8G8B8A8_UNORM;
-		pitch = 4;
-		break;
-	case BufferFormat::R16F:
-		format = DXGI_FORMAT_R16_FLOAT;
-		pitch = 2;
-		break;
-	case BufferFormat::RG16F:
-		format = DXGI_FORMAT_R16G16_FLOAT;
-		pitch = 4;
-		break;
-	case BufferFormat::RGB16F:
-		format = DXGI_FORMAT_R16G16B16A16_FLOAT;
-		pitch = 6;  // legacy
-		break;
-	case BufferFormat::RGBA16F:
-		format = DXGI_FORMAT_R16G16B16A16_FLOAT;
-		pitch = 8;
-		break;
-	case BufferFormat::R32F:
-		format = DXGI_FORMAT_R32_FLOAT;
-		pitch = 4;
-		break;
-	case BufferFormat::RG32F:
-		format = DXGI_FORMAT_R32G32_FLOAT;
-		pitch = 8;
-		break;
-	case BufferFormat::RGB32F:
-		format = DXGI_FORMAT_R32G32B32_FLOAT;
-		pitch = 12;
-		break;
-	case BufferFormat::RGBA32F:
-		format = DXGI_FORMAT_R32G32B32A32_FLOAT;
-		pitch = 16;
-		break;
-	}
+	Draw draw{paint.color, paint.style == VectorLoader::RenderPaintStyle::stroke,
+		static_cast<int>(mesh.vertices.size()), 0, -1};
 
-	// Copy into a texture.
-	D3D11_TEXTURE2D_DESC texDesc;
-	texDesc.Width = desc.Width();
-	texDesc.Height = desc.Height();
-	texDesc.MipLevels = 1;
-	texDesc.ArraySize = 1;
-	texDesc.Format = format;
-	texDesc.SampleDesc.Count = 1;
-	texDesc.SampleDesc.Quality = 0;
-	texDesc.Usage = D3D11_USAGE_IMMUTABLE;
-	texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-	texDesc.CPUAccessFlags = 0;
-	texDesc.MiscFlags = 0;
+	if (draw.stroke)
+		Stroke(mesh, paint);
+	else
+		Fill(mesh);
 
-	D3D11_SUBRESOURCE_DATA sub;
-	sub.pSysMem = data;
-	sub.SysMemPitch = pitch;
-	sub.SysMemSlicePitch = 0; // no array support yet
+	draw.count = static_cast<int>(mesh.vertices.size()) - draw.first;
 
-	if (m_device->CreateTexture2D(&texDesc, &sub, &m_textures.back()))
-		return -1;
+	if (draw.count == 0)
+		return;
 
-	return m_textures.size() - 1;
-}
+	if (!draw.stroke)
+	{
+		auto min = mesh.vertices[draw.first];
+		auto max = min;
 
-void PalD3D11::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
-{
-	D3D11_MAPPED_SUBRESOURCE mappedResource;
-	ZeroMemory(&mappedResource, sizeof(D3D11_MAPPED_SUBRESOURCE));
+		for (auto i = draw.first; i < draw.first + draw.count; ++i)
+		{
+			min = {std::min(min.x, mesh.vertices[i].x), std::min(min.y, mesh.vertices[i].y)};
+			max = {std::max(max.x, mesh.vertices[i].x), std::max(max.y, mesh.vertices[i].y)};
+		}
 
-	m_device_context->Map(m_buffers[buffer_id], 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource);
-	memcpy(mappedResource.pData, data, length);
-	m_device_context->Unmap(m_buffers[buffer_id], 0);
-}
+		draw.cover_first = static_cast<int>(mesh.vertices.size());
+		push_triangle(mesh.vertices, min, {max.x, min.y}, max);
+		push_triangle(mesh.vertices, min, max, {min.x, max.y});
+	}
 
-void PalD3D11::DeleteBuffer(ObjectID buffer_id)
-{
-	if (buffer_id != -1)
-		m_buffers[buffer_id]->Release();
+	mesh.draws.push_back(draw);
 }
 
-ObjectID PalD3D11::CreateVector(int length, const uint8_t data[])
+void VectorTessellator::Flatten(const VectorLoader::CommandList &commands, const VectorLoader::CommandSpan &span)
 {
-#ifdef RLT_RIVE
-	m_vector_commands.emplace_back(VectorLoader::Read(data, length));
+	m_contours.clear();
+	m_closed.clear();
 
-	m_vector_srvs.emplace_back(nullptr);
-	m_vector_textures.emplace_back(nullptr);
+	Point current{0.0f, 0.0f};
 
-	return m_vector_commands.size() - 1;
-#else
-	return -1;
-#endif
-}
+	const auto begin = [this](Point p)
+	{
+		m_contours.push_back({p});
+		m_closed.push_back(false);
+	};
 
-ObjectID PalD3D11::UpdateVector(int length, const uint8_t data[], ObjectID buffer_id)
-{
-#ifdef RLT_RIVE
-	m_vector_commands[buffer_id] = VectorLoader::Read(data, length);
-	return buffer_id;
-#else
-	return -1;
-#endif
-}
+	const auto *points = commands.points.data() + span.first_point;
 
-void PalD3D11::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride)
-{
-	if (buffer_id < 0)
-		return;
+	for (auto v = span.first_verb; v < span.first_verb + span.verb_count; ++v)
+	{
+		const auto type = commands.verbs[v];
 
-	ID3D11Buffer *const buffers[] = {m_buffers[buffer_id], nullptr};
-	const UINT strides[] = {stride, 0};
-	const UINT offsets[] = {0, 0};
+		if (type != VectorLoader::EPathType::Close && m_contours.empty())
+			begin(current);
 
-	m_device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	m_device_context->IASetVertexBuffers(0, 2, buffers, strides, offsets);
-	m_device_context->Draw(length, offset);
+		switch (type)
+		{
+		case VectorLoader::EPathType::Move:
+			current = points[0];
+			if (m_contours.back().size() > 1)
+				begin(current);
+			else
+				m_contours.back() = {current};
+			break;
+		case VectorLoader::EPathType::Line:
+			current = points[0];
+			m_contours.back().push_back(current);
+			break;
+		case VectorLoader::EPathType::Quad:
+		{
+			// Wang's formula, quadratic case
+			const auto dd = length(current - points[0] * 2.0f + points[1]);
+			const auto n = std::min(100, std::max(1, static_cast<int>(std::ceil(std::sqrt(dd / (4.0f * m_tolerance))))));
+			const auto p0 = current;
+			for (auto i = 1; i <= n; ++i)
+			{
+				const auto t = static_cast<float>(i) / n;
+				const auto u = 1.0f - t;
+				m_contours.back().push_back(p0 * (u * u) + points[0] * (2.0f * u * t) + points[1] * (t * t));
+			}
+			current = points[1];
+			break;
+		}
+		case VectorLoader::EPathType::Cubic:
+		{
+			// Wang's formula, cubic case
+			const auto dd = std::max(length(current - points[0] * 2.0f + points[1]),
+				length(points[0] - points[1] * 2.0f + points[2]));
+			const auto n = std::min(100, std::max(1, static_cast<int>(std::ceil(std::sqrt(0.75f * dd / m_tolerance)))));
+			const auto p0 = current;
+			for (auto i = 1; i <= n; ++i)
+			{
+				const auto t = static_cast<float>(i) / n;
+				const auto u = 1.0f - t;
+				m_contours.back().push_back(p0 * (u * u * u) + points[0] * (3.0f * u * u * t) +
+					points[1] * (3.0f * u * t * t) + points[2] * (t * t * t));
+			}
+			current = points[2];
+			break;
+		}
+		case VectorLoader::EPathType::Close:
+			if (m_contours.empty())
+				break;
+			m_closed.back() = true;
+			current = m_contours.back().front();
+			begin(current);
+			break;
+		}
+
+		points += VectorLoader::PointCount(type);
+	}
 }
 
-void PalD3D11::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length,
-	unsigned int stride, ObjectID material_buffer_id, unsigned int material_stride)
+void VectorTessellator::Fill(Mesh &mesh) const
 {
-	if (buffer_id < 0 || material_buffer_id < 0)
-		return;
-
-	ID3D11Buffer* const buffers[] = {m_buffers[buffer_id], m_buffers[material_buffer_id]};
-	const UINT strides[] = {stride, material_stride};
-	const UINT offsets[] = {static_cast<UINT>(offset * stride), 0};
-
-	m_device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	m_device_context->IASetVertexBuffers(0, 2, buffers, strides, offsets);
-	m_device_context->Draw(length, 0);
+	for (const auto &contour : m_contours)
+	{
+		for (size_t i = 1; i + 1 < contour.size(); ++i)
+		{
+			push_triangle(mesh.vertices, contour[0], contour[i], contour[i + 1]);
+		}
+	}
 }
 
-void PalD3D11::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+void VectorTessellator::Stroke(Mesh &mesh, const VectorLoader::RenderPaint &paint) const
 {
-#if defined(RLT_RIVE)
-	{
-		D3D11SavedState savedState(m_device_context);
+	const auto half_width = paint.thickness * 0.5f;
+	if (half_width <= 0.0f)
+		return;
 
-		const auto &vector = m_vector_commands[buffer_id];
+	std::vector<Point> points;
 
-		rive::Factory *factory = m_plsContext.get();
+	for (size_t c = 0; c < m_contours.size(); ++c)
+	{
+		// Drop zero length segments so every direction is well defined
+		points.clear();
+		for (const auto &p : m_contours[c])
+		{
+			if (points.empty() || length(p - points.back()) > 1e-4f)
+				points.push_back(p);
+		}
 
-		auto renderer = std::make_unique<PLSRenderer>(m_plsContext.get());
+		const auto closed = m_closed[c] && points.size() > 2;
+		if (closed && length(points.back() - points.front()) <= 1e-4f)
+			points.pop_back();
 
-		auto plsContextImpl = m_plsContext->static_impl_cast<PLSRenderContextD3DImpl>();
+		if (points.size() < 2)
+			continue;
 
-		auto renderTarget = plsContextImpl->makeRenderTarget(width, height);
+		const auto segments = closed ? points.size() : points.size() - 1;
 
-		if (slot != -1 && m_vector_textures[buffer_id] == nullptr)
+		for (size_t i = 0; i < segments; ++i)
 		{
-			D3D11_TEXTURE2D_DESC CoordinateTexDesc = {
-				static_cast<UINT>(width), // UINT Width;
-				static_cast<UINT>(height), // UINT Height;
-				1, // UINT MipLevels;
-				1, // UINT ArraySize;
-				DXGI_FORMAT_R8G8B8A8_UNORM, // DXGI_FORMAT Format;
-				{1, 0}, // DXGI_SAMPLE_DESC SampleDesc;
-				D3D11_USAGE_DEFAULT, // D3D11_USAGE Usage;
-				D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET, // UINT BindFlags;
-				0, // UINT CPUAccessFlags;
-				0, // UINT MiscFlags;
-			};
+			const auto a = points[i];
+			const auto b = points[(i + 1) % points.size()];
+			const auto n = perpendicular(normalize(b - a)) * half_width;
 
-			m_device->CreateTexture2D(&CoordinateTexDesc, NULL, &m_vector_textures[buffer_id]);
-			m_device->CreateShaderResourceView(m_vector_textures[buffer_id], NULL, &m_vector_srvs[buffer_id]);
-		}
+			push_triangle(mesh.vertices, a + n, a - n, b + n);
+			push_triangle(mesh.vertices, b + n, a - n, b - n);
 
-		m_plsContext->beginFrame({
-			.renderTargetWidth = static_cast<uint32_t>(width),
-			.renderTargetHeight = static_cast<uint32_t>(height),
-			.clearColor = 0xFF000000,
-			.msaaSampleCount = 0,
-			.disableRasterOrdering = false,
-			.wireframe = false,
-			.fillsDisabled = false,
-			.strokesDisabled = false,
-		});
+			if (i + 1 < segments || closed)
+			{
+				const auto c2 = points[(i + 2) % points.size()];
+				Join(mesh, b, normalize(b - a), normalize(c2 - b), half_width, paint.join);
+			}
+		}
 
-		if (slot == -1)
+		if (!closed)
 		{
-			ID3D11Texture2D *frameBuffer;
+			Cap(mesh, points.front(), normalize(points.front() - points[1]), half_width, paint.cap);
+			Cap(mesh, points.back(), normalize(points.back() - points[points.size() - 2]), half_width, paint.cap);
+		}
+	}
+}
 
-			m_swapchain->GetBuffer(0, __uuidof(ID3D11Texture2D), reinterpret_cast<void **>(&frameBuffer));
+void VectorTessellator::Join(Mesh &mesh, Point p, Point d0, Point d1, float half_width,
+	VectorLoader::StrokeJoin join) const
+{
+	constexpr auto MiterLimit = 4.0f;
 
-			renderTarget->setTargetTexture(frameBuffer);
-		}
-		else
+	const auto cross = d0.x * d1.y - d0.y * d1.x;
+	const auto dot = d0.x * d1.x + d0.y * d1.y;
+	if (std::fabs(cross) < 1e-6f && dot > 0.0f)
+		return;
+
+	// The gap opens on the outside of the turn
+	const auto side = cross > 0.0f ? -1.0f : 1.0f;
+	const auto n0 = perpendicular(d0) * side;
+	const auto n1 = perpendicular(d1) * side;
+
+	switch (join)
+	{
+	case VectorLoader::StrokeJoin::round:
+		Arc(mesh, p, n0 * half_width, std::atan2(n0.x * n1.y - n0.y * n1.x, n0.x * n1.x + n0.y * n1.y), half_width);
+		return;
+	case VectorLoader::StrokeJoin::miter:
+	{
+		const auto m = normalize(n0 + n1);
+		const auto cosine = m.x * n0.x + m.y * n0.y;
+		if (cosine > 1.0f / MiterLimit)
 		{
-			renderTarget->setTargetTexture(m_vector_textures[buffer_id]);
+			const auto tip = p + m * (half_width / cosine);
+			push_triangle(mesh.vertices, p, p + n0 * half_width, tip);
+			push_triangle(mesh.vertices, p, tip, p + n1 * half_width);
+			return;
 		}
+		break;
+	}
+	case VectorLoader::StrokeJoin::bevel:
+		break;
+	}
 
-		for (const auto &paths : vector)
-		{
-			const auto &raw_paint = std::get<0>(paths);
-			auto paint = factory->makeRenderPaint();
+	push_triangle(mesh.vertices, p, p + n0 * half_width, p + n1 * half_width);
+}
 
-			//paint->blendMode(static_cast<BlendMode>(raw_paint.blendMode));
-			paint->join(static_cast<StrokeJoin>(raw_paint.join));
-			paint->cap(static_cast<StrokeCap>(raw_paint.cap));
-			paint->style(static_cast<RenderPaintStyle>(raw_paint.style));
-			paint->thickness(raw_paint.thickness);
-			paint->color(raw_paint.color);
+void VectorTessellator::Cap(Mesh &mesh, Point p, Point d, float half_width, VectorLoader::StrokeCap cap) const
+{
+	const auto n = perpendicular(d) * half_width;
 
-			RawPath rp{};
-			const auto &raw_path = std::get<1>(paths);
+	switch (cap)
+	{
+	case VectorLoader::StrokeCap::butt:
+		break;
+	case VectorLoader::StrokeCap::round:
+		Arc(mesh, p, n, -3.14159265f, half_width);
+		break;
+	case VectorLoader::StrokeCap::square:
+	{
+		const auto e = d * half_width;
+		push_triangle(mesh.vertices, p + n, p - n, p + n + e);
+		push_triangle(mesh.vertices, p + n + e, p - n, p - n + e);
+		break;
+	}
+	}
+}
 
-			for (const auto &path : raw_path)
-			{
-				const auto type = std::get<0>(path);
-				const auto &points = std::get<1>(path);
+void VectorTessellator::Arc(Mesh &mesh, Point center, Point from, float angle, float radius) const
+{
+	// Segment count keeps the chord error under the tolerance
+	const auto step = 2.0f * std::acos(std::max(0.0f, 1.0f - m_tolerance / std::max(radius, m_tolerance)));
+	const auto n = std::min(64, std::max(1, static_cast<int>(std::ceil(std::fabs(angle) / std::max(step, 1e-3f)))));
 
-				switch (type)
-				{
-				case VectorLoader::EPathType::Move:
-					rp.moveTo(points[0].x, points[0].y);
-					break;
-				case VectorLoader::EPathType::Line:
-					rp.lineTo(points[0].x, points[0].y);
-					break;
-				case VectorLoader::EPathType::Quad:
-					rp.quadTo(points[0].x, points[0].y, points[1].x, points[1].y);
-					break;
-				case VectorLoader::EPathType::Cubic:
-					rp.cubicTo(points[0].x, points[0].y, points[1].x, points[1].y, points[2].x, points[2].y);
-					break;
-				case VectorLoader::EPathType::Close:
-					rp.close();
-					break;
+	auto previous = center + from;
+	for (auto i = 1; i <= n; ++i)
+	{
+		const auto a = angle * i / n;
+		const auto c = std::cos(a);
+		const auto s = std::sin(a);
+		const auto next = center + Point{from.x * c - from.y * s, from.x * s + from.y * c};
+
+		push_triangle(mesh.vertices, center, previous, next);
+		previous = next;
+	}
+}
+
+size_t TexturePipeline::LevelSize(BufferFormat format, int width, int height)
+{
+	const auto blocks = static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4);
+	const auto texels = static_cast<size_t>(width) * height;
+
+	switch (format)
+	{
+	case BufferFormat::BC1:
+		return blocks * 8;
+	case BufferFormat::BC3:
+		return blocks * 16;
+	case BufferFormat::R8:
+		return texels;
+	case BufferFormat::RG8:
+	case BufferFormat::R16F:
+		return texels * 2;
+	case BufferFormat::RGB8:
+		return texels * 3;
+	case BufferFormat::RGBA8:
+	case BufferFormat::RG16F:
+	case BufferFormat::R32F:
+		return texels * 4;
+	case BufferFormat::RGB16F:
+		return texels * 6;
+	case BufferFormat::RGBA16F:
+	case BufferFormat::RG32F:
+		return texels * 8;
+	case BufferFormat::RGB32F:
+		return texels * 12;
+	case BufferFormat::RGBA32F:
+		return texels * 16;
+	default:
+		return 0;
+	}
+}
+
+void TexturePipeline::Downsample(const uint8_t *src, int width, int height, uint8_t *dst)
+{
+	const auto dst_width = std::max(width / 2, 1);
+	const auto dst_height = std::max(height / 2, 1);
+
+	for (auto y = 0; y < dst_height; ++y)
+	{
+		// A single row or column is averaged with itself, odd edges drop the last one
+		const auto row0 = src + static_cast<size_t>(std::min(2 * y, height - 1)) * width * 4;
+		const auto row1 = src + static_cast<size_t>(std::min(2 * y + 1, height - 1)) * width * 4;
+		const auto out = dst + static_cast<size_t>(y) * dst_width * 4;
+
+		auto x = 0;
+
+#ifdef RLT_SSE2
+		// Two texels out per four texels in from each row, summed in 16 bits
+		const auto zero = _mm_setzero_si128();
+		const auto round = _mm_set1_epi16(2);
+
+		for (; 2 * x + 3 < width && x + 2 <= dst_width; x += 2)
+		{
+			const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 8 * x));
+			const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 8 * x));
+
+			const auto lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			const auto hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+			const auto sum = _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)),
+				_mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+			const auto average = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(out + 4 * x), _mm_packus_epi16(average, average));
+		}
+#endif
+
+		for (; x < dst_width; ++x)
+		{
+			const auto x0 = std::min(2 * x, width - 1) * 4;
+			const auto x1 = std::min(2 * x + 1, width - 1) * 4;
+
+			for (auto c = 0; c < 4; ++c)
+				out[4 * x + c] = static_cast<uint8_t>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+		}
+	}
+}
+
+// Texels of the 4x4 block at (bx, by), blocks past the edge repeat the last row or column
+static void load_block(const uint8_t *rgba, int width, int height, int bx, int by, uint8_t block[64])
+{
+	for (auto y = 0; y < 4; ++y)
+	{
+		const auto row = rgba + static_cast<size_t>(std::min(by + y, height - 1)) * width * 4;
+
+		for (auto x = 0; x < 4; ++x)
+			memcpy(block + 4 * (4 * y + x), row + 4 * std::min(bx + x, width - 1), 4);
+	}
+}
+
+static uint16_t to_565(const int color[3])
+{
+	return static_cast<uint16_t>(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 |
+		(color[2] * 31 + 127) / 255);
+}
+
+static void from_565(uint16_t value, int color[3])
+{
+	const auto r = (value >> 11) & 31;
+	const auto g = (value >> 5) & 63;
+	const auto b = value & 31;
+
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+void TexturePipeline::ColorBlock(const uint8_t block[64], uint8_t out[8])
+{
+	int lo[3] = {255, 255, 255};
+	int hi[3] = {0, 0, 0};
+	int mean[3] = {0, 0, 0};
+
+	for (auto i = 0; i < 16; ++i)
+	{
+		for (auto c = 0; c < 3; ++c)
+		{
+			lo[c] = std::min<int>(lo[c], block[4 * i + c]);
+			hi[c] = std::max<int>(hi[c], block[4 * i + c]);
+			mean[c] += block[4 * i + c];
+		}
+	}
+
+	// Endpoints on the diagonal of the bounding box that follows the colors: channels falling
+	// as the widest one rises swap ends. Inset by 1/16 of the range to cut the error at the ends.
+	auto widest = 0;
+	for (auto c = 1; c < 3; ++c)
+	{
+		if (hi[c] - lo[c] > hi[widest] - lo[widest])
+			widest = c;
+	}
+
+	for (auto c = 0; c < 3; ++c)
+	{
+		auto covariance = 0;
+		for (auto i = 0; i < 16; ++i)
+			covariance += (16 * block[4 * i + c] - mean[c]) * (16 * block[4 * i + widest] - mean[widest]) / 256;
+
+		const auto inset = (hi[c] - lo[c]) >> 4;
+		lo[c] += inset;
+		hi[c] -= inset;
+
+		if (covariance < 0)
+			std::swap(lo[c], hi[c]);
+	}
+
+	auto c0 = to_565(hi);
+	auto c1 = to_565(lo);
+
+	// c0 > c1 selects the four color mode, equal endpoints need no indices
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	int palette[4][3];
+	from_565(c0, palette[0]);
+	from_565(c1, palette[1]);
+
+	for (auto c = 0; c < 3; ++c)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	uint32_t indices = 0;
+	if (c0 != c1)
+	{
+		for (auto i = 0; i < 16; ++i)
+		{
+			auto best = 0;
+			auto best_distance = INT32_MAX;
+
+			for (auto p = 0; p < 4; ++p)
+			{
+				auto distance = 0;
+				for (auto c = 0; c < 3; ++c)
+					distance += (block[4 * i + c] - palette[p][c]) * (block[4 * i + c] - palette[p][c]);
+
+				if (distance < best_distance)
+				{
+					best = p;
+					best_distance = distance;
 				}
 			}
 
-			auto path = factory->makeRenderPath(rp, FillRule::nonZero);
+			indices |= static_cast<uint32_t>(best) << (2 * i);
+		}
+	}
+
+	out[0] = c0 & 0xFF;
+	out[1] = c0 >> 8;
+	out[2] = c1 & 0xFF;
+	out[3] = c1 >> 8;
+	memcpy(out + 4, &indices, 4);
+}
+
+void TexturePipeline::AlphaBlock(const uint8_t block[64], uint8_t out[8])
+{
+	auto lo = 255;
+	auto hi = 0;
+
+	for (auto i = 0; i < 16; ++i)
+	{
+		lo = std::min<int>(lo, block[4 * i + 3]);
+		hi = std::max<int>(hi, block[4 * i + 3]);
+	}
 
-			renderer->drawPath(path.get(), paint.get());
+	// hi > lo selects eight interpolated values, 0 and 1 are the endpoints
+	int palette[8] = {hi, lo};
+	for (auto i = 1; i < 7; ++i)
+		palette[i + 1] = ((7 - i) * hi + i * lo) / 7;
+
+	uint64_t indices = 0;
+	if (hi != lo)
+	{
+		for (auto i = 0; i < 16; ++i)
+		{
+			auto best = 0;
+			for (auto p = 1; p < 8; ++p)
+			{
+				if (std::abs(block[4 * i + 3] - palette[p]) < std::abs(block[4 * i + 3] - palette[best]))
+					best = p;
+			}
 
-			
+			indices |= static_cast<uint64_t>(best) << (3 * i);
 		}
-		m_plsContext->flush({.renderTarget = renderTarget.get()});
 	}
-	if (slot != -1)
-		m_device_context->PSSetShaderResources(slot, 1, &m_vector_srvs[buffer_id]);
-#endif
+
+	out[0] = static_cast<uint8_t>(hi);
+	out[1] = static_cast<uint8_t>(lo);
+	for (auto i = 0; i < 6; ++i)
+		out[2 + i] = static_cast<uint8_t>(indices >> (8 * i));
 }
 
-#endif
+void TexturePipeline::EncodeBC1(const uint8_t *rgba, int width, int height, uint8_t *dst)
+{
+	uint8_t block[64];
 
-ObjectID PalOpenGL::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+	for (auto by = 0; by < height; by += 4)
+	{
+		for (auto bx = 0; bx < width; bx += 4, dst += 8)
+		{
+			load_block(rgba, width, height, bx, by, block);
+			ColorBlock(block, dst);
+		}
+	}
+}
+
+void TexturePipeline::EncodeBC3(const uint8_t *rgba, int width, int height, uint8_t *dst)
 {
-	switch (desc.Type())
+	uint8_t block[64];
+
+	for (auto by = 0; by < height; by += 4)
 	{
-	case BufferType::Vertex:
-		break;
-	case BufferType::Index:
-	case BufferType::Texture2D:
-		CreateTexture(desc, length, data);
-		break;
+		for (auto bx = 0; bx < width; bx += 4, dst += 16)
+		{
+			load_block(rgba, width, height, bx, by, block);
+			AlphaBlock(block, dst);
+			ColorBlock(block, dst + 8);
+		}
 	}
+}
 
-	GLuint vbo{};
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, length, data, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	m_vbos.emplace_back(vbo);
+void TexturePipeline::DecodeColorBlock(const uint8_t in[8], bool alpha_mode, uint8_t block[64])
+{
+	const uint16_t c0 = in[0] | in[1] << 8;
+	const uint16_t c1 = in[2] | in[3] << 8;
+
+	int palette[4][4] = {};
+	from_565(c0, palette[0]);
+	from_565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = palette[2][3] = 255;
+
+	// BC1 with c0 <= c1 has three colors and transparent black, BC3 color blocks always have four
+	if (c0 > c1 || !alpha_mode)
+	{
+		for (auto c = 0; c < 3; ++c)
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		palette[3][3] = 255;
+	}
+	else
+	{
+		for (auto c = 0; c < 3; ++c)
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+	}
 
-	GLuint vao{};
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	m_vaos.emplace_back(vao);
+	uint32_t indices;
+	memcpy(&indices, in + 4, 4);
 
-	return m_vaos.size() - 1;
+	for (auto i = 0; i < 16; ++i)
+	{
+		for (auto c = 0; c < 4; ++c)
+			block[4 * i + c] = static_cast<uint8_t>(palette[(indices >> (2 * i)) & 3][c]);
+	}
 }
 
-ObjectID PalOpenGL::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+void TexturePipeline::DecodeAlphaBlock(const uint8_t in[8], uint8_t block[64])
 {
-	GLenum format{};
-	GLenum type{};
+	const int a0 = in[0];
+	const int a1 = in[1];
 
-	switch (desc.Format())
+	// a0 > a1 has eight interpolated values, otherwise six plus 0 and 255
+	int palette[8] = {a0, a1};
+	if (a0 > a1)
 	{
-	case BufferFormat::Unknown:
-	case BufferFormat::Custom:
-	case BufferFormat::CustomVertex:
-	case BufferFormat::Index16:
-	case BufferFormat::Index32:
-		return -1;
-	case BufferFormat::R8:
-		format = GL_UNSIGNED_BYTE;
-		type = GL_RED;
-		break;
-	case BufferFormat::RG8:
-		format = GL_UNSIGNED_BYTE;
-		type = GL_RG;
-		break;
-	case BufferFormat::RGB8:
-		format = GL_UNSIGNED_BYTE;
-		type = GL_RGB;
+		for (auto i = 1; i < 7; ++i)
+			palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+	}
+	else
+	{
+		for (auto i = 1; i < 5; ++i)
+			palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+
+	uint64_t indices = 0;
+	for (auto i = 0; i < 6; ++i)
+		indices |= static_cast<uint64_t>(in[2 + i]) << (8 * i);
+
+	for (auto i = 0; i < 16; ++i)
+		block[4 * i + 3] = static_cast<uint8_t>(palette[(indices >> (3 * i)) & 7]);
+}
+
+void TexturePipeline::DecodeBC(BufferFormat format, const uint8_t *src, int width, int height, uint8_t *rgba)
+{
+	const auto bc3 = format == BufferFormat::BC3;
+	uint8_t block[64];
+
+	for (auto by = 0; by < height; by += 4)
+	{
+		for (auto bx = 0; bx < width; bx += 4, src += bc3 ? 16 : 8)
+		{
+			if (bc3)
+			{
+				DecodeColorBlock(src + 8, false, block);
+				DecodeAlphaBlock(src, block);
+			}
+			else
+			{
+				DecodeColorBlock(src, true, block);
+			}
+
+			// Edge blocks only keep the texels inside the texture
+			for (auto y = 0; y < std::min(4, height - by); ++y)
+			{
+				memcpy(rgba + (static_cast<size_t>(by + y) * width + bx) * 4, block + 16 * y,
+					4 * std::min(4, width - bx));
+			}
+		}
+	}
+}
+
+std::shared_ptr<const TexturePipeline::Texture> TexturePipeline::Process(const uint8_t *rgba, int width, int height,
+	bool mips, ETextureCompression compression)
+{
+	const auto size = static_cast<size_t>(width) * height * 4;
+
+	// The settings are part of the key
+	const uint64_t settings[] = {static_cast<uint64_t>(width) << 32 | static_cast<uint32_t>(height),
+		static_cast<uint64_t>(mips) << 8 | static_cast<uint64_t>(compression)};
+
+	const auto key = HashBytes(rgba, size, HashBytes(reinterpret_cast<const uint8_t *>(settings), sizeof(settings)));
+
+	const auto matches = [&](const CacheEntry &entry) {
+		return memcmp(entry.settings, settings, sizeof(settings)) == 0 && entry.source.size() == size &&
+			memcmp(entry.source.data(), rgba, size) == 0;
+	};
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		const auto it = m_cache.find(key);
+		if (it != m_cache.end() && matches(it->second))
+		{
+			m_hits.fetch_add(1, std::memory_order_relaxed);
+			return it->second.texture;
+		}
+	}
+
+	m_misses.fetch_add(1, std::memory_order_relaxed);
+
+	// Built outside the lock, RenderMany workers process their textures in parallel
+	auto texture = std::make_shared<Texture>();
+	texture->width = width;
+	texture->height = height;
+	texture->format = BufferFormat::RGBA8;
+
+	if (compression == ETextureCompression::BC)
+	{
+		texture->format = BufferFormat::BC1;
+		for (size_t texel = 0; texel < size; texel += 4)
+		{
+			if (rgba[texel + 3] != 255)
+			{
+				texture->format = BufferFormat::BC3;
+				break;
+			}
+		}
+	}
+
+	// Down to 1x1
+	texture->levels = 1;
+	if (mips)
+	{
+		for (auto extent = std::max(width, height); extent > 1; extent /= 2)
+			++texture->levels;
+	}
+
+	size_t total = 0;
+	for (auto level = 0; level < texture->levels; ++level)
+		total += LevelSize(texture->format, std::max(width >> level, 1), std::max(height >> level, 1));
+
+	texture->data.resize(total);
+
+	std::vector<uint8_t> scratch[2];
+	const uint8_t *source = rgba;
+	auto out = texture->data.data();
+	auto level_width = width;
+	auto level_height = height;
+
+	for (auto level = 0; level < texture->levels; ++level)
+	{
+		switch (texture->format)
+		{
+		case BufferFormat::BC1:
+			EncodeBC1(source, level_width, level_height, out);
+			break;
+		case BufferFormat::BC3:
+			EncodeBC3(source, level_width, level_height, out);
+			break;
+		default:
+			memcpy(out, source, static_cast<size_t>(level_width) * level_height * 4);
+			break;
+		}
+
+		out += LevelSize(texture->format, level_width, level_height);
+
+		if (level + 1 == texture->levels)
+			break;
+
+		// Each level from the one before, not the one being read
+		auto &next = scratch[level % 2];
+		next.resize(static_cast<size_t>(std::max(level_width / 2, 1)) * std::max(level_height / 2, 1) * 4);
+		Downsample(source, level_width, level_height, next.data());
+
+		source = next.data();
+		level_width = std::max(level_width / 2, 1);
+		level_height = std::max(level_height / 2, 1);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Another thread may have built the same texture meanwhile, the first one in is kept. A different
+	// texture colliding on the key keeps its entry and this one goes uncached
+	const auto it = m_cache.find(key);
+	if (it != m_cache.end())
+		return matches(it->second) ? it->second.texture : texture;
+
+	auto &entry = m_cache[key];
+	entry.texture = texture;
+	memcpy(entry.settings, settings, sizeof(settings));
+	entry.source.assign(rgba, rgba + size);
+
+	m_order.push_back(key);
+	m_cache_bytes += texture->data.size() + size;
+
+	// Trees keep the textures they were given, eviction only drops the cache's reference
+	while (m_cache_bytes > CacheBytes && m_order.size() > 1)
+	{
+		const auto oldest = m_cache.find(m_order.front());
+		m_cache_bytes -= oldest->second.texture->data.size() + oldest->second.source.size();
+		m_cache.erase(oldest);
+		m_order.pop_front();
+	}
+
+	return texture;
+}
+
+bool TextureAtlas::Place(Page &page, int width, int height, Rect &rect)
+{
+	// Released slots first, the whole slot is kept so it goes back as it came
+	for (auto slot = page.free.begin(); slot != page.free.end(); ++slot)
+	{
+		if (slot->width >= width && slot->height >= height)
+		{
+			rect = *slot;
+			page.free.erase(slot);
+			return true;
+		}
+	}
+
+	// Skyline bottom left, the lowest resting height wins, then the leftmost
+	auto &skyline = page.skyline;
+	auto best = skyline.size();
+	auto best_y = PageSize;
+
+	for (size_t i = 0; i < skyline.size() && skyline[i].x + width <= PageSize; ++i)
+	{
+		auto y = 0;
+		auto j = i;
+		for (auto covered = 0; covered < width; covered += skyline[j++].width)
+			y = std::max(y, skyline[j].y);
+
+		if (y + height <= PageSize && y < best_y)
+		{
+			best = i;
+			best_y = y;
+		}
+	}
+
+	if (best == skyline.size())
+		return false;
+
+	rect = {skyline[best].x, best_y, width, height};
+
+	// The new segment replaces the ones under it, one partly under it is shortened
+	const auto right = rect.x + width;
+	while (best < skyline.size() && skyline[best].x < right)
+	{
+		auto &segment = skyline[best];
+		if (segment.x + segment.width <= right)
+		{
+			skyline.erase(skyline.begin() + best);
+			continue;
+		}
+
+		segment.width -= right - segment.x;
+		segment.x = right;
 		break;
-	case BufferFormat::RGBA8:
-		format = GL_UNSIGNED_BYTE;
-		type = GL_RGBA;
+	}
+
+	skyline.insert(skyline.begin() + best, Segment{rect.x, best_y + height, width});
+
+	for (size_t i = 0; i + 1 < skyline.size();)
+	{
+		if (skyline[i].y == skyline[i + 1].y)
+		{
+			skyline[i].width += skyline[i + 1].width;
+			skyline.erase(skyline.begin() + i + 1);
+		}
+		else
+			++i;
+	}
+
+	return true;
+}
+
+bool TextureAtlas::Insert(Pal &pal, PalCounters &counters, const std::shared_ptr<const TexturePipeline::Texture> &texture,
+	Allocation &allocation)
+{
+	// Mips would bleed across neighbours, those and large textures keep their own
+	if (texture->levels != 1 || texture->width > MaxSize || texture->height > MaxSize)
+		return false;
+
+	auto entry = m_entries.find(texture.get());
+	if (entry == m_entries.end())
+	{
+		// Slots start on block boundaries so compressed textures can be written in place
+		const auto compressed = texture->format == BufferFormat::BC1 || texture->format == BufferFormat::BC3;
+		const auto width = (texture->width + 3) & ~3;
+		const auto height = (texture->height + 3) & ~3;
+
+		Rect rect{};
+		auto page = m_pages.size();
+
+		for (size_t i = 0; i < m_pages.size(); ++i)
+		{
+			if (m_pages[i].format == texture->format && Place(m_pages[i], width, height, rect))
+			{
+				page = i;
+				break;
+			}
+		}
+
+		if (page == m_pages.size())
+		{
+			const BufferDescriptor desc{BufferType::Texture2D, texture->format, PageSize, PageSize};
+			const auto id = pal.CreateTexture(desc, 0, nullptr);
+			if (id == -1)
+				return false;
+
+			counters.Create(TexturePipeline::LevelSize(texture->format, PageSize, PageSize));
+
+			m_pages.push_back({id, texture->format, {{0, 0, PageSize}}});
+			Place(m_pages.back(), width, height, rect);
+		}
+
+		pal.UpdateTextureRegion(m_pages[page].id, texture->format, rect.x, rect.y,
+			compressed ? width : texture->width, compressed ? height : texture->height, texture->data.data());
+		counters.Update(texture->data.size());
+
+		++m_pages[page].live;
+		entry = m_entries.emplace(texture.get(), Entry{texture, page, rect, 0}).first;
+	}
+
+	++entry->second.refs;
+
+	// Texel centres at the edges, filtering never reaches into a neighbour
+	const auto &rect = entry->second.rect;
+	const auto scale = 1.0f / PageSize;
+
+	allocation.page_id = m_pages[entry->second.page].id;
+	allocation.uv_transform[0] = (texture->width - 1) * scale;
+	allocation.uv_transform[1] = (texture->height - 1) * scale;
+	allocation.uv_transform[2] = (rect.x + 0.5f) * scale;
+	allocation.uv_transform[3] = (rect.y + 0.5f) * scale;
+	allocation.texture = texture.get();
+
+	return true;
+}
+
+void TextureAtlas::Release(const Allocation &allocation)
+{
+	const auto entry = m_entries.find(allocation.texture);
+	if (entry == m_entries.end() || --entry->second.refs != 0)
+		return;
+
+	auto &page = m_pages[entry->second.page];
+	page.free.push_back(entry->second.rect);
+
+	// An empty page starts over, its free list would only fragment it
+	if (--page.live == 0)
+	{
+		page.skyline = {{0, 0, PageSize}};
+		page.free.clear();
+	}
+
+	m_entries.erase(entry);
+}
+
+bool TextureAtlas::IsPage(ObjectID texture_id) const
+{
+	return std::any_of(m_pages.begin(), m_pages.end(), [texture_id](const Page &page) { return page.id == texture_id; });
+}
+
+ObjectID Pal::CreateVertexLayout(const VertexLayout &layout)
+{
+	for (size_t i = 0; i < m_vertex_layouts.size(); ++i)
+	{
+		if (m_vertex_layouts[i] == layout)
+			return static_cast<ObjectID>(i);
+	}
+
+	m_vertex_layouts.push_back(layout);
+	return m_vertex_layouts.size() - 1;
+}
+
+const VertexLayout *Pal::VertexLayoutAt(ObjectID layout_id) const
+{
+	if (layout_id < 0 || layout_id >= static_cast<ObjectID>(m_vertex_layouts.size()))
+		return nullptr;
+
+	return &m_vertex_layouts[layout_id];
+}
+
+#ifdef _WIN32
+
+#ifdef RLT_RIVE
+
+struct PalD3D11::VectorState
+{
+	// Paths and paints are keyed by content, so unchanged commands keep their rive objects across updates
+	struct Buffer
+	{
+		VectorObjectCache<rcp<RenderPath>> paths;
+		VectorObjectCache<rcp<RenderPaint>> paints;
+		std::vector<std::pair<RenderPath *, RenderPaint *>> draws;
+
+		// Target for slot != -1, created on first draw
+		ID3D11Texture2D *texture = nullptr;
+		ID3D11ShaderResourceView *srv = nullptr;
+	};
+
+	typedef decltype(std::declval<PLSRenderContextD3DImpl &>().makeRenderTarget(0, 0)) RenderTarget;
+
+	std::unique_ptr<PLSRenderer> renderer;
+	HandlePool<Buffer> buffers{HandleType::Vector};
+
+	// Pooled by size, a render target only borrows its texture for the frame
+	std::map<std::pair<int, int>, RenderTarget> render_targets;
+};
+
+#endif
+
+PalD3D11::PalD3D11(ID3D11Device *device, ID3D11DeviceContext *context) :
+	m_device(device), m_device_context(context), m_swapchain(nullptr)
+{
+}
+
+PalD3D11::PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context, IDXGISwapChain* swapchain) :
+	m_device(device), m_device_context(context), m_swapchain(swapchain)
+{
+#ifdef RLT_RIVE
+	PLSRenderContextD3DImpl::ContextOptions contextOptions{};
+
+	m_plsContext = PLSRenderContextD3DImpl::MakeContext(m_device, m_device_context, contextOptions);
+	m_vector_state = std::make_unique<VectorState>();
+	m_vector_state->renderer = std::make_unique<PLSRenderer>(m_plsContext.get());
+#endif
+}
+
+PalD3D11::~PalD3D11() {};
+
+ObjectID PalD3D11::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalD3D11::CreateBuffer");
+
+	D3D11_BUFFER_DESC vbd = {};
+	vbd.Usage = D3D11_USAGE_IMMUTABLE;
+	vbd.ByteWidth = length;
+	vbd.CPUAccessFlags = 0;
+	vbd.MiscFlags = 0;
+	D3D11_SUBRESOURCE_DATA vinitData;
+	vinitData.pSysMem = data;
+
+	// Without data the buffer is filled later through UpdateBufferRange
+	if (data == nullptr)
+		vbd.Usage = D3D11_USAGE_DEFAULT;
+
+	switch (desc.Type())
+	{
+	case BufferType::Vertex:
+		vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		break;
+	case BufferType::Index:
+		vbd.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		break;
+	case BufferType::Texture2D:
+		exit_with_error("Texture2D not supported in D3D11 Buffers", nullptr, nullptr);
+		break;
+	case BufferType::DynamicMaterial:
+		vbd.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		vbd.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		vbd.Usage = D3D11_USAGE_DYNAMIC;
+		break;
+	}
+
+	ID3D11Buffer *buffer = nullptr;
+	if (m_device->CreateBuffer(&vbd, data != nullptr ? &vinitData : nullptr, &buffer) != 0)
+		return -1;
+
+	return m_buffers.Insert(buffer);
+}
+
+ObjectID PalD3D11::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalD3D11::CreateTexture");
+
+	DXGI_FORMAT format{};
+
+	switch (desc.Format())
+	{
+	case BufferFormat::Unknown:
+	case BufferFormat::Custom:
+	case BufferFormat::CustomVertex:
+	case BufferFormat::Index16:
+	case BufferFormat::Index32:
+	default:
+		return -1;
+	case BufferFormat::R8:
+		format = DXGI_FORMAT_R8_UNORM;
+		break;
+	case BufferFormat::RG8:
+		format = DXGI_FORMAT_R8G8_UNORM;
+		break;
+	case BufferFormat::RGB8:
+		format = DXGI_FORMAT_R8G8B8A8_UNORM; // legacy, rows are still read at 3 bytes per texel
+		break;
+	case BufferFormat::RGBA8:
+		format = DXGI_FORMAT_R8G8B8A8_UNORM;
 		break;
 	case BufferFormat::R16F:
-		format = GL_HALF_FLOAT;
-		type = GL_RED;
+		format = DXGI_FORMAT_R16_FLOAT;
 		break;
 	case BufferFormat::RG16F:
-		format = GL_HALF_FLOAT;
-		type = GL_RG;
+		format = DXGI_FORMAT_R16G16_FLOAT;
 		break;
 	case BufferFormat::RGB16F:
-		format = GL_HALF_FLOAT;
-		type = GL_RGB;
+		format = DXGI_FORMAT_R16G16B16A16_FLOAT; // legacy
 		break;
 	case BufferFormat::RGBA16F:
-		format = GL_HALF_FLOAT;
-		type = GL_RGBA;
+		format = DXGI_FORMAT_R16G16B16A16_FLOAT;
 		break;
 	case BufferFormat::R32F:
-		format = GL_FLOAT;
-		type = GL_RED;
+		format = DXGI_FORMAT_R32_FLOAT;
 		break;
 	case BufferFormat::RG32F:
-		format = GL_FLOAT;
-		type = GL_RG;
+		format = DXGI_FORMAT_R32G32_FLOAT;
 		break;
 	case BufferFormat::RGB32F:
-		format = GL_FLOAT;
-		type = GL_RGB;
+		format = DXGI_FORMAT_R32G32B32_FLOAT;
 		break;
 	case BufferFormat::RGBA32F:
-		format = GL_FLOAT;
-		type = GL_RGBA;
+		format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+		break;
+	case BufferFormat::BC1:
+		format = DXGI_FORMAT_BC1_UNORM;
+		break;
+	case BufferFormat::BC3:
+		format = DXGI_FORMAT_BC3_UNORM;
+		break;
+	}
+
+	const auto levels = std::max(desc.Levels(), 1);
+	const auto compressed = desc.Format() == BufferFormat::BC1 || desc.Format() == BufferFormat::BC3;
+
+	// Copy into a texture.
+	D3D11_TEXTURE2D_DESC texDesc;
+	texDesc.Width = desc.Width();
+	texDesc.Height = desc.Height();
+	texDesc.MipLevels = levels;
+	texDesc.ArraySize = 1;
+	texDesc.Format = format;
+	texDesc.SampleDesc.Count = 1;
+	texDesc.SampleDesc.Quality = 0;
+	texDesc.Usage = data != nullptr ? D3D11_USAGE_IMMUTABLE : D3D11_USAGE_DEFAULT; // filled by UpdateTextureRegion
+	texDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+	texDesc.CPUAccessFlags = 0;
+	texDesc.MiscFlags = 0;
+
+	// One subresource per level, packed back to back, rows of blocks for compressed formats
+	// Without data the levels are left for UpdateTextureRegion
+	std::vector<D3D11_SUBRESOURCE_DATA> subs;
+
+	if (data != nullptr)
+	{
+		subs.resize(levels);
+		size_t offset = 0;
+
+		for (auto level = 0; level < levels; ++level)
+		{
+			const auto width = std::max(desc.Width() >> level, 1);
+			const auto height = std::max(desc.Height() >> level, 1);
+			const auto size = TexturePipeline::LevelSize(desc.Format(), width, height);
+
+			if (offset + size > static_cast<size_t>(std::max(length, 0)))
+				return -1;
+
+			subs[level].pSysMem = data + offset;
+			subs[level].SysMemPitch = static_cast<UINT>(size / (compressed ? (height + 3) / 4 : height));
+			subs[level].SysMemSlicePitch = 0; // no array support yet
+
+			offset += size;
+		}
+	}
+
+	Texture texture{};
+	if (m_device->CreateTexture2D(&texDesc, data != nullptr ? subs.data() : nullptr, &texture.texture))
+		return -1;
+
+	if (m_device->CreateShaderResourceView(texture.texture, nullptr, &texture.view))
+	{
+		texture.texture->Release();
+		return -1;
+	}
+
+	return m_textures.Insert(texture);
+}
+
+void PalD3D11::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalD3D11::UpdateBuffer");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr)
+		return;
+
+	D3D11_MAPPED_SUBRESOURCE mappedResource;
+	ZeroMemory(&mappedResource, sizeof(D3D11_MAPPED_SUBRESOURCE));
+
+	m_device_context->Map(*buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedResource);
+	memcpy(mappedResource.pData, data, length);
+	m_device_context->Unmap(*buffer, 0);
+}
+
+void PalD3D11::UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalD3D11::UpdateBufferRange");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr)
+		return;
+
+	const D3D11_BOX box{static_cast<UINT>(offset), 0, 0, static_cast<UINT>(offset + length), 1, 1};
+	m_device_context->UpdateSubresource(*buffer, 0, &box, data, 0, 0);
+}
+
+void PalD3D11::UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+	const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalD3D11::UpdateTextureRegion");
+
+	const auto texture = m_textures.Get(texture_id);
+	if (texture == nullptr)
+		return;
+
+	const auto compressed = format == BufferFormat::BC1 || format == BufferFormat::BC3;
+	const auto pitch = TexturePipeline::LevelSize(format, width, compressed ? 4 : 1);
+
+	const D3D11_BOX box{static_cast<UINT>(x), static_cast<UINT>(y), 0,
+		static_cast<UINT>(x + width), static_cast<UINT>(y + height), 1};
+	m_device_context->UpdateSubresource(texture->texture, 0, &box, data, static_cast<UINT>(pitch), 0);
+}
+
+void PalD3D11::DeleteBuffer(ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalD3D11::DeleteBuffer");
+
+	switch (HandlePool<ID3D11Buffer*>::TypeOf(buffer_id))
+	{
+	case HandleType::Buffer:
+		if (const auto buffer = m_buffers.Get(buffer_id))
+		{
+			(*buffer)->Release();
+			m_buffers.Erase(buffer_id);
+		}
+		break;
+	case HandleType::Texture:
+		if (const auto texture = m_textures.Get(buffer_id))
+		{
+			texture->view->Release();
+			texture->texture->Release();
+			m_textures.Erase(buffer_id);
+		}
+		break;
+	case HandleType::Vector:
+#ifdef RLT_RIVE
+		if (m_vector_state == nullptr)
+			break;
+
+		if (const auto vector = m_vector_state->buffers.Get(buffer_id))
+		{
+			SAFE_RELEASE(vector->srv);
+			SAFE_RELEASE(vector->texture);
+			m_vector_state->buffers.Erase(buffer_id);
+		}
+#endif
 		break;
 	default:
+		break;
+	}
+}
+
+ObjectID PalD3D11::CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	RLT_TRACE_SCOPE("PalD3D11::CreateVector");
+
+#ifdef RLT_RIVE
+	if (m_vector_state == nullptr)
 		return -1;
+
+	const auto buffer_id = m_vector_state->buffers.Insert({});
+	BuildVector(buffer_id, commands, diff);
+
+	return buffer_id;
+#else
+	return -1;
+#endif
+}
+
+ObjectID PalD3D11::UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalD3D11::UpdateVector");
+
+#ifdef RLT_RIVE
+	if (m_vector_state == nullptr || m_vector_state->buffers.Get(buffer_id) == nullptr)
+		return -1;
+
+	BuildVector(buffer_id, commands, diff);
+	return buffer_id;
+#else
+	return -1;
+#endif
+}
+
+#ifdef RLT_RIVE
+
+void PalD3D11::BuildVector(ObjectID buffer_id, const VectorLoader::CommandList &vector, const VectorDiff &diff)
+{
+	const auto &changes = diff.Changes();
+	if (changes.changed.empty() && !changes.resized)
+		return;
+
+	rive::Factory *factory = m_plsContext.get();
+
+	auto &cache = *m_vector_state->buffers.Get(buffer_id);
+
+	cache.draws.resize(vector.Size());
+
+	// Unchanged commands hit the cache, which also keeps their entries alive through the sweep
+	for (size_t c = 0; c < vector.Size(); ++c)
+	{
+		const auto &raw_paint = vector.paints[c];
+		const auto &span = vector.commands[c];
+
+		const auto paint_key = diff.PaintHash(c);
+		auto *paint = cache.paints.Find(paint_key);
+
+		if (paint == nullptr)
+		{
+			auto render_paint = factory->makeRenderPaint();
+
+			//render_paint->blendMode(static_cast<BlendMode>(raw_paint.blendMode));
+			render_paint->join(static_cast<StrokeJoin>(raw_paint.join));
+			render_paint->cap(static_cast<StrokeCap>(raw_paint.cap));
+			render_paint->style(static_cast<RenderPaintStyle>(raw_paint.style));
+			render_paint->thickness(raw_paint.thickness);
+			render_paint->color(raw_paint.color);
+
+			paint = cache.paints.Insert(paint_key, std::move(render_paint));
+		}
+
+		const auto path_key = diff.PathHash(c);
+		auto *path = cache.paths.Find(path_key);
+
+		if (path == nullptr)
+		{
+			RawPath rp{};
+			const auto *points = vector.points.data() + span.first_point;
+
+			for (auto v = span.first_verb; v < span.first_verb + span.verb_count; ++v)
+			{
+				const auto type = vector.verbs[v];
+
+				switch (type)
+				{
+				case VectorLoader::EPathType::Move:
+					rp.moveTo(points[0].x, points[0].y);
+					break;
+				case VectorLoader::EPathType::Line:
+					rp.lineTo(points[0].x, points[0].y);
+					break;
+				case VectorLoader::EPathType::Quad:
+					rp.quadTo(points[0].x, points[0].y, points[1].x, points[1].y);
+					break;
+				case VectorLoader::EPathType::Cubic:
+					rp.cubicTo(points[0].x, points[0].y, points[1].x, points[1].y, points[2].x, points[2].y);
+					break;
+				case VectorLoader::EPathType::Close:
+					rp.close();
+					break;
+				}
+
+				points += VectorLoader::PointCount(type);
+			}
+
+			path = cache.paths.Insert(path_key, factory->makeRenderPath(rp, FillRule::nonZero));
+		}
+
+		cache.draws[c] = {path->get(), paint->get()};
+	}
+
+	cache.paths.Sweep();
+	cache.paints.Sweep();
+}
+
+#endif
+
+void PalD3D11::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalD3D11::DrawTriangleList");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr)
+		return;
+
+	ID3D11Buffer *const buffers[] = {*buffer, nullptr};
+	const UINT strides[] = {stride, 0};
+	const UINT offsets[] = {0, 0};
+
+	m_device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	m_device_context->IASetVertexBuffers(0, 2, buffers, strides, offsets);
+	m_device_context->Draw(length, offset);
+}
+
+void PalD3D11::DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+	ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalD3D11::DrawTriangleListInstanced");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	const auto instances = m_buffers.Get(instance_buffer_id);
+	if (buffer == nullptr || instances == nullptr)
+		return;
+
+	// The host's input layout reads the transforms per instance from slot 1
+	ID3D11Buffer *const buffers[] = {*buffer, *instances};
+	const UINT strides[] = {stride, 16 * sizeof(float)};
+	const UINT offsets[] = {0, 0};
+
+	m_device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	m_device_context->IASetVertexBuffers(0, 2, buffers, strides, offsets);
+	m_device_context->DrawInstanced(length, instance_count, offset, 0);
+}
+
+void PalD3D11::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length,
+	unsigned int stride, ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalD3D11::DrawTriangleListMultiBuffer");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	const auto material = m_buffers.Get(material_buffer_id);
+	if (buffer == nullptr || material == nullptr)
+		return;
+
+	ID3D11Buffer* const buffers[] = {*buffer, *material};
+	const UINT strides[] = {stride, material_stride};
+	const UINT offsets[] = {static_cast<UINT>(offset * stride), 0};
+
+	m_device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	m_device_context->IASetVertexBuffers(0, 2, buffers, strides, offsets);
+	m_device_context->Draw(length, 0);
+}
+
+void PalD3D11::BindTexture(ObjectID texture_id, int slot)
+{
+	RLT_TRACE_SCOPE("PalD3D11::BindTexture");
+
+	if (const auto texture = m_textures.Get(texture_id))
+		m_device_context->PSSetShaderResources(slot, 1, &texture->view);
+}
+
+void PalD3D11::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+{
+	RLT_TRACE_SCOPE("PalD3D11::DrawVector");
+
+#if defined(RLT_RIVE)
+	if (m_vector_state == nullptr)
+		return;
+
+	auto *vector = m_vector_state->buffers.Get(buffer_id);
+	if (vector == nullptr)
+		return;
+
+	{
+		D3D11SavedState savedState(m_device_context);
+
+		auto plsContextImpl = m_plsContext->static_impl_cast<PLSRenderContextD3DImpl>();
+
+		auto &renderTarget = m_vector_state->render_targets[{width, height}];
+		if (renderTarget == nullptr)
+		{
+			renderTarget = plsContextImpl->makeRenderTarget(width, height);
+		}
+
+		if (slot != -1 && vector->texture == nullptr)
+		{
+			D3D11_TEXTURE2D_DESC CoordinateTexDesc = {
+				static_cast<UINT>(width), // UINT Width;
+				static_cast<UINT>(height), // UINT Height;
+				1, // UINT MipLevels;
+				1, // UINT ArraySize;
+				DXGI_FORMAT_R8G8B8A8_UNORM, // DXGI_FORMAT Format;
+				{1, 0}, // DXGI_SAMPLE_DESC SampleDesc;
+				D3D11_USAGE_DEFAULT, // D3D11_USAGE Usage;
+				D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET, // UINT BindFlags;
+				0, // UINT CPUAccessFlags;
+				0, // UINT MiscFlags;
+			};
+
+			m_device->CreateTexture2D(&CoordinateTexDesc, NULL, &vector->texture);
+			m_device->CreateShaderResourceView(vector->texture, NULL, &vector->srv);
+		}
+
+		m_plsContext->beginFrame({
+			.renderTargetWidth = static_cast<uint32_t>(width),
+			.renderTargetHeight = static_cast<uint32_t>(height),
+			.clearColor = 0xFF000000,
+			.msaaSampleCount = 0,
+			.disableRasterOrdering = false,
+			.wireframe = false,
+			.fillsDisabled = false,
+			.strokesDisabled = false,
+		});
+
+		ID3D11Texture2D *frameBuffer = nullptr;
+
+		if (slot == -1)
+		{
+			m_swapchain->GetBuffer(0, __uuidof(ID3D11Texture2D), reinterpret_cast<void **>(&frameBuffer));
+
+			renderTarget->setTargetTexture(frameBuffer);
+		}
+		else
+		{
+			renderTarget->setTargetTexture(vector->texture);
+		}
+
+		for (const auto &[path, paint] : vector->draws)
+		{
+			m_vector_state->renderer->drawPath(path, paint);
+		}
+
+		m_plsContext->flush({.renderTarget = renderTarget.get()});
+
+		// GetBuffer adds a reference
+		SAFE_RELEASE(frameBuffer);
+	}
+	if (slot != -1)
+		m_device_context->PSSetShaderResources(slot, 1, &vector->srv);
+#endif
+}
+
+#endif
+
+void GLStateCache::BindVertexArray(GLuint vao)
+{
+	if (Changed(m_vao, vao))
+		glBindVertexArray(vao);
+}
+
+void GLStateCache::BindArrayBuffer(GLuint vbo)
+{
+	if (Changed(m_array_buffer, vbo))
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+}
+
+void GLStateCache::UseProgram(GLuint program)
+{
+	if (Changed(m_program, program))
+		glUseProgram(program);
+}
+
+void GLStateCache::ActiveTexture(int unit)
+{
+	if (Changed(m_active_unit, unit))
+		glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLStateCache::BindTexture2D(GLuint texture)
+{
+	// Units past the shadowed range are always sent
+	if (m_active_unit >= TextureUnits)
+	{
+		++m_stats.issued;
+		glBindTexture(GL_TEXTURE_2D, texture);
+		return;
+	}
+
+	if (Changed(m_textures[m_active_unit], texture))
+		glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void GLStateCache::DeleteVertexArray(GLuint vao)
+{
+	if (m_vao == vao)
+		m_vao = 0;
+
+	glDeleteVertexArrays(1, &vao);
+}
+
+void GLStateCache::DeleteArrayBuffer(GLuint vbo)
+{
+	if (m_array_buffer == vbo)
+		m_array_buffer = 0;
+
+	glDeleteBuffers(1, &vbo);
+}
+
+void GLStateCache::DeleteTexture2D(GLuint texture)
+{
+	for (auto &bound : m_textures)
+	{
+		if (bound == texture)
+			bound = 0;
+	}
+
+	glDeleteTextures(1, &texture);
+}
+
+void GLStateCache::Invalidate()
+{
+	m_vao = Unknown;
+	m_array_buffer = Unknown;
+	m_program = Unknown;
+	m_active_unit = Unknown;
+	std::fill(std::begin(m_textures), std::end(m_textures), Unknown);
+}
+
+void PalOpenGL::BeginFrame()
+{
+	m_state.Invalidate();
+	m_state.ResetStats();
+}
+
+PalStateStats PalOpenGL::GetStateStats()
+{
+	return m_state.Stats();
+}
+
+ObjectID PalOpenGL::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalOpenGL::CreateBuffer");
+
+	// Textures get their own ID type, so they can't collide with buffer IDs
+	if (desc.Type() == BufferType::Texture2D)
+		return CreateTexture(desc, length, data);
+
+	Buffer buffer;
+	glGenBuffers(1, &buffer.vbo);
+	m_state.BindArrayBuffer(buffer.vbo);
+	glBufferData(GL_ARRAY_BUFFER, length, data, GL_STATIC_DRAW);
+
+	// Buffers with a declared layout draw through the layout's VAO
+	if (desc.LayoutID() == -1)
+	{
+		// Both stay bound for attribute setup by the host
+		glGenVertexArrays(1, &buffer.vao);
+		m_state.BindVertexArray(buffer.vao);
+	}
+
+	return m_buffers.Insert(buffer);
+}
+
+ObjectID PalOpenGL::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalOpenGL::CreateTexture");
+
+	GLenum format{};
+	GLenum type{};
+	GLenum compressed{};
+
+	switch (desc.Format())
+	{
+	case BufferFormat::Unknown:
+	case BufferFormat::Custom:
+	case BufferFormat::CustomVertex:
+	case BufferFormat::Index16:
+	case BufferFormat::Index32:
+		return -1;
+	case BufferFormat::R8:
+		format = GL_UNSIGNED_BYTE;
+		type = GL_RED;
+		break;
+	case BufferFormat::RG8:
+		format = GL_UNSIGNED_BYTE;
+		type = GL_RG;
+		break;
+	case BufferFormat::RGB8:
+		format = GL_UNSIGNED_BYTE;
+		type = GL_RGB;
+		break;
+	case BufferFormat::RGBA8:
+		format = GL_UNSIGNED_BYTE;
+		type = GL_RGBA;
+		break;
+	case BufferFormat::R16F:
+		format = GL_HALF_FLOAT;
+		type = GL_RED;
+		break;
+	case BufferFormat::RG16F:
+		format = GL_HALF_FLOAT;
+		type = GL_RG;
+		break;
+	case BufferFormat::RGB16F:
+		format = GL_HALF_FLOAT;
+		type = GL_RGB;
+		break;
+	case BufferFormat::RGBA16F:
+		format = GL_HALF_FLOAT;
+		type = GL_RGBA;
+		break;
+	case BufferFormat::R32F:
+		format = GL_FLOAT;
+		type = GL_RED;
+		break;
+	case BufferFormat::RG32F:
+		format = GL_FLOAT;
+		type = GL_RG;
+		break;
+	case BufferFormat::RGB32F:
+		format = GL_FLOAT;
+		type = GL_RGB;
+		break;
+	case BufferFormat::RGBA32F:
+		format = GL_FLOAT;
+		type = GL_RGBA;
+		break;
+	case BufferFormat::BC1:
+		compressed = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		break;
+	case BufferFormat::BC3:
+		compressed = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		break;
+	default:
+		return -1;
+	}
+
+	// don't (yet) support tex arrays
+	unsigned int texture;
+	glGenTextures(1, &texture);
+	m_state.BindTexture2D(texture);
+
+	// Every level comes with the data, mips are built on the CPU by the texture pipeline
+	const auto levels = std::max(desc.Levels(), 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+	auto level_data = data;
+	for (auto level = 0; level < levels; ++level)
+	{
+		const auto width = std::max(desc.Width() >> level, 1);
+		const auto height = std::max(desc.Height() >> level, 1);
+		const auto size = TexturePipeline::LevelSize(desc.Format(), width, height);
+
+		if (compressed != 0)
+			glCompressedTexImage2D(GL_TEXTURE_2D, level, compressed, width, height, 0, static_cast<GLsizei>(size), level_data);
+		else
+			glTexImage2D(GL_TEXTURE_2D, level, type, width, height, 0, type, format, level_data);
+
+		if (level_data != nullptr)
+			level_data += size;
+	}
+
+	return m_texs.Insert(texture);
+}
+
+void PalOpenGL::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalOpenGL::UpdateBuffer");
+
+	return;
+}
+
+void PalOpenGL::UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalOpenGL::UpdateBufferRange");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr)
+		return;
+
+	m_state.BindArrayBuffer(buffer->vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, offset, length, data);
+}
+
+void PalOpenGL::UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+	const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalOpenGL::UpdateTextureRegion");
+
+	const auto texture = m_texs.Get(texture_id);
+	if (texture == nullptr)
+		return;
+
+	m_state.BindTexture2D(*texture);
+
+	const auto size = static_cast<GLsizei>(TexturePipeline::LevelSize(format, width, height));
+
+	// Only the formats the atlas packs
+	switch (format)
+	{
+	case BufferFormat::RGBA8:
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		break;
+	case BufferFormat::BC1:
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, size, data);
+		break;
+	case BufferFormat::BC3:
+		glCompressedTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, size, data);
+		break;
+	default:
+		break;
+	}
+}
+
+void PalOpenGL::DeleteBuffer(ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::DeleteBuffer");
+
+	switch (HandlePool<Buffer>::TypeOf(buffer_id))
+	{
+	case HandleType::Buffer:
+		if (const auto buffer = m_buffers.Get(buffer_id))
+		{
+			if (buffer->vao != 0)
+				m_state.DeleteVertexArray(buffer->vao);
+
+			// GL names get reused, layout VAOs must not skip setup for a new buffer with this name
+			for (auto &arrays : m_layout_arrays)
+			{
+				if (arrays.vbo == buffer->vbo)
+					arrays.vbo = 0;
+			}
+
+			m_state.DeleteArrayBuffer(buffer->vbo);
+			m_buffers.Erase(buffer_id);
+		}
+		break;
+	case HandleType::Texture:
+		if (const auto texture = m_texs.Get(buffer_id))
+		{
+			m_state.DeleteTexture2D(*texture);
+			m_texs.Erase(buffer_id);
+		}
+		break;
+	case HandleType::Vector:
+		if (const auto vector = m_vectors.Get(buffer_id))
+		{
+			m_state.DeleteVertexArray(vector->vao);
+			m_state.DeleteArrayBuffer(vector->vbo);
+
+			if (vector->fbo != 0)
+			{
+				glDeleteFramebuffers(1, &vector->fbo);
+				glDeleteRenderbuffers(1, &vector->stencil);
+				m_state.DeleteTexture2D(vector->texture);
+			}
+
+			m_vectors.Erase(buffer_id);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+ObjectID PalOpenGL::CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::CreateVector");
+
+	const auto buffer_id = m_vectors.Insert({});
+
+	auto &vector = *m_vectors.Get(buffer_id);
+	glGenBuffers(1, &vector.vbo);
+	glGenVertexArrays(1, &vector.vao);
+
+	m_state.BindVertexArray(vector.vao);
+	m_state.BindArrayBuffer(vector.vbo);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(VectorLoader::Point), nullptr);
+	glEnableVertexAttribArray(0);
+
+	TessellateVector(vector, commands, diff);
+
+	return buffer_id;
+}
+
+ObjectID PalOpenGL::UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::UpdateVector");
+
+	const auto vector = m_vectors.Get(buffer_id);
+	if (vector == nullptr)
+		return -1;
+
+	TessellateVector(*vector, commands, diff);
+	return buffer_id;
+}
+
+void PalOpenGL::TessellateVector(VectorBuffer &vector, const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	const auto &changes = diff.Changes();
+
+	auto relayout = changes.resized;
+	vector.meshes.resize(commands.Size());
+
+	VectorTessellator tessellator;
+
+	for (const auto c : changes.changed)
+	{
+		auto &mesh = vector.meshes[c];
+		const auto previous = mesh.vertices.size();
+
+		mesh.vertices.clear();
+		mesh.draws.clear();
+		tessellator.Append(commands, c, mesh);
+
+		relayout |= mesh.vertices.size() != previous;
+	}
+
+	m_state.BindArrayBuffer(vector.vbo);
+
+	if (relayout)
+	{
+		std::vector<VectorLoader::Point> vertices;
+		vector.base_vertex.resize(vector.meshes.size());
+
+		for (size_t c = 0; c < vector.meshes.size(); ++c)
+		{
+			vector.base_vertex[c] = static_cast<int>(vertices.size());
+			vertices.insert(vertices.end(), vector.meshes[c].vertices.begin(), vector.meshes[c].vertices.end());
+		}
+
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VectorLoader::Point), vertices.data(), GL_DYNAMIC_DRAW);
+	}
+	else
+	{
+		// Same sizes everywhere, patch the changed ranges in place
+		for (const auto c : changes.changed)
+		{
+			const auto &mesh = vector.meshes[c];
+			glBufferSubData(GL_ARRAY_BUFFER, vector.base_vertex[c] * sizeof(VectorLoader::Point),
+				mesh.vertices.size() * sizeof(VectorLoader::Point), mesh.vertices.data());
+		}
+	}
+}
+
+bool PalOpenGL::CreateVectorProgram()
+{
+	if (m_vector_program != 0)
+		return true;
+
+#ifdef __EMSCRIPTEN__
+#define RLT_GLSL_VERSION "#version 300 es\nprecision highp float;\n"
+#else
+#define RLT_GLSL_VERSION "#version 330 core\n"
+#endif
+
+	const char *vertex_source =
+		RLT_GLSL_VERSION
+		"layout(location = 0) in vec2 position;\n"
+		"uniform vec2 viewport;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_Position = vec4(position.x / viewport.x * 2.0 - 1.0, 1.0 - position.y / viewport.y * 2.0, 0.0, 1.0);\n"
+		"}\n";
+
+	const char *fragment_source =
+		RLT_GLSL_VERSION
+		"uniform vec4 color;\n"
+		"out vec4 out_color;\n"
+		"void main()\n"
+		"{\n"
+		"	out_color = color;\n"
+		"}\n";
+
+#undef RLT_GLSL_VERSION
+
+	const auto compile = [](GLenum type, const char *source)
+	{
+		const auto shader = glCreateShader(type);
+		glShaderSource(shader, 1, &source, nullptr);
+		glCompileShader(shader);
+
+		GLint status = 0;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+		if (!status)
+		{
+			glDeleteShader(shader);
+			return 0u;
+		}
+		return shader;
+	};
+
+	const auto vertex = compile(GL_VERTEX_SHADER, vertex_source);
+	const auto fragment = compile(GL_FRAGMENT_SHADER, fragment_source);
+
+	if (vertex != 0 && fragment != 0)
+	{
+		m_vector_program = glCreateProgram();
+		glAttachShader(m_vector_program, vertex);
+		glAttachShader(m_vector_program, fragment);
+		glLinkProgram(m_vector_program);
+
+		GLint status = 0;
+		glGetProgramiv(m_vector_program, GL_LINK_STATUS, &status);
+		if (!status)
+		{
+			glDeleteProgram(m_vector_program);
+			m_vector_program = 0;
+		}
+	}
+
+	glDeleteShader(vertex);
+	glDeleteShader(fragment);
+
+	if (m_vector_program == 0)
+		return false;
+
+	m_vector_viewport = glGetUniformLocation(m_vector_program, "viewport");
+	m_vector_color = glGetUniformLocation(m_vector_program, "color");
+	return true;
+}
+
+// Restores the host's GL state after vector rendering
+class GLSavedState
+{
+public:
+	GLSavedState(GLStateCache &state) : m_state(state)
+	{
+		glGetIntegerv(GL_CURRENT_PROGRAM, &m_program);
+		glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &m_vao);
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &m_framebuffer);
+		glGetIntegerv(GL_RENDERBUFFER_BINDING, &m_renderbuffer);
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &m_texture);
+		glGetIntegerv(GL_VIEWPORT, m_viewport);
+		glGetIntegerv(GL_BLEND_SRC_RGB, &m_blend_src);
+		glGetIntegerv(GL_BLEND_DST_RGB, &m_blend_dst);
+		glGetIntegerv(GL_BLEND_SRC_ALPHA, &m_blend_src_alpha);
+		glGetIntegerv(GL_BLEND_DST_ALPHA, &m_blend_dst_alpha);
+		glGetBooleanv(GL_COLOR_WRITEMASK, m_color_mask);
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, m_clear_color);
+		glGetIntegerv(GL_STENCIL_CLEAR_VALUE, &m_clear_stencil);
+		m_front.Save(GL_STENCIL_FUNC, GL_STENCIL_REF, GL_STENCIL_VALUE_MASK, GL_STENCIL_WRITEMASK, GL_STENCIL_FAIL,
+			GL_STENCIL_PASS_DEPTH_FAIL, GL_STENCIL_PASS_DEPTH_PASS);
+		m_back.Save(GL_STENCIL_BACK_FUNC, GL_STENCIL_BACK_REF, GL_STENCIL_BACK_VALUE_MASK, GL_STENCIL_BACK_WRITEMASK,
+			GL_STENCIL_BACK_FAIL, GL_STENCIL_BACK_PASS_DEPTH_FAIL, GL_STENCIL_BACK_PASS_DEPTH_PASS);
+		m_blend = glIsEnabled(GL_BLEND);
+		m_depth = glIsEnabled(GL_DEPTH_TEST);
+		m_cull = glIsEnabled(GL_CULL_FACE);
+		m_stencil = glIsEnabled(GL_STENCIL_TEST);
+	}
+
+	~GLSavedState()
+	{
+		m_state.UseProgram(m_program);
+		m_state.BindVertexArray(m_vao);
+		m_state.BindTexture2D(m_texture);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_framebuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, m_renderbuffer);
+		glViewport(m_viewport[0], m_viewport[1], m_viewport[2], m_viewport[3]);
+		glBlendFuncSeparate(m_blend_src, m_blend_dst, m_blend_src_alpha, m_blend_dst_alpha);
+		glColorMask(m_color_mask[0], m_color_mask[1], m_color_mask[2], m_color_mask[3]);
+		glClearColor(m_clear_color[0], m_clear_color[1], m_clear_color[2], m_clear_color[3]);
+		glClearStencil(m_clear_stencil);
+		m_front.Restore(GL_FRONT);
+		m_back.Restore(GL_BACK);
+		Enable(GL_BLEND, m_blend);
+		Enable(GL_DEPTH_TEST, m_depth);
+		Enable(GL_CULL_FACE, m_cull);
+		Enable(GL_STENCIL_TEST, m_stencil);
+	}
+
+	// The host's draw framebuffer, which may be its own FBO
+	GLuint Framebuffer() const
+	{
+		return static_cast<GLuint>(m_framebuffer);
+	}
+
+private:
+	struct StencilFace
+	{
+		GLint func = GL_ALWAYS;
+		GLint ref = 0;
+		GLint value_mask = ~0;
+		GLint write_mask = ~0;
+		GLint fail = GL_KEEP;
+		GLint depth_fail = GL_KEEP;
+		GLint pass = GL_KEEP;
+
+		void Save(GLenum func_name, GLenum ref_name, GLenum value_mask_name, GLenum write_mask_name,
+			GLenum fail_name, GLenum depth_fail_name, GLenum pass_name)
+		{
+			glGetIntegerv(func_name, &func);
+			glGetIntegerv(ref_name, &ref);
+			glGetIntegerv(value_mask_name, &value_mask);
+			glGetIntegerv(write_mask_name, &write_mask);
+			glGetIntegerv(fail_name, &fail);
+			glGetIntegerv(depth_fail_name, &depth_fail);
+			glGetIntegerv(pass_name, &pass);
+		}
+
+		void Restore(GLenum face) const
+		{
+			glStencilFuncSeparate(face, func, ref, static_cast<GLuint>(value_mask));
+			glStencilMaskSeparate(face, static_cast<GLuint>(write_mask));
+			glStencilOpSeparate(face, fail, depth_fail, pass);
+		}
+	};
+
+	static void Enable(GLenum cap, GLboolean enabled)
+	{
+		if (enabled)
+			glEnable(cap);
+		else
+			glDisable(cap);
+	}
+
+	GLStateCache &m_state;
+
+	GLint m_program = 0;
+	GLint m_vao = 0;
+	GLint m_framebuffer = 0;
+	GLint m_renderbuffer = 0;
+	GLint m_texture = 0; // on the active unit, the one DrawVector binds to
+	GLint m_viewport[4] = {};
+	GLint m_blend_src = 0;
+	GLint m_blend_dst = 0;
+	GLint m_blend_src_alpha = 0;
+	GLint m_blend_dst_alpha = 0;
+	GLboolean m_color_mask[4] = {GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE};
+	GLfloat m_clear_color[4] = {};
+	GLint m_clear_stencil = 0;
+	StencilFace m_front;
+	StencilFace m_back;
+	GLboolean m_blend = GL_FALSE;
+	GLboolean m_depth = GL_FALSE;
+	GLboolean m_cull = GL_FALSE;
+	GLboolean m_stencil = GL_FALSE;
+};
+
+void PalOpenGL::BindTexture(ObjectID texture_id, int slot)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::BindTexture");
+
+	const auto texture = m_texs.Get(texture_id);
+	if (texture == nullptr)
+		return;
+
+	m_state.ActiveTexture(slot);
+	m_state.BindTexture2D(*texture);
+}
+
+void wander::PalOpenGL::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::DrawVector");
+
+	if (m_vectors.Get(buffer_id) == nullptr || !CreateVectorProgram())
+		return;
+
+	auto &vector = *m_vectors.Get(buffer_id);
+
+	{
+		GLSavedState saved_state(m_state);
+
+		if (slot != -1 && (vector.fbo == 0 || vector.width != width || vector.height != height))
+		{
+			if (vector.fbo == 0)
+			{
+				glGenFramebuffers(1, &vector.fbo);
+				glGenTextures(1, &vector.texture);
+				glGenRenderbuffers(1, &vector.stencil);
+			}
+
+			m_state.BindTexture2D(vector.texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+			glBindRenderbuffer(GL_RENDERBUFFER, vector.stencil);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, vector.fbo);
+			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vector.texture, 0);
+			glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, vector.stencil);
+
+			vector.width = width;
+			vector.height = height;
+		}
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, slot == -1 ? saved_state.Framebuffer() : vector.fbo);
+		glViewport(0, 0, width, height);
+
+		// Same clear as the D3D11 / rive path
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClearStencil(0);
+		glStencilMask(0xFF);
+		glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+		m_state.UseProgram(m_vector_program);
+		glUniform2f(m_vector_viewport, static_cast<float>(width), static_cast<float>(height));
+		m_state.BindVertexArray(vector.vao);
+
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_CULL_FACE);
+		glEnable(GL_STENCIL_TEST);
+		glEnable(GL_BLEND);
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+		for (size_t c = 0; c < vector.meshes.size(); ++c)
+		{
+			const auto base = vector.base_vertex[c];
+
+			for (const auto &draw : vector.meshes[c].draws)
+			{
+				// Paint colors are ARGB
+				glUniform4f(m_vector_color,
+					((draw.color >> 16) & 0xFF) / 255.0f, ((draw.color >> 8) & 0xFF) / 255.0f,
+					(draw.color & 0xFF) / 255.0f, ((draw.color >> 24) & 0xFF) / 255.0f);
+
+				if (draw.stroke)
+				{
+					// Stencil keeps overlapping stroke triangles from blending twice
+					glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+					glStencilFunc(GL_EQUAL, 0, 0xFF);
+					glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+					glDrawArrays(GL_TRIANGLES, base + draw.first, draw.count);
+
+					glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+					glStencilFunc(GL_ALWAYS, 0, 0xFF);
+					glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+					glDrawArrays(GL_TRIANGLES, base + draw.first, draw.count);
+					continue;
+				}
+
+				// Non-zero winding: accumulate fans into the stencil, then cover
+				glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+				glStencilFunc(GL_ALWAYS, 0, 0xFF);
+				glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_KEEP, GL_INCR_WRAP);
+				glStencilOpSeparate(GL_BACK, GL_KEEP, GL_KEEP, GL_DECR_WRAP);
+				glDrawArrays(GL_TRIANGLES, base + draw.first, draw.count);
+
+				glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+				glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+				glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+				glDrawArrays(GL_TRIANGLES, base + draw.cover_first, 6);
+			}
+		}
+	}
+
+	if (slot != -1)
+	{
+		m_state.ActiveTexture(slot);
+		m_state.BindTexture2D(vector.texture);
+	}
+}
+
+void PalOpenGL::BindVertexLayout(ObjectID layout_id, GLuint vbo)
+{
+	if (m_layout_arrays.size() < m_vertex_layouts.size())
+		m_layout_arrays.resize(m_vertex_layouts.size());
+
+	auto &arrays = m_layout_arrays[layout_id];
+	if (arrays.vao == 0)
+		glGenVertexArrays(1, &arrays.vao);
+
+	m_state.BindVertexArray(arrays.vao);
+
+	// Consecutive draws from one (pooled) buffer skip the attribute setup
+	if (arrays.vbo == vbo)
+		return;
+
+	const auto &layout = m_vertex_layouts[layout_id];
+	m_state.BindArrayBuffer(vbo);
+
+	for (const auto &attribute : layout.Attributes())
+	{
+		const auto location = static_cast<GLuint>(attribute.semantic);
+		const auto pointer = reinterpret_cast<const void *>(static_cast<uintptr_t>(attribute.offset));
+
+		if (attribute.format == VertexFormat::UNorm8x4)
+			glVertexAttribPointer(location, 4, GL_UNSIGNED_BYTE, GL_TRUE, layout.Stride(), pointer);
+		else
+			glVertexAttribPointer(location, VertexLayout::Components(attribute.format), GL_FLOAT, GL_FALSE,
+				layout.Stride(), pointer);
+
+		glEnableVertexAttribArray(location);
+	}
+
+	arrays.vbo = vbo;
+}
+
+void PalOpenGL::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::DrawTriangleList");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr)
+		return;
+
+	// Left bound, consecutive nodes usually share a buffer
+	if (layout_id == -1)
+		m_state.BindVertexArray(buffer->vao);
+	else
+		BindVertexLayout(layout_id, buffer->vbo);
+
+	glDrawArrays(GL_TRIANGLES, offset, length);
+}
+
+void PalOpenGL::DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+	ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::DrawTriangleListInstanced");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	const auto instances = m_buffers.Get(instance_buffer_id);
+	if (buffer == nullptr || instances == nullptr)
+		return;
+
+	if (layout_id == -1)
+		m_state.BindVertexArray(buffer->vao);
+	else
+		BindVertexLayout(layout_id, buffer->vbo);
+
+	// One column per attribute, disabled again after so plain draws from the same VAO don't read them
+	m_state.BindArrayBuffer(instances->vbo);
+	for (GLuint column = 0; column < 4; ++column)
+	{
+		const auto location = InstanceTransformLocation + column;
+		glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float),
+			reinterpret_cast<const void *>(column * 4 * sizeof(float)));
+		glVertexAttribDivisor(location, 1);
+		glEnableVertexAttribArray(location);
+	}
+
+	glDrawArraysInstanced(GL_TRIANGLES, offset, length, static_cast<GLsizei>(instance_count));
+
+	for (GLuint column = 0; column < 4; ++column)
+		glDisableVertexAttribArray(InstanceTransformLocation + column);
+}
+
+void PalOpenGL::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length,
+	unsigned int stride, ObjectID material_buffer_id,unsigned int material_stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalOpenGL::DrawTriangleListMultiBuffer");
+
+	DrawTriangleList(buffer_id, offset, length, stride, layout_id);
+}
+
+PalSoftware::PalSoftware(int width, int height, int threads) :
+	m_width(width), m_height(height), m_threads(threads),
+	m_tiles_x((width + TileSize - 1) / TileSize), m_tiles_y((height + TileSize - 1) / TileSize),
+	m_transform{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}, m_uv_transform{1, 1, 0, 0},
+	m_color(static_cast<size_t>(width) * height), m_depth(static_cast<size_t>(width) * height),
+	m_bins(static_cast<size_t>(m_tiles_x) * m_tiles_y)
+{
+	if (m_threads <= 0)
+		m_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	m_threads = std::min(m_threads, m_tiles_x * m_tiles_y);
+	if (m_threads > 1)
+		m_workers = std::make_unique<WorkStealingPool>(m_threads);
+
+	Clear(0xFF000000);
+}
+
+PalSoftware::~PalSoftware() = default;
+
+ObjectID PalSoftware::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalSoftware::CreateBuffer");
+
+	if (data == nullptr)
+		return m_buffers.Insert(std::vector<uint8_t>(length));
+
+	return m_buffers.Insert(std::vector<uint8_t>(data, data + length));
+}
+
+// Bytes per texel of the 8 bit formats, BC blocks are decoded to RGBA8 first; 0 for formats that can't be sampled
+static int texel_channels(BufferFormat format)
+{
+	switch (format)
+	{
+	case BufferFormat::R8:
+		return 1;
+	case BufferFormat::RG8:
+		return 2;
+	case BufferFormat::RGB8:
+		return 3;
+	case BufferFormat::RGBA8:
+	case BufferFormat::BC1:
+	case BufferFormat::BC3:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+// width * height texels of format into RGBA8 rows pitch texels apart, missing channels read as GL does
+static void convert_texels(BufferFormat format, const uint8_t *src, int width, int height, uint32_t *dst, int pitch)
+{
+	const auto channels = texel_channels(format);
+
+	std::vector<uint8_t> decoded;
+	if (format == BufferFormat::BC1 || format == BufferFormat::BC3)
+	{
+		decoded.resize(static_cast<size_t>(width) * height * 4);
+		TexturePipeline::DecodeBC(format, src, width, height, decoded.data());
+		src = decoded.data();
+	}
+
+	for (auto y = 0; y < height; ++y)
+	{
+		for (auto x = 0; x < width; ++x)
+		{
+			const auto texel = src + (static_cast<size_t>(y) * width + x) * channels;
+			const uint8_t rgba[4] = {texel[0], channels > 1 ? texel[1] : uint8_t{0},
+				channels > 2 ? texel[2] : uint8_t{0}, channels > 3 ? texel[3] : uint8_t{255}};
+
+			memcpy(dst + static_cast<size_t>(y) * pitch + x, rgba, sizeof(rgba));
+		}
+	}
+}
+
+ObjectID PalSoftware::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalSoftware::CreateTexture");
+
+	const auto width = desc.Width();
+	const auto height = desc.Height();
+	if (width <= 0 || height <= 0 || texel_channels(desc.Format()) == 0)
+		return -1;
+
+	// Atlas pages come without data and are filled in by UpdateTextureRegion
+	if (data != nullptr && static_cast<size_t>(length) < TexturePipeline::LevelSize(desc.Format(), width, height))
+		return -1;
+
+	Texture texture;
+	texture.width = width;
+	texture.height = height;
+	texture.texels.resize(static_cast<size_t>(width) * height);
+
+	// Only level 0 is sampled, the rest of the chain is skipped
+	if (data != nullptr)
+		convert_texels(desc.Format(), data, width, height, texture.texels.data(), width);
+
+	return m_textures.Insert(std::move(texture));
+}
+
+void PalSoftware::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalSoftware::UpdateBuffer");
+
+	if (const auto buffer = m_buffers.Get(buffer_id))
+		buffer->assign(data, data + length);
+}
+
+void PalSoftware::UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalSoftware::UpdateBufferRange");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer != nullptr && offset >= 0 && length >= 0 && static_cast<size_t>(offset + length) <= buffer->size())
+		memcpy(buffer->data() + offset, data, length);
+}
+
+void PalSoftware::UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+	const uint8_t data[])
+{
+	RLT_TRACE_SCOPE("PalSoftware::UpdateTextureRegion");
+
+	const auto texture = m_textures.Get(texture_id);
+	if (texture == nullptr || texel_channels(format) == 0 || x < 0 || y < 0 || width <= 0 || height <= 0 ||
+		x + width > texture->width || y + height > texture->height)
+		return;
+
+	convert_texels(format, data, width, height, texture->texels.data() + static_cast<size_t>(y) * texture->width + x,
+		texture->width);
+}
+
+void PalSoftware::DeleteBuffer(ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalSoftware::DeleteBuffer");
+
+	if (HandlePool<Texture>::TypeOf(buffer_id) == HandleType::Texture)
+		m_textures.Erase(buffer_id);
+	else
+		m_buffers.Erase(buffer_id);
+}
+
+ObjectID PalSoftware::CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	RLT_TRACE_SCOPE("PalSoftware::CreateVector");
+
+	return -1;
+}
+
+ObjectID PalSoftware::UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id)
+{
+	RLT_TRACE_SCOPE("PalSoftware::UpdateVector");
+
+	return -1;
+}
+
+void PalSoftware::BindTexture(ObjectID texture_id, int slot)
+{
+	RLT_TRACE_SCOPE("PalSoftware::BindTexture");
+
+	// Only slot 0 is sampled, -1 unbinds
+	if (slot == 0)
+		m_texture_id = texture_id;
+}
+
+void PalSoftware::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+{
+	RLT_TRACE_SCOPE("PalSoftware::DrawVector");
+
+	// Vectors aren't supported on the software PAL
+}
+
+void PalSoftware::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalSoftware::DrawTriangleList");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	if (buffer == nullptr || (static_cast<size_t>(offset) + length) * stride > buffer->size())
+		return;
+
+	Rasterize(buffer->data() + static_cast<size_t>(offset) * stride, stride, nullptr, 0, length);
+}
+
+void PalSoftware::DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+	ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalSoftware::DrawTriangleListInstanced");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	const auto instances = m_buffers.Get(instance_buffer_id);
+	if (buffer == nullptr || instances == nullptr || (static_cast<size_t>(offset) + length) * stride > buffer->size() ||
+		static_cast<size_t>(instance_count) * 16 * sizeof(float) > instances->size())
+		return;
+
+	// Triangles are transformed as they are queued, each instance goes in with its own transform
+	float view[16];
+	memcpy(view, m_transform, sizeof(view));
+
+	for (uint32_t instance = 0; instance < instance_count; ++instance)
+	{
+		float model[16];
+		memcpy(model, instances->data() + instance * sizeof(model), sizeof(model));
+
+		for (auto c = 0; c < 4; ++c)
+			for (auto r = 0; r < 4; ++r)
+				m_transform[c * 4 + r] = view[r] * model[c * 4] + view[4 + r] * model[c * 4 + 1] +
+					view[8 + r] * model[c * 4 + 2] + view[12 + r] * model[c * 4 + 3];
+
+		Rasterize(buffer->data() + static_cast<size_t>(offset) * stride, stride, nullptr, 0, length);
+	}
+
+	memcpy(m_transform, view, sizeof(view));
+}
+
+void PalSoftware::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length,
+	unsigned int stride, ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id)
+{
+	RLT_TRACE_SCOPE("PalSoftware::DrawTriangleListMultiBuffer");
+
+	const auto buffer = m_buffers.Get(buffer_id);
+	const auto material = m_buffers.Get(material_buffer_id);
+	if (buffer == nullptr || material == nullptr)
+		return;
+
+	if ((static_cast<size_t>(offset) + length) * stride > buffer->size() ||
+		static_cast<size_t>(length) * material_stride > material->size())
+		return;
+
+	// Material buffer is indexed from the start of the node, same as the D3D11 input assembler setup
+	Rasterize(buffer->data() + static_cast<size_t>(offset) * stride, stride,
+		material->data(), material_stride, length);
+}
+
+void PalSoftware::Clear(uint32_t color, float depth)
+{
+	m_triangles.clear();
+	for (auto& bin : m_bins)
+		bin.clear();
+
+	std::fill(m_color.begin(), m_color.end(), color);
+	std::fill(m_depth.begin(), m_depth.end(), depth);
+}
+
+void PalSoftware::SetTransform(const float transform[16])
+{
+	memcpy(m_transform, transform, sizeof(m_transform));
+}
+
+void PalSoftware::SetUVTransform(const float transform[4])
+{
+	memcpy(m_uv_transform, transform, sizeof(m_uv_transform));
+}
+
+void PalSoftware::ReadPixels(uint8_t rgba[])
+{
+	Flush();
+
+	memcpy(rgba, m_color.data(), m_color.size() * sizeof(uint32_t));
+}
+
+void PalSoftware::Rasterize(const uint8_t* vertices, unsigned int stride,
+	const uint8_t* colors, unsigned int color_stride, int length)
+{
+	constexpr auto TexcoordOffset = 6 * sizeof(float);
+	constexpr auto ColorOffset = 8 * sizeof(float);
+
+	Vertex triangle[3];
+
+	for (auto i = 0; i + 2 < length; i += 3)
+	{
+		for (auto v = 0; v < 3; ++v)
+		{
+			const auto* vertex = vertices + static_cast<size_t>(i + v) * stride;
+			auto& out = triangle[v];
+
+			float position[3];
+			memcpy(position, vertex, sizeof(position));
+
+			for (auto r = 0; r < 4; ++r)
+			{
+				out.clip[r] = m_transform[r] * position[0] + m_transform[4 + r] * position[1] +
+					m_transform[8 + r] * position[2] + m_transform[12 + r];
+			}
+
+			if (colors != nullptr)
+				memcpy(out.color, colors + static_cast<size_t>(i + v) * color_stride, sizeof(out.color));
+			else if (stride >= ColorOffset + sizeof(out.color))
+				memcpy(out.color, vertex + ColorOffset, sizeof(out.color));
+			else
+				out.color[0] = out.color[1] = out.color[2] = 1.0f;
+
+			if (stride >= TexcoordOffset + sizeof(out.uv))
+			{
+				memcpy(out.uv, vertex + TexcoordOffset, sizeof(out.uv));
+				out.uv[0] = out.uv[0] * m_uv_transform[0] + m_uv_transform[2];
+				out.uv[1] = out.uv[1] * m_uv_transform[1] + m_uv_transform[3];
+			}
+			else
+			{
+				out.uv[0] = out.uv[1] = 0.0f;
+			}
+		}
+
+		ClipTriangle(triangle);
+	}
+}
+
+void PalSoftware::ClipTriangle(const Vertex vertices[3])
+{
+	if (vertices[0].clip[3] > NearW && vertices[1].clip[3] > NearW && vertices[2].clip[3] > NearW)
+	{
+		SetupTriangle(vertices);
+		return;
+	}
+
+	// Sutherland-Hodgman against w = NearW, one plane turns the triangle into at most a quad
+	Vertex polygon[4];
+	auto count = 0;
+
+	for (auto i = 0; i < 3; ++i)
+	{
+		const auto& a = vertices[i];
+		const auto& b = vertices[(i + 1) % 3];
+		const auto a_inside = a.clip[3] > NearW;
+		const auto b_inside = b.clip[3] > NearW;
+
+		if (a_inside)
+			polygon[count++] = a;
+
+		if (a_inside != b_inside)
+		{
+			const auto t = (NearW - a.clip[3]) / (b.clip[3] - a.clip[3]);
+			auto& out = polygon[count++];
+
+			for (auto c = 0; c < 4; ++c)
+				out.clip[c] = a.clip[c] + (b.clip[c] - a.clip[c]) * t;
+			for (auto c = 0; c < 3; ++c)
+				out.color[c] = a.color[c] + (b.color[c] - a.color[c]) * t;
+			for (auto c = 0; c < 2; ++c)
+				out.uv[c] = a.uv[c] + (b.uv[c] - a.uv[c]) * t;
+
+			// Exactly on the plane, so the divide in SetupTriangle stays finite
+			out.clip[3] = NearW;
+		}
+	}
+
+	for (auto i = 1; i + 1 < count; ++i)
+	{
+		const Vertex fan[3] = {polygon[0], polygon[i], polygon[i + 1]};
+		SetupTriangle(fan);
+	}
+}
+
+void PalSoftware::SetupTriangle(const Vertex vertices[3])
+{
+	float sx[3], sy[3], sz[3], inv_w[3];
+
+	for (auto i = 0; i < 3; ++i)
+	{
+		const auto& clip = vertices[i].clip;
+
+		inv_w[i] = 1.0f / clip[3];
+		sx[i] = (clip[0] * inv_w[i] * 0.5f + 0.5f) * m_width;
+		sy[i] = (0.5f - clip[1] * inv_w[i] * 0.5f) * m_height;
+		sz[i] = clip[2] * inv_w[i] * 0.5f + 0.5f;
+	}
+
+	const auto area = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+	if (std::fabs(area) < 1e-8f)
+		return;
+
+	Triangle t;
+	t.min_x = std::max(0, static_cast<int>(std::floor(std::min({sx[0], sx[1], sx[2]}))));
+	t.min_y = std::max(0, static_cast<int>(std::floor(std::min({sy[0], sy[1], sy[2]}))));
+	t.max_x = std::min(m_width - 1, static_cast<int>(std::ceil(std::max({sx[0], sx[1], sx[2]}))));
+	t.max_y = std::min(m_height - 1, static_cast<int>(std::ceil(std::max({sy[0], sy[1], sy[2]}))));
+
+	if (t.min_x > t.max_x || t.min_y > t.max_y)
+		return;
+
+	// Normalized edge functions are the barycentric coordinates, so winding doesn't matter
+	const auto inv_area = 1.0f / area;
+	for (auto i = 0; i < 3; ++i)
+	{
+		const auto j = (i + 1) % 3;
+		const auto k = (i + 2) % 3;
+
+		t.edge[i][0] = (sy[j] - sy[k]) * inv_area;
+		t.edge[i][1] = (sx[k] - sx[j]) * inv_area;
+		t.edge[i][2] = (sx[j] * sy[k] - sx[k] * sy[j]) * inv_area;
+	}
+
+	for (auto c = 0; c < 3; ++c)
+	{
+		t.depth[c] = sz[0] * t.edge[0][c] + sz[1] * t.edge[1][c] + sz[2] * t.edge[2][c];
+		t.inv_w[c] = inv_w[0] * t.edge[0][c] + inv_w[1] * t.edge[1][c] + inv_w[2] * t.edge[2][c];
+
+		for (auto channel = 0; channel < 3; ++channel)
+		{
+			t.color[channel][c] = vertices[0].color[channel] * inv_w[0] * t.edge[0][c] +
+				vertices[1].color[channel] * inv_w[1] * t.edge[1][c] +
+				vertices[2].color[channel] * inv_w[2] * t.edge[2][c];
+		}
+
+		for (auto channel = 0; channel < 2; ++channel)
+		{
+			t.uv[channel][c] = vertices[0].uv[channel] * inv_w[0] * t.edge[0][c] +
+				vertices[1].uv[channel] * inv_w[1] * t.edge[1][c] + vertices[2].uv[channel] * inv_w[2] * t.edge[2][c];
+		}
+	}
+
+	t.texture_id = m_texture_id;
+
+	const auto index = static_cast<uint32_t>(m_triangles.size());
+	m_triangles.push_back(t);
+
+	for (auto ty = t.min_y / TileSize; ty <= t.max_y / TileSize; ++ty)
+	{
+		for (auto tx = t.min_x / TileSize; tx <= t.max_x / TileSize; ++tx)
+		{
+			m_bins[ty * m_tiles_x + tx].push_back(index);
+		}
+	}
+}
+
+static float plane(const float p[3], float x, float y)
+{
+	return p[0] * x + p[1] * y + p[2];
+}
+
+static uint32_t pack_unorm(float r, float g, float b)
+{
+	const auto to_byte = [](float v) { return static_cast<uint32_t>(std::min(std::max(v, 0.0f), 1.0f) * 255.0f + 0.5f); };
+
+	return to_byte(r) | (to_byte(g) << 8) | (to_byte(b) << 16) | 0xFF000000u;
+}
+
+void PalSoftware::RasterizeTile(int tile)
+{
+	const auto tile_x0 = (tile % m_tiles_x) * TileSize;
+	const auto tile_y0 = (tile / m_tiles_x) * TileSize;
+	const auto tile_x1 = std::min(tile_x0 + TileSize, m_width) - 1;
+	const auto tile_y1 = std::min(tile_y0 + TileSize, m_height) - 1;
+
+	const Texture* texture = nullptr;
+
+	const auto shade = [this, &texture](const Triangle& t, int x, int y, float z)
+	{
+		const auto index = static_cast<size_t>(y) * m_width + x;
+		if (z < 0.0f || z >= m_depth[index])
+			return;
+
+		const auto px = x + 0.5f;
+		const auto py = y + 0.5f;
+		const auto w = 1.0f / plane(t.inv_w, px, py);
+
+		float rgb[3] = {plane(t.color[0], px, py) * w, plane(t.color[1], px, py) * w, plane(t.color[2], px, py) * w};
+
+		// Nearest texel, wrapping like GL_REPEAT
+		if (texture != nullptr)
+		{
+			const auto u = plane(t.uv[0], px, py) * w;
+			const auto v = plane(t.uv[1], px, py) * w;
+
+			const auto tx = std::min(static_cast<int>((u - std::floor(u)) * texture->width), texture->width - 1);
+			const auto ty = std::min(static_cast<int>((v - std::floor(v)) * texture->height), texture->height - 1);
+
+			const auto texel = texture->texels[static_cast<size_t>(ty) * texture->width + tx];
+			for (auto c = 0; c < 3; ++c)
+				rgb[c] *= ((texel >> (8 * c)) & 0xFF) * (1.0f / 255.0f);
+		}
+
+		m_depth[index] = z;
+		m_color[index] = pack_unorm(rgb[0], rgb[1], rgb[2]);
+	};
+
+	for (const auto triangle : m_bins[tile])
+	{
+		const auto& t = m_triangles[triangle];
+
+		texture = m_textures.Get(t.texture_id);
+		if (texture != nullptr && texture->texels.empty())
+			texture = nullptr;
+
+		const auto x0 = std::max(t.min_x, tile_x0);
+		const auto x1 = std::min(t.max_x, tile_x1);
+		const auto y0 = std::max(t.min_y, tile_y0);
+		const auto y1 = std::min(t.max_y, tile_y1);
+
+#ifdef RLT_SSE2
+		const auto lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+		const auto zero = _mm_setzero_ps();
+
+		const auto edge_plane = [](const float p[3], __m128 x, __m128 y)
+		{
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]), x),
+				_mm_mul_ps(_mm_set1_ps(p[1]), y)), _mm_set1_ps(p[2]));
+		};
+
+		for (auto y = y0; y <= y1; ++y)
+		{
+			const auto py = _mm_set1_ps(y + 0.5f);
+
+			for (auto x = x0; x <= x1; x += 4)
+			{
+				const auto px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), lanes);
+
+				auto inside = _mm_cmpge_ps(edge_plane(t.edge[0], px, py), zero);
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(edge_plane(t.edge[1], px, py), zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(edge_plane(t.edge[2], px, py), zero));
+
+				auto mask = _mm_movemask_ps(inside);
+				if (x1 - x < 3)
+					mask &= (1 << (x1 - x + 1)) - 1;
+
+				if (mask == 0)
+					continue;
+
+				alignas(16) float depth[4];
+				_mm_store_ps(depth, edge_plane(t.depth, px, py));
+
+				for (auto lane = 0; lane < 4; ++lane)
+				{
+					if (mask & (1 << lane))
+						shade(t, x + lane, y, depth[lane]);
+				}
+			}
+		}
+#else
+		for (auto y = y0; y <= y1; ++y)
+		{
+			const auto py = y + 0.5f;
+
+			for (auto x = x0; x <= x1; ++x)
+			{
+				const auto px = x + 0.5f;
+
+				if (plane(t.edge[0], px, py) < 0.0f || plane(t.edge[1], px, py) < 0.0f ||
+					plane(t.edge[2], px, py) < 0.0f)
+					continue;
+
+				shade(t, x, y, plane(t.depth, px, py));
+			}
+		}
+#endif
+	}
+}
+
+void PalSoftware::Flush()
+{
+	if (m_triangles.empty())
+		return;
+
+	m_busy_tiles.clear();
+	for (auto tile = 0; tile < m_tiles_x * m_tiles_y; ++tile)
+	{
+		if (!m_bins[tile].empty())
+			m_busy_tiles.push_back(tile);
+	}
+
+	// Tiles own disjoint pixels, so workers share nothing but the queues
+	if (m_workers != nullptr && m_busy_tiles.size() > 1)
+	{
+		m_workers->Run(m_busy_tiles.size(), [this](size_t i) { RasterizeTile(m_busy_tiles[i]); });
+	}
+	else
+	{
+		for (const auto tile : m_busy_tiles)
+			RasterizeTile(tile);
+	}
+
+	m_triangles.clear();
+	for (auto& bin : m_bins)
+		bin.clear();
+}
+
+WorkStealingPool::WorkStealingPool(unsigned int thread_count)
+{
+	thread_count = std::max(thread_count, 1u);
+
+	for (unsigned int i = 0; i < thread_count; ++i)
+		m_queues.push_back(std::make_unique<Queue>());
+
+	for (unsigned int i = 0; i + 1 < thread_count; ++i)
+		m_threads.emplace_back(&WorkStealingPool::Loop, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+	m_wake.notify_all();
+
+	for (auto &thread : m_threads)
+		thread.join();
+}
+
+void WorkStealingPool::Run(size_t count, const std::function<void(size_t)> &f)
+{
+	if (count == 0)
+		return;
+
+	std::lock_guard<std::mutex> run_lock(m_run_mutex);
+
+	// Published before any item, whoever pops one sees the job
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = &f;
+		++m_generation;
+	}
+
+	// Contiguous ranges per queue, stealing evens out renderlets of different cost
+	const auto queues = m_queues.size();
+	for (size_t q = 0; q < queues; ++q)
+	{
+		std::lock_guard<std::mutex> lock(m_queues[q]->mutex);
+		for (auto i = count * q / queues; i < count * (q + 1) / queues; ++i)
+			m_queues[q]->items.push_back(i);
+	}
+
+	m_wake.notify_all();
+
+	Work(queues - 1);
+
+	// Every item is taken once all queues are empty, wait for the ones still running
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this] { return m_active == 0; });
+	m_job = nullptr;
+}
+
+bool WorkStealingPool::Pop(size_t queue, size_t &item)
+{
+	auto &own = *m_queues[queue];
+	std::lock_guard<std::mutex> lock(own.mutex);
+
+	if (own.items.empty())
+		return false;
+
+	item = own.items.back();
+	own.items.pop_back();
+	return true;
+}
+
+bool WorkStealingPool::Steal(size_t thief, size_t &item)
+{
+	for (size_t i = 1; i < m_queues.size(); ++i)
+	{
+		auto &victim = *m_queues[(thief + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+
+		if (!victim.items.empty())
+		{
+			item = victim.items.front();
+			victim.items.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkStealingPool::Work(size_t queue)
+{
+	size_t item;
+	while (Pop(queue, item) || Steal(queue, item))
+		(*m_job)(item);
+}
+
+void WorkStealingPool::Loop(size_t queue)
+{
+	uint64_t generation = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_exit || m_generation != generation; });
+
+			if (m_exit)
+				return;
+
+			generation = m_generation;
+			++m_active;
+		}
+
+		Work(queue);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_active;
+		}
+		m_idle.notify_one();
+	}
+}
+
+void DeferredPal::Batch::Clear()
+{
+	commands.clear();
+	bytes.clear();
+	layouts.clear();
+	vector_count = 0;
+	tree_count = 0;
+	next = nullptr;
+}
+
+DeferredPal::DeferredPal(Pal *pal) : m_pal(pal), m_recording(new Batch)
+{
+	// Second batch of the pair, drained batches come back through m_free
+	m_free.store(new Batch, std::memory_order_relaxed);
+}
+
+DeferredPal::~DeferredPal()
+{
+	const auto destroy = [](Batch *batch)
+	{
+		while (batch != nullptr)
+		{
+			const auto next = batch->next;
+			delete batch;
+			batch = next;
+		}
+	};
+
+	delete m_recording;
+	destroy(m_submitted.exchange(nullptr));
+	destroy(m_free.exchange(nullptr));
+}
+
+ObjectID DeferredPal::RecordBytes(Command::Kind kind, ObjectID id, BufferDescriptor desc, int length, const uint8_t data[])
+{
+	if (data == nullptr)
+	{
+		m_recording->commands.push_back({kind, id, desc, NoBytes, static_cast<size_t>(length)});
+		return id;
+	}
+
+	// The renderlet's memory is reused by the next call, payloads are copied into the batch
+	const auto first = m_recording->bytes.size();
+	m_recording->bytes.insert(m_recording->bytes.end(), data, data + length);
+	m_recording->commands.push_back({kind, id, desc, first, static_cast<size_t>(length)});
+
+	return id;
+}
+
+ObjectID DeferredPal::RecordVector(Command::Kind kind, ObjectID id, const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	auto &batch = *m_recording;
+
+	if (batch.vector_count == batch.vectors.size())
+		batch.vectors.emplace_back();
+
+	// Assignment reuses the snapshot's storage from earlier frames
+	auto &snapshot = batch.vectors[batch.vector_count];
+	snapshot.commands = commands;
+	snapshot.diff = diff;
+
+	batch.commands.push_back({kind, id, BufferDescriptor{BufferType::Texture2D}, batch.vector_count++, 0});
+
+	return id;
+}
+
+ObjectID DeferredPal::CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	return RecordBytes(Command::CreateBuffer, m_proxies.Insert(0), desc, length, data);
+}
+
+ObjectID DeferredPal::CreateTexture(BufferDescriptor desc, int length, const uint8_t data[])
+{
+	return RecordBytes(Command::CreateTexture, m_proxies.Insert(0), desc, length, data);
+}
+
+void DeferredPal::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
+{
+	if (m_proxies.Get(buffer_id) != nullptr)
+		RecordBytes(Command::UpdateBuffer, buffer_id, BufferDescriptor{BufferType::DynamicMaterial}, length, data);
+}
+
+void DeferredPal::UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[])
+{
+	if (m_proxies.Get(buffer_id) == nullptr)
+		return;
+
+	RecordBytes(Command::UpdateBufferRange, buffer_id, BufferDescriptor{BufferType::Vertex}, length, data);
+	m_recording->commands.back().offset = static_cast<size_t>(offset);
+}
+
+void DeferredPal::UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+	const uint8_t data[])
+{
+	if (m_proxies.Get(texture_id) == nullptr)
+		return;
+
+	const auto length = TexturePipeline::LevelSize(format, width, height);
+	RecordBytes(Command::UpdateTextureRegion, texture_id, BufferDescriptor{BufferType::Texture2D, format, width, height},
+		static_cast<int>(length), data);
+
+	m_recording->commands.back().x = x;
+	m_recording->commands.back().y = y;
+}
+
+void DeferredPal::DeleteBuffer(ObjectID buffer_id)
+{
+	if (m_proxies.Erase(buffer_id))
+		m_recording->commands.push_back({Command::DeleteBuffer, buffer_id, BufferDescriptor{BufferType::Vertex}, 0, 0});
+}
+
+ObjectID DeferredPal::CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff)
+{
+	return RecordVector(Command::CreateVector, m_proxies.Insert(0), commands, diff);
+}
+
+ObjectID DeferredPal::UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id)
+{
+	if (m_proxies.Get(buffer_id) == nullptr)
+		return -1;
+
+	return RecordVector(Command::UpdateVector, buffer_id, commands, diff);
+}
+
+ObjectID DeferredPal::CreateVertexLayout(const VertexLayout &layout)
+{
+	// The real PAL sees the same layouts in the same order, so it hands out the same IDs
+	const auto count = m_vertex_layouts.size();
+	const auto layout_id = Pal::CreateVertexLayout(layout);
+
+	if (m_vertex_layouts.size() != count)
+	{
+		m_recording->layouts.push_back(layout);
+		m_recording->commands.push_back({Command::CreateVertexLayout, layout_id, BufferDescriptor{BufferType::Vertex},
+			m_recording->layouts.size() - 1, 0});
+	}
+
+	return layout_id;
+}
+
+void DeferredPal::RecordTree(ObjectID tree_id, const RenderTree &tree)
+{
+	auto &batch = *m_recording;
+
+	if (batch.tree_count == batch.trees.size())
+		batch.trees.emplace_back();
+
+	auto &nodes = batch.trees[batch.tree_count];
+	nodes.clear();
+
+	for (auto i = 0; i < tree.Length(); ++i)
+		nodes.push_back(*tree.NodeAt(i));
+
+	batch.commands.push_back({Command::SetTree, tree_id, BufferDescriptor{BufferType::Vertex}, batch.tree_count++, 0});
+}
+
+void DeferredPal::RecordDestroyTree(ObjectID tree_id)
+{
+	m_recording->commands.push_back({Command::DestroyTree, tree_id, BufferDescriptor{BufferType::Vertex}, 0, 0});
+}
+
+void DeferredPal::Push(std::atomic<Batch *> &stack, Batch *batch)
+{
+	batch->next = stack.load(std::memory_order_relaxed);
+	while (!stack.compare_exchange_weak(batch->next, batch, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+void DeferredPal::Submit()
+{
+	if (m_recording->commands.empty())
+		return;
+
+	Push(m_submitted, m_recording);
+
+	// Only this thread pops m_free, so there is no ABA on the head
+	auto batch = m_free.load(std::memory_order_acquire);
+	while (batch != nullptr &&
+		!m_free.compare_exchange_weak(batch, batch->next, std::memory_order_acquire, std::memory_order_acquire))
+	{
+	}
+
+	// The render thread is behind by more than a frame
+	m_recording = batch != nullptr ? batch : new Batch;
+	m_recording->next = nullptr;
+}
+
+void DeferredPal::Drain()
+{
+	auto batch = m_submitted.exchange(nullptr, std::memory_order_acquire);
+
+	// Submitted newest first, replay oldest first
+	Batch *ordered = nullptr;
+	while (batch != nullptr)
+	{
+		const auto next = batch->next;
+		batch->next = ordered;
+		ordered = batch;
+		batch = next;
+	}
+
+	while (ordered != nullptr)
+	{
+		const auto next = ordered->next;
+
+		Replay(*ordered);
+		ordered->Clear();
+		Push(m_free, ordered);
+
+		ordered = next;
+	}
+}
+
+void DeferredPal::Replay(const Batch &batch)
+{
+	RLT_TRACE_SCOPE("DeferredPal::Replay");
+
+	for (const auto &command : batch.commands)
+	{
+		const auto *bytes = command.first != NoBytes ? batch.bytes.data() + command.first : nullptr;
+
+		switch (command.kind)
+		{
+		case Command::CreateBuffer:
+			Map(command.id, m_pal->CreateBuffer(command.desc, static_cast<int>(command.length), bytes));
+			break;
+		case Command::CreateTexture:
+			Map(command.id, m_pal->CreateTexture(command.desc, static_cast<int>(command.length), bytes));
+			break;
+		case Command::UpdateBuffer:
+			m_pal->UpdateBuffer(Translate(command.id), static_cast<int>(command.length), bytes);
+			break;
+		case Command::UpdateBufferRange:
+			m_pal->UpdateBufferRange(Translate(command.id), static_cast<int>(command.offset),
+				static_cast<int>(command.length), bytes);
+			break;
+		case Command::UpdateTextureRegion:
+			m_pal->UpdateTextureRegion(Translate(command.id), command.desc.Format(), command.x, command.y,
+				command.desc.Width(), command.desc.Height(), bytes);
+			break;
+		case Command::DeleteBuffer:
+			m_pal->DeleteBuffer(Translate(command.id));
+			Map(command.id, -1);
+			break;
+		case Command::CreateVector:
+		{
+			const auto &vector = batch.vectors[command.first];
+			Map(command.id, m_pal->CreateVector(vector.commands, vector.diff));
+			break;
+		}
+		case Command::UpdateVector:
+		{
+			const auto &vector = batch.vectors[command.first];
+			m_pal->UpdateVector(vector.commands, vector.diff, Translate(command.id));
+			break;
+		}
+		case Command::CreateVertexLayout:
+			m_pal->CreateVertexLayout(batch.layouts[command.first]);
+			break;
+		case Command::SetTree:
+		{
+			// Pointers from GetRenderTree stay valid, the tree is updated in place
+			auto &tree = m_trees[command.id];
+			if (tree == nullptr)
+				tree = std::make_unique<RenderTree>(batch.trees[command.first]);
+			else
+				*tree = RenderTree(batch.trees[command.first]);
+			break;
+		}
+		case Command::DestroyTree:
+			m_trees.erase(command.id);
+			break;
+		}
+	}
+}
+
+ObjectID DeferredPal::Translate(ObjectID proxy_id) const
+{
+	if (proxy_id < 0)
+		return -1;
+
+	const auto index = HandlePool<char>::IndexOf(proxy_id);
+	if (index >= m_real.size() || m_real[index].first != proxy_id)
+		return -1;
+
+	return m_real[index].second;
+}
+
+void DeferredPal::Map(ObjectID proxy_id, ObjectID real_id)
+{
+	const auto index = HandlePool<char>::IndexOf(proxy_id);
+	if (index >= m_real.size())
+		m_real.resize(index + 1, {-1, -1});
+
+	m_real[index] = {real_id == -1 ? -1 : proxy_id, real_id};
+}
+
+const RenderTree *DeferredPal::DrawnTree(ObjectID tree_id) const
+{
+	const auto it = m_trees.find(tree_id);
+	return it != m_trees.end() ? it->second.get() : nullptr;
+}
+
+const VertexLayout *DeferredPal::VertexLayoutAt(ObjectID layout_id) const
+{
+	return m_pal->VertexLayoutAt(layout_id);
+}
+
+// Nodes submitted but not drained yet map to -1 and are skipped by the real PAL
+void DeferredPal::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id)
+{
+	m_pal->DrawTriangleList(Translate(buffer_id), offset, length, stride, layout_id);
+}
+
+void DeferredPal::DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+	ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id)
+{
+	m_pal->DrawTriangleListInstanced(Translate(buffer_id), offset, length, stride,
+		Translate(instance_buffer_id), instance_count, layout_id);
+}
+
+void DeferredPal::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+	ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id)
+{
+	m_pal->DrawTriangleListMultiBuffer(Translate(buffer_id), offset, length, stride,
+		Translate(material_buffer_id), material_stride, layout_id);
+}
+
+void DeferredPal::BindTexture(ObjectID texture_id, int slot)
+{
+	m_pal->BindTexture(Translate(texture_id), slot);
+}
+
+void DeferredPal::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+{
+	m_pal->DrawVector(Translate(buffer_id), slot, width, height);
+}
+
+void RenderTreeNode::Render(IRuntime *runtime) const
+{
+	const auto *layout = runtime->GetVertexLayout(m_layout_id);
+	if (layout == nullptr)
+		return;
+
+	RenderFixedStride(runtime, layout->Stride());
+}
+
+void RenderTreeNode::RenderFixedStride(IRuntime* runtime, unsigned int stride) const
+{
+	const auto pal = static_cast<Runtime*>(runtime)->PalImpl();
+
+	if (m_instance_count != 0)
+		pal->DrawTriangleListInstanced(m_buffer_id, m_offset, m_length, stride, m_instance_buffer_id, m_instance_count,
+			m_layout_id);
+	else
+		pal->DrawTriangleList(m_buffer_id, m_offset, m_length, stride, m_layout_id);
+}
+
+void RenderTreeNode::RenderFixedStrideWithMaterial(IRuntime *runtime, unsigned stride, unsigned material_stride) const
+{
+	static_cast<Runtime *>(runtime)->PalImpl()->DrawTriangleListMultiBuffer(
+		m_buffer_id, m_offset, m_length, stride, m_material_buffer_id, material_stride, m_layout_id
+	);
+}
+
+void RenderTreeNode::RenderVector(IRuntime *runtime, int slot, int width, int height) const
+{
+	static_cast<Runtime*>(runtime)->PalImpl()->DrawVector(m_buffer_id, slot, width, height);
+}
+
+void RenderTreeNode::SetPooledBuffer(ObjectID buffer_id, int offset)
+{
+	m_buffer_id = buffer_id;
+	m_offset += offset;
+}
+
+void RenderTreeNode::SetVertexLayout(ObjectID layout_id)
+{
+	m_layout_id = layout_id;
+}
+
+void RenderTreeNode::BindTexture(IRuntime *runtime, int slot) const
+{
+	if (m_texture_id != -1)
+		static_cast<Runtime *>(runtime)->PalImpl()->BindTexture(m_texture_id, slot);
+}
+
+void RenderTreeNode::SetTexture(ObjectID texture_id)
+{
+	m_texture_id = texture_id;
+}
+
+void RenderTreeNode::SetUVTransform(const float transform[4])
+{
+	memcpy(m_uv_transform, transform, sizeof(m_uv_transform));
+}
+
+void RenderTreeNode::SetInstances(ObjectID instance_buffer_id, uint32_t count)
+{
+	m_instance_buffer_id = instance_buffer_id;
+	m_instance_count = count;
+}
+
+std::string RenderTreeNode::Metadata() const
+{
+	return m_metadata;
+}
+
+uint64_t DrawList::Key(const RenderTreeNode &node, uint32_t material, float depth)
+{
+	// -1 sorts first as 0, handles keep their slot index folded into 1..mask
+	const auto field = [](ObjectID id, uint32_t mask) {
+		return id == -1 ? 0 : 1 + static_cast<uint64_t>(HandlePool<char>::IndexOf(id) % mask);
+	};
+	const auto bucket = static_cast<uint64_t>(std::min(std::max(depth, 0.0f), 1.0f) * 4095.0f);
+
+	return field(node.VertexLayoutID(), 0xFF) << 56 | static_cast<uint64_t>(material & 0xFFF) << 44 |
+		field(node.TextureID(), 0xFFFF) << 28 | field(node.BufferID(), 0xFFFF) << 12 | bucket;
+}
+
+// Stable LSD radix sort of draws by key, 11 bit digits, those the same in every key are skipped
+static void sort_draws(std::vector<DrawList::Draw> &draws, std::vector<DrawList::Draw> &scratch)
+{
+	const auto count = draws.size();
+
+	constexpr auto DigitBits = 11;
+	constexpr auto Passes = (64 + DigitBits - 1) / DigitBits;
+	constexpr uint64_t DigitMask = (1u << DigitBits) - 1;
+
+	uint32_t histograms[Passes][1u << DigitBits] = {};
+	for (const auto &draw : draws)
+	{
+		for (auto pass = 0; pass < Passes; ++pass)
+			++histograms[pass][(draw.key >> (pass * DigitBits)) & DigitMask];
+	}
+
+	scratch.resize(count);
+
+	auto *source = draws.data();
+	auto *target = scratch.data();
+
+	for (auto pass = 0; pass < Passes; ++pass)
+	{
+		const auto shift = pass * DigitBits;
+		auto &histogram = histograms[pass];
+
+		if (histogram[(source[0].key >> shift) & DigitMask] == count)
+			continue;
+
+		uint32_t offset = 0;
+		for (auto &bucket : histogram)
+		{
+			const auto size = bucket;
+			bucket = offset;
+			offset += size;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+			target[histogram[(source[i].key >> shift) & DigitMask]++] = source[i];
+
+		std::swap(source, target);
+	}
+
+	if (source != draws.data())
+		draws.swap(scratch);
+}
+
+// One pass over [compact key:32][index:32] pairs by the 11 bit digit at Shift, a constant so the
+// loop doesn't shift by a register
+template <uint32_t Shift>
+static void scatter_pairs(const uint64_t *source, uint64_t *target, size_t count, uint32_t *offsets)
+{
+	for (size_t i = 0; i < count; ++i)
+		target[offsets[(source[i] >> Shift) & 0x7FF]++] = source[i];
+}
+
+void DrawList::Sort()
+{
+	const auto count = m_draws.size();
+	if (count < 2)
+		return;
+
+	// Only the key bits that differ between draws need sorting
+	const auto first_key = m_draws[0].key;
+	uint64_t varying = 0;
+	for (const auto &draw : m_draws)
+		varying |= draw.key ^ first_key;
+
+	if (varying == 0)
+		return;
+
+	// Key's fields low to high as [shift, width], each keeps its bits up to the highest that differs
+	static constexpr uint32_t Fields[][2] = {{0, 12}, {12, 16}, {28, 16}, {44, 12}, {56, 8}};
+
+	uint64_t masks[5];
+	uint32_t to[5];
+	uint32_t bits = 0;
+
+	for (auto field = 0; field < 5; ++field)
+	{
+		const auto live = (varying >> Fields[field][0]) & ((uint64_t(1) << Fields[field][1]) - 1);
+
+		uint32_t width = 0;
+		while ((live >> width) != 0)
+			++width;
+
+		masks[field] = (uint64_t(1) << width) - 1;
+		to[field] = bits;
+		bits += width;
+	}
+
+	// Wider than 32 bits, the draws themselves are sorted
+	if (bits > 32 || count > std::numeric_limits<uint32_t>::max())
+	{
+		sort_draws(m_draws, m_scratch);
+		return;
+	}
+
+	// Otherwise 8 byte pairs sort in at most three passes, then one gather puts the draws in order.
+	// The pairs and every digit's histogram come from one read of the draws
+	constexpr uint64_t DigitMask = 0x7FF;
+	const auto passes = (bits + 10) / 11;
+
+	uint32_t histograms[3][DigitMask + 1] = {};
+
+	m_order.resize(count);
+	m_order_scratch.resize(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const auto key = m_draws[i].key;
+		const auto compact = (key & masks[0]) << to[0] | ((key >> 12) & masks[1]) << to[1] |
+			((key >> 28) & masks[2]) << to[2] | ((key >> 44) & masks[3]) << to[3] | ((key >> 56) & masks[4]) << to[4];
+
+		m_order[i] = compact << 32 | i;
+
+		++histograms[0][compact & DigitMask];
+		++histograms[1][(compact >> 11) & DigitMask];
+		++histograms[2][(compact >> 22) & DigitMask];
+	}
+
+	auto *source = m_order.data();
+	auto *target = m_order_scratch.data();
+
+	for (uint32_t pass = 0; pass < passes; ++pass)
+	{
+		auto &histogram = histograms[pass];
+
+		// A digit that's the same in every key would leave the order as it is
+		if (histogram[(source[0] >> (32 + pass * 11)) & DigitMask] == count)
+			continue;
+
+		uint32_t offset = 0;
+		for (auto &bucket : histogram)
+		{
+			const auto size = bucket;
+			bucket = offset;
+			offset += size;
+		}
+
+		switch (pass)
+		{
+		case 0:
+			scatter_pairs<32>(source, target, count, histogram);
+			break;
+		case 1:
+			scatter_pairs<43>(source, target, count, histogram);
+			break;
+		default:
+			scatter_pairs<54>(source, target, count, histogram);
+			break;
+		}
+
+		std::swap(source, target);
+	}
+
+	m_scratch.resize(count);
+	for (size_t i = 0; i < count; ++i)
+		m_scratch[i] = m_draws[static_cast<uint32_t>(source[i])];
+
+	m_draws.swap(m_scratch);
+}
+
+#ifdef __EMSCRIPTEN__
+
+EM_ASYNC_JS(uintptr_t, init_renderlet, (const char *str), {
+	if (Window.renderlet_id === undefined){
+		Window.renderlet_id = 0;
+	}
+	else {
+		++Window.renderlet_id;
+	}
+	
+	await WebAssembly.instantiateStreaming(fetch(UTF8ToString(str)), {}).then(function(obj) {
+		Window["Start_" + Window.renderlet_id] = obj.instance.exports.Start;
+		Window["Start_mem_" + Window.renderlet_id] = obj.instance.exports.memory;
+	});
+	return Window.renderlet_id;
+});
+
+
+EM_ASYNC_JS(uintptr_t, run_renderlet, (int id), {
+	var offset = Window["Start_" + id]();
+
+	var length_output = new Uint8Array(Window["Start_mem_" + id].buffer, offset, 4);
+	var view = new DataView(length_output.buffer, offset, 4);
+	var length = view.getUint32(0, true);
+
+	var output = new Uint8Array(Window["Start_mem_" + id].buffer, offset, length);
+
+	var heapSpace = _malloc(output.length);
+	HEAP8.set(output, heapSpace);
+	return heapSpace;
+});
+
+EM_ASYNC_JS(void, delete_renderlet, (int id), {
+	Window["Start_" + id] = {};
+	Window["Start_mem_" + id] = {};
+});
+
+#endif
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t LatencyHistogram::Percentile(uint32_t p) const
+{
+	if (count == 0)
+		return 0;
+
+	const auto rank = std::max<uint64_t>((count * p + 99) / 100, 1);
+
+	uint64_t seen = 0;
+	for (auto bucket = 0; bucket + 1 < Buckets; ++bucket)
+	{
+		seen += buckets[bucket];
+		if (seen >= rank)
+			return std::min<uint64_t>(uint64_t{1} << bucket, max_us);
+	}
+
+	return max_us;
+}
+
+void AtomicHistogram::Add(uint64_t us)
+{
+	auto bucket = 0;
+	while (bucket + 1 < LatencyHistogram::Buckets && (us >> bucket) != 0)
+		++bucket;
+
+	count.fetch_add(1, std::memory_order_relaxed);
+	total_us.fetch_add(us, std::memory_order_relaxed);
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+	auto max = max_us.load(std::memory_order_relaxed);
+	while (us > max && !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+	{
+	}
+}
+
+void AtomicHistogram::Read(LatencyHistogram &histogram) const
+{
+	histogram.count += count.load(std::memory_order_relaxed);
+	histogram.total_us += total_us.load(std::memory_order_relaxed);
+	histogram.max_us = std::max(histogram.max_us, max_us.load(std::memory_order_relaxed));
+
+	for (auto bucket = 0; bucket < LatencyHistogram::Buckets; ++bucket)
+		histogram.buckets[bucket] += buckets[bucket].load(std::memory_order_relaxed);
+}
+
+void RenderletCounters::Read(RenderletStats &stats) const
+{
+	for (auto entry = 0; entry < static_cast<int>(EEntryPoint::Count); ++entry)
+		calls[entry].Read(stats.calls[entry]);
+
+	parse.Read(stats.parse);
+	stats.traps += traps.load(std::memory_order_relaxed);
+	stats.output_bytes += output_bytes.load(std::memory_order_relaxed);
+	stats.nodes += nodes.load(std::memory_order_relaxed);
+	stats.memory_pages += memory_pages.load(std::memory_order_relaxed);
+}
+
+ObjectID Runtime::CreateBuffer(const BufferDescriptor &desc, int length, const uint8_t data[])
+{
+	m_pal_counters.Create(length);
+	return m_pal->CreateBuffer(desc, length, data);
+}
+
+ObjectID Runtime::CreateTexture(const BufferDescriptor &desc, int length, const uint8_t data[])
+{
+	m_pal_counters.Create(length);
+	return m_pal->CreateTexture(desc, length, data);
+}
+
+void Runtime::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
+{
+	m_pal_counters.Update(length);
+	m_pal->UpdateBuffer(buffer_id, length, data);
+}
+
+void Runtime::UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[])
+{
+	m_pal_counters.Update(length);
+	m_pal->UpdateBufferRange(buffer_id, offset, length, data);
+}
+
+ObjectID wander::Runtime::LoadFromFile(const std::wstring& path)
+{
+	return LoadFromFile(path, "Start");
+}
+
+ObjectID wander::Runtime::LoadFromFile(const std::wstring& path, const std::string& function)
+{
+	RLT_TRACE_SCOPE("Runtime::LoadFromFile");
+
+#ifndef __EMSCRIPTEN__
+
+	auto context = WasmtimeContext{};
+	context.Lock = std::make_unique<std::mutex>();
+	context.Function = function;
+	context.Stats = std::make_shared<RenderletCounters>();
+
+	std::call_once(m_engine_once, [this]
+	{
+		auto conf = wasm_config_new();
+		wasmtime_config_wasm_simd_set(conf, true);
+		wasmtime_config_wasm_bulk_memory_set(conf, true);
+		wasmtime_config_wasm_multi_value_set(conf, true);
+		wasmtime_config_wasm_multi_memory_set(conf, true);
+		wasmtime_config_wasm_reference_types_set(conf, true);
+		wasmtime_config_wasm_threads_set(conf, true);
+		wasmtime_config_cranelift_opt_level_set(conf, WASMTIME_OPT_LEVEL_NONE);
+		wasmtime_config_parallel_compilation_set(conf, true);
+		wasmtime_config_cranelift_debug_verifier_set(conf, false);
+
+		// Needed by RenderWithBudget, unbudgeted calls get a deadline that never comes
+		wasmtime_config_epoch_interruption_set(conf, true);
+
+		if (m_config.profiler == EProfiler::PerfMap)
+			wasmtime_config_profiler_set(conf, WASMTIME_PROFILING_STRATEGY_PERFMAP);
+		else if (m_config.profiler == EProfiler::JitDump)
+			wasmtime_config_profiler_set(conf, WASMTIME_PROFILING_STRATEGY_JITDUMP);
+
+		// Outputs are read in place after the call, guest pointers must stay valid as memory grows
+		wasmtime_config_memory_may_move_set(conf, false);
+
+		wasmtime_config_memory_init_cow_set(conf, m_config.memory_init_cow);
+		if (m_config.memory_reservation != 0)
+			wasmtime_config_memory_reservation_set(conf, m_config.memory_reservation);
+		if (m_config.memory_guard_size != 0)
+			wasmtime_config_memory_guard_size_set(conf, m_config.memory_guard_size);
+
+		m_engine = wasm_engine_new_with_config(conf);
+	});
+	assert(m_engine != NULL);
+
+	context.Compiled = Compile(path);
+
+	if (!Instantiate(context))
+	{
+		wasmtime_store_delete(context.Store);
+		return -1;
+	}
+
+	// Only the main instance is profiled, RenderTiled tiles go unsampled
+	if (m_config.profiler == EProfiler::Guest)
+		context.Host->Profile.Profiler = NewGuestProfiler(*context.Compiled);
+
+	std::unique_lock<std::shared_mutex> lock(m_contexts_mutex);
+	return m_contexts.Insert(std::move(context));
+
+#else
+
+	//init_renderlet(path.c_str());
+	m_context_count = init_renderlet("demo.wasm") + 1;
+
+	return m_context_count - 1;
+#endif
+}
+
+#ifndef __EMSCRIPTEN__
+Runtime::CompiledModule::~CompiledModule()
+{
+	wasmtime_instance_pre_delete(Pre);
+	wasmtime_linker_delete(Linker);
+	wasmtime_module_delete(Module);
+}
+
+std::shared_ptr<Runtime::CompiledModule> wander::Runtime::Compile(const std::wstring &path)
+{
+	RLT_TRACE_SCOPE("Runtime::Compile");
+
+	std::lock_guard<std::mutex> lock(m_modules_mutex);
+
+	auto &compiled = m_modules[path];
+	if (compiled != nullptr)
+	{
+		m_module_hits.fetch_add(1, std::memory_order_relaxed);
+		return compiled;
+	}
+
+	m_module_misses.fetch_add(1, std::memory_order_relaxed);
+
+	compiled = std::make_shared<CompiledModule>();
+
+	wasm_byte_vec_t wasm;
+	// Load our input file to parse it next
+	FILE *file;
+	if (_wfopen_s(&file, path.c_str(), L"rb") || !file)
+	{
+		printf("> Error loading file!\n");
+		exit(1);
+	}
+	fseek(file, 0L, SEEK_END);
+	size_t file_size = ftell(file);
+	wasm_byte_vec_new_uninitialized(&wasm, file_size);
+	fseek(file, 0L, SEEK_SET);
+	if (fread(wasm.data, file_size, 1, file) != 1)
+	{
+		printf("> Error loading module!\n");
+		exit(1);
+	}
+	fclose(file);
+
+	auto error = wasmtime_module_new(m_engine, (uint8_t *)wasm.data, wasm.size, &compiled->Module);
+	if (!compiled->Module)
+		exit_with_error("failed to compile module", error, NULL);
+	wasm_byte_vec_delete(&wasm);
+
+	// Create a linker with WASI functions defined, stores only differ in their WASI context
+	compiled->Linker = wasmtime_linker_new(m_engine);
+	error = wasmtime_linker_define_wasi(compiled->Linker);
+	if (error != NULL)
+		exit_with_error("failed to link wasi", error, NULL);
+
+	// Renderlets that don't import it still link, unused definitions are fine
+	const auto alloc_output = wasm_functype_new_1_1(wasm_valtype_new_i32(), wasm_valtype_new_i32());
+	error = wasmtime_linker_define_func(compiled->Linker, "wander", 6, "alloc_output", 12, alloc_output,
+		&Runtime::AllocOutput, nullptr, nullptr);
+	wasm_functype_delete(alloc_output);
+	if (error != NULL)
+		exit_with_error("failed to define wander.alloc_output", error, NULL);
+
+	const auto emit_chunk = wasm_functype_new_3_0(wasm_valtype_new_i32(), wasm_valtype_new_i32(), wasm_valtype_new_i32());
+	error = wasmtime_linker_define_func(compiled->Linker, "wander", 6, "emit_chunk", 10, emit_chunk,
+		&Runtime::EmitChunk, this, nullptr);
+	wasm_functype_delete(emit_chunk);
+	if (error != NULL)
+		exit_with_error("failed to define wander.emit_chunk", error, NULL);
+
+	error = wasmtime_linker_instantiate_pre(compiled->Linker, compiled->Module, &compiled->Pre);
+	if (error != NULL)
+		exit_with_error("failed to link module", error, NULL);
+
+	return compiled;
+}
+
+wasm_trap_t *Runtime::AllocOutput(void *env, wasmtime_caller_t *caller,
+	const wasmtime_val_t *args, size_t nargs, wasmtime_val_t *results, size_t nresults)
+{
+	const auto context = wasmtime_caller_context(caller);
+	auto &arena = static_cast<HostData *>(wasmtime_context_get_data(context))->Arena;
+
+	wasmtime_extern_t memory{};
+	if (!wasmtime_caller_export_get(caller, "memory", 6, &memory) || memory.kind != WASMTIME_EXTERN_MEMORY)
+	{
+		static const char message[] = "wander.alloc_output needs an exported memory";
+		return wasmtime_trap_new(message, sizeof(message) - 1);
+	}
+
+	const auto offset = arena.Allocate(context, memory.of.memory, static_cast<uint32_t>(args[0].of.i32));
+	if (offset == 0)
+	{
+		static const char message[] = "wander.alloc_output is out of memory";
+		return wasmtime_trap_new(message, sizeof(message) - 1);
+	}
+
+	results[0].kind = WASMTIME_I32;
+	results[0].of.i32 = static_cast<int32_t>(offset);
+	return nullptr;
+}
+
+uint64_t Runtime::OutputArena::Allocate(wasmtime_context_t *context, const wasmtime_memory_t &memory, uint64_t size)
+{
+	// 16 byte aligned, any vertex attribute can be written in place
+	size = (size + 15) & ~uint64_t{15};
+
+	while (current < chunks.size())
+	{
+		if (used + size <= chunks[current].size)
+		{
+			const auto offset = chunks[current].offset + used;
+			used += size;
+			return offset;
+		}
+
+		++current;
+		used = 0;
+	}
+
+	// Whole chunks, small outputs share one and later frames reuse them
+	const auto pages = std::max((size + WasmPage - 1) / WasmPage, ArenaChunkPages);
+
+	uint64_t previous = 0;
+	if (auto error = wasmtime_memory_grow(context, &memory, pages, &previous))
+	{
+		wasmtime_error_delete(error);
+		return 0;
+	}
+
+	chunks.push_back({previous * WasmPage, pages * WasmPage});
+	current = chunks.size() - 1;
+	used = size;
+
+	return chunks.back().offset;
+}
+
+wasm_trap_t *Runtime::EmitChunk(void *env, wasmtime_caller_t *caller,
+	const wasmtime_val_t *args, size_t nargs, wasmtime_val_t *results, size_t nresults)
+{
+	const auto context = wasmtime_caller_context(caller);
+	auto &stream = static_cast<HostData *>(wasmtime_context_get_data(context))->Stream;
+
+	const auto trap = [](const char *message) { return wasmtime_trap_new(message, strlen(message)); };
+
+	wasmtime_extern_t memory{};
+	if (!wasmtime_caller_export_get(caller, "memory", 6, &memory) || memory.kind != WASMTIME_EXTERN_MEMORY)
+		return trap("wander.emit_chunk needs an exported memory");
+
+	const auto ptr = static_cast<uint32_t>(args[1].of.i32);
+	const auto len = static_cast<uint32_t>(args[2].of.i32);
+	if (uint64_t{ptr} + len > wasmtime_memory_data_size(context, &memory.of.memory))
+		return trap("wander.emit_chunk out of bounds");
+
+	const auto data = wasmtime_memory_data(context, &memory.of.memory) + ptr;
+	stream.active = true;
+
+	switch (static_cast<EChunk>(args[0].of.i32))
+	{
+	case EChunk::Format:
+		if (len < sizeof(uint32_t))
+			return trap("wander.emit_chunk format too short");
+		memcpy(&stream.output.vert_format, data, sizeof(uint32_t));
+		break;
+	case EChunk::Layout:
+	{
+		auto header = data;
+		if (!static_cast<Runtime *>(env)->ReadVertexLayout(header, len, stream.output))
+			return trap("wander.emit_chunk invalid layout");
+		break;
+	}
+	case EChunk::Vertices:
+		stream.verts.insert(stream.verts.end(), data, data + len);
+		break;
+	case EChunk::Colors:
+		stream.colors.insert(stream.colors.end(), data, data + len);
+		break;
+	case EChunk::Nodes:
+	{
+		// Nodes are built as their lines complete, the rest waits for the next chunk
+		stream.partial.append(reinterpret_cast<const char *>(data), len);
+
+		const auto end = stream.partial.rfind('\n');
+		if (end != std::string::npos)
+		{
+			ReadNodes(stream.partial.substr(0, end + 1), stream.output.nodes);
+			stream.partial.erase(0, end + 1);
+		}
+		break;
+	}
+	case EChunk::Textures:
+		if (!static_cast<Runtime *>(env)->ReadTextures(data, len, stream.output))
+			return trap("wander.emit_chunk invalid texture");
+		break;
+	default:
+		return trap("wander.emit_chunk unknown kind");
+	}
+
+	return nullptr;
+}
+
+void Runtime::OutputStream::Clear()
+{
+	// Cleared rather than replaced, capacity is reused by the next call
+	active = false;
+	output.vert_format = 1;
+	output.stride = 0;
+	output.attributes.clear();
+	output.nodes.clear();
+	output.textures.clear();
+	output.commands_read = false;
+	output.renderlet_id = -1;
+	verts.clear();
+	colors.clear();
+	partial.clear();
+}
+
+bool Runtime::FinishStream(WasmtimeContext &context, RenderOutput &parsed, bool read_vectors)
+{
+	auto &stream = context.Host->Stream;
+
+	// A last line without a newline
+	if (!stream.partial.empty())
+	{
+		ReadNodes(stream.partial, stream.output.nodes);
+		stream.partial.clear();
+	}
+
+	std::swap(parsed, stream.output);
+
+	parsed.verts = stream.verts.data();
+	parsed.vert_length = static_cast<uint32_t>(stream.verts.size());
+	parsed.colors = stream.colors.data();
+	parsed.colors_length = static_cast<uint32_t>(stream.colors.size());
+
+	if (parsed.vert_format == 2 && read_vectors)
+	{
+		VectorLoader::Read(parsed.verts, parsed.vert_length, parsed.commands);
+		parsed.commands_read = true;
+	}
+
+	return parsed.vert_format >= 1 && parsed.vert_format <= 4;
+}
+
+bool Runtime::OutputArena::Contains(uint64_t offset, uint64_t length) const
+{
+	for (const auto &chunk : chunks)
+	{
+		if (offset >= chunk.offset && offset + length <= chunk.offset + chunk.size)
+			return true;
+	}
+
+	return false;
+}
+
+bool wander::Runtime::Instantiate(WasmtimeContext &context)
+{
+	RLT_TRACE_SCOPE("Runtime::Instantiate");
+
+	const auto start = std::chrono::steady_clock::now();
+
+	context.Host = std::make_unique<HostData>();
+	context.Store = wasmtime_store_new(m_engine, context.Host.get(), NULL);
+	assert(context.Store != NULL);
+	context.Context = wasmtime_store_context(context.Store);
+
+	if (m_config.profiler == EProfiler::Guest)
+	{
+		context.Host->Profile.Store = context.Store;
+		wasmtime_store_epoch_deadline_callback(context.Store, &Runtime::SampleGuest, &context.Host->Profile, nullptr);
+	}
+
+	// Instantiate wasi
+	wasi_config_t *wasi_config = wasi_config_new();
+	assert(wasi_config);
+	wasi_config_inherit_argv(wasi_config);
+	wasi_config_inherit_env(wasi_config);
+	wasi_config_inherit_stdin(wasi_config);
+	wasi_config_inherit_stdout(wasi_config);
+	wasi_config_inherit_stderr(wasi_config);
+
+	auto error = wasmtime_context_set_wasi(context.Context, wasi_config);
+	if (error != NULL)
+	{
+		print_error("failed to instantiate WASI", error, NULL);
+		return false;
+	}
+
+	wasmtime_context_set_epoch_deadline(context.Context, NoDeadline);
+
+	wasm_trap_t *trap = nullptr;
+	error = wasmtime_instance_pre_instantiate(context.Compiled->Pre, context.Context, &context.Instance, &trap);
+	if (error != NULL || trap != NULL)
+	{
+		print_error("failed to instantiate module", error, trap);
+		return false;
+	}
+
+	// Reactors expect _initialize before anything else, as wasmtime_linker_module did for us
+	wasmtime_extern_t initialize{};
+	if (wasmtime_instance_export_get(context.Context, &context.Instance, "_initialize", 11, &initialize))
+	{
+		error = wasmtime_func_call(context.Context, &initialize.of.func, nullptr, 0, nullptr, 0, &trap);
+		if (error != NULL || trap != NULL)
+		{
+			print_error("failed to initialize module", error, trap);
+			return false;
+		}
+	}
+
+	if (!wasmtime_instance_export_get(context.Context, &context.Instance, 
+		context.Function.c_str(), context.Function.length(), &context.Run))
+		return false;
+
+	if (!wasmtime_instance_export_get(context.Context, &context.Instance, 
+		"memory", 6, &context.Memory))
+		return false;
+
+	if (!Initialize(context))
+		return false;
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+	std::lock_guard<std::mutex> lock(m_stats_mutex);
+
+	if (m_instantiation_us.size() < InstantiationSamples)
+		m_instantiation_us.push_back(static_cast<uint32_t>(elapsed.count()));
+	else
+		m_instantiation_us[m_instantiation_count % InstantiationSamples] = static_cast<uint32_t>(elapsed.count());
+
+	++m_instantiation_count;
+	return true;
+}
+
+bool wander::Runtime::Initialize(WasmtimeContext &context)
+{
+	auto &compiled = *context.Compiled;
+
+	wasmtime_extern_t init{};
+	const auto has_init = wasmtime_instance_export_get(context.Context, &context.Instance, "init", 4, &init) &&
+		init.kind == WASMTIME_EXTERN_FUNC;
+
+	// Without snapshots every instance runs its own init
+	if (!m_config.snapshot_init)
+	{
+		if (!has_init)
+			return true;
+
+		wasm_trap_t *trap = nullptr;
+		auto error = wasmtime_func_call(context.Context, &init.of.func, nullptr, 0, nullptr, 0, &trap);
+		if (error != NULL || trap != NULL)
+		{
+			print_error("failed to call init", error, trap);
+			return false;
+		}
+		return true;
+	}
+
+	// Later instances wait for the first one's init, rather than running their own
+	std::lock_guard<std::mutex> lock(compiled.SnapshotMutex);
+
+	if (compiled.Snapshotted)
+		return RestoreSnapshot(context);
+
+	if (has_init && !TakeSnapshot(context, init.of.func))
+		return false;
+
+	compiled.Snapshotted = true;
+	return true;
+}
+
+bool wander::Runtime::TakeSnapshot(WasmtimeContext &context, const wasmtime_func_t &init)
+{
+	auto &compiled = *context.Compiled;
+
+	// Only pages init writes need restoring, the rest come from the copy-on-write image
+	const auto fresh_size = wasmtime_memory_data_size(context.Context, &context.Memory.of.memory);
+	const auto fresh = std::vector<uint8_t>(wasmtime_memory_data(context.Context, &context.Memory.of.memory),
+		wasmtime_memory_data(context.Context, &context.Memory.of.memory) + fresh_size);
+
+	wasm_trap_t *trap = nullptr;
+	auto error = wasmtime_func_call(context.Context, &init, nullptr, 0, nullptr, 0, &trap);
+	if (error != NULL || trap != NULL)
+	{
+		print_error("failed to call init", error, trap);
+		return false;
+	}
+
+	const auto size = wasmtime_memory_data_size(context.Context, &context.Memory.of.memory);
+	const auto data = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
+
+	compiled.SnapshotSize = size;
+
+	for (size_t offset = 0; offset < size; offset += SnapshotPage)
+	{
+		// Pages past the fresh size start zeroed
+		const auto dirty = offset < fresh_size ? memcmp(data + offset, fresh.data() + offset, SnapshotPage) != 0
+			: std::any_of(data + offset, data + offset + SnapshotPage, [](uint8_t b) { return b != 0; });
+
+		if (dirty)
+		{
+			compiled.SnapshotPages.push_back(static_cast<uint32_t>(offset / SnapshotPage));
+			compiled.SnapshotData.insert(compiled.SnapshotData.end(), data + offset, data + offset + SnapshotPage);
+		}
+	}
+
+	// Exported mutable globals, globals that aren't exported can't be reached through the C API
+	char *name;
+	size_t name_length;
+	wasmtime_extern_t item;
+
+	for (size_t i = 0; wasmtime_instance_export_nth(context.Context, &context.Instance, i, &name, &name_length, &item); ++i)
+	{
+		if (item.kind != WASMTIME_EXTERN_GLOBAL)
+			continue;
+
+		auto global_name = std::string(name, name_length);
+
+		const auto type = wasmtime_global_type(context.Context, &item.of.global);
+		const auto mutable_global = wasm_globaltype_mutability(type) == WASM_VAR;
+		wasm_globaltype_delete(type);
+
+		wasmtime_val_t value;
+		wasmtime_global_get(context.Context, &item.of.global, &value);
+
+		if (mutable_global && value.kind <= WASMTIME_V128)
+			compiled.SnapshotGlobals.emplace_back(std::move(global_name), value);
+	}
+
+	return true;
+}
+
+bool wander::Runtime::RestoreSnapshot(WasmtimeContext &context)
+{
+	const auto &compiled = *context.Compiled;
+
+	const auto size = wasmtime_memory_data_size(context.Context, &context.Memory.of.memory);
+	if (size < compiled.SnapshotSize)
+	{
+		uint64_t previous;
+		auto error = wasmtime_memory_grow(context.Context, &context.Memory.of.memory,
+			(compiled.SnapshotSize - size) / 65536, &previous);
+
+		if (error != NULL)
+		{
+			print_error("failed to grow memory to the snapshot", error, NULL);
+			return false;
+		}
+	}
+
+	const auto data = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
+
+	for (size_t i = 0; i < compiled.SnapshotPages.size(); ++i)
+	{
+		memcpy(data + static_cast<size_t>(compiled.SnapshotPages[i]) * SnapshotPage,
+			compiled.SnapshotData.data() + i * SnapshotPage, SnapshotPage);
+	}
+
+	for (const auto &[name, value] : compiled.SnapshotGlobals)
+	{
+		wasmtime_extern_t global{};
+		if (!wasmtime_instance_export_get(context.Context, &context.Instance, name.c_str(), name.length(), &global))
+			continue;
+
+		if (auto error = wasmtime_global_set(context.Context, &global.of.global, &value))
+			wasmtime_error_delete(error);
+	}
+
+	return true;
+}
+
+bool wander::Runtime::Reset(ObjectID renderlet_id)
+{
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr)
+		return false;
+
+	// Pooled outputs still to be uploaded live in the current memory
+	if (context->Host->Arena.pins != 0)
+		return false;
+
+	// A new store, the old one can't give back memory it grew
+	auto fresh = WasmtimeContext{};
+	fresh.Compiled = context->Compiled;
+	fresh.Function = context->Function;
+
+	if (!Instantiate(fresh))
+	{
+		wasmtime_store_delete(fresh.Store);
+		return false;
+	}
+
+	for (const auto &tile : context->Tiles)
+	{
+		wasmtime_store_delete(tile->Store);
+	}
+	context->Tiles.clear();
+
+	wasmtime_store_delete(context->Store);
+
+	context->Store = fresh.Store;
+	context->Context = fresh.Context;
+	context->Instance = fresh.Instance;
+	context->Run = fresh.Run;
+	context->Memory = fresh.Memory;
+	context->Poisoned = false;
+
+	// The profile carries on, sampling the new store
+	std::swap(context->Host->Profile.Profiler, fresh.Host->Profile.Profiler);
+	context->Host = std::move(fresh.Host);
+
+	return true;
+}
+#else
+bool wander::Runtime::Reset(ObjectID renderlet_id)
+{
+	return false;
+}
+#endif
+
+InstantiationStats wander::Runtime::GetInstantiationStats()
+{
+	std::vector<uint32_t> samples;
+	InstantiationStats stats{};
+
+	{
+		std::lock_guard<std::mutex> lock(m_stats_mutex);
+		samples = m_instantiation_us;
+		stats.count = m_instantiation_count;
+	}
+
+	if (samples.empty())
+		return stats;
+
+	std::sort(samples.begin(), samples.end());
+
+	const auto percentile = [&samples](size_t p) { return samples[(samples.size() - 1) * p / 100]; };
+
+	stats.p50_us = percentile(50);
+	stats.p90_us = percentile(90);
+	stats.p99_us = percentile(99);
+	stats.max_us = samples.back();
+
+	return stats;
+}
+
+RenderletStats wander::Runtime::GetStats(ObjectID renderlet_id)
+{
+	RenderletStats stats{};
+
+	std::shared_lock<std::shared_mutex> lookup(m_contexts_mutex);
+
+	const auto context = m_contexts.Get(renderlet_id);
+	if (context != nullptr && context->Stats != nullptr)
+		context->Stats->Read(stats);
+
+	return stats;
+}
+
+std::string wander::Runtime::ExportTrace()
+{
+#if defined(RLT_TRACE)
+	return Tracer::Export();
+#else
+	return "{\"traceEvents\":[]}";
+#endif
+}
+
+bool wander::Runtime::WriteProfile(ObjectID renderlet_id, const std::wstring &path)
+{
+#ifndef __EMSCRIPTEN__
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr || context->Host->Profile.Profiler == nullptr)
+		return false;
+
+	auto &profile = context->Host->Profile;
+
+	// Finishing takes the profiler, sampling goes on into a new one
+	wasm_byte_vec_t json;
+	auto error = wasmtime_guestprofiler_finish(profile.Profiler, &json);
+	profile.Profiler = NewGuestProfiler(*context->Compiled);
+	if (error != NULL)
+	{
+		print_error("failed to finish guest profile", error, NULL);
+		return false;
+	}
+
+	FILE *file = nullptr;
+	auto written = !_wfopen_s(&file, path.c_str(), L"wb") && file;
+	if (written)
+	{
+		written = fwrite(json.data, 1, json.size, file) == json.size;
+		fclose(file);
+	}
+
+	wasm_byte_vec_delete(&json);
+	return written;
+#else
+	return false;
+#endif
+}
+
+RuntimeStats wander::Runtime::GetGlobalStats()
+{
+	RuntimeStats stats{};
+
+	{
+		std::lock_guard<std::mutex> lock(m_stats_mutex);
+		stats.renderlets = m_unloaded_stats;
+	}
+
+	{
+		std::shared_lock<std::shared_mutex> lookup(m_contexts_mutex);
+
+		m_contexts.ForEach([&stats](ObjectID, WasmtimeContext &context)
+		{
+			if (context.Stats != nullptr)
+				context.Stats->Read(stats.renderlets);
+		});
+	}
+
+	stats.pal_creates = m_pal_counters.creates.load(std::memory_order_relaxed);
+	stats.pal_create_bytes = m_pal_counters.create_bytes.load(std::memory_order_relaxed);
+	stats.pal_updates = m_pal_counters.updates.load(std::memory_order_relaxed);
+	stats.pal_update_bytes = m_pal_counters.update_bytes.load(std::memory_order_relaxed);
+
+	stats.texture_cache_hits = m_texture_pipeline.Hits();
+	stats.texture_cache_misses = m_texture_pipeline.Misses();
+	stats.module_cache_hits = m_module_hits.load(std::memory_order_relaxed);
+	stats.module_cache_misses = m_module_misses.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
+void wander::Runtime::PushParam(ObjectID renderlet_id, float value)
+{
+	Param p;
+	p.Type = Param::Float32;
+	p.Value.F32 = value;
+
+	std::unique_lock<std::mutex> lock;
+	if (const auto context = LockContext(renderlet_id, lock))
+		context->Params.push(p);
+}
+
+void wander::Runtime::PushParam(ObjectID renderlet_id, double value)
+{
+	Param p;
+	p.Type = Param::Float64;
+	p.Value.F64 = value;
+
+	std::unique_lock<std::mutex> lock;
+	if (const auto context = LockContext(renderlet_id, lock))
+		context->Params.push(p);
+}
+
+void wander::Runtime::PushParam(ObjectID renderlet_id, uint32_t value)
+{
+	Param p;
+	p.Type = Param::Int32;
+	p.Value.I32 = value;
+
+	std::unique_lock<std::mutex> lock;
+	if (const auto context = LockContext(renderlet_id, lock))
+		context->Params.push(p);
+}
+
+void wander::Runtime::PushParam(ObjectID renderlet_id, uint64_t value)
+{
+	Param p;
+	p.Type = Param::Int64;
+	p.Value.I64 = value;
+
+	std::unique_lock<std::mutex> lock;
+	if (const auto context = LockContext(renderlet_id, lock))
+		context->Params.push(p);
+}
+
+void wander::Runtime::ResetStack(ObjectID renderlet_id)
+{
+	std::unique_lock<std::mutex> lock;
+	if (const auto context = LockContext(renderlet_id, lock))
+		context->Params = {};
+}
+
+Runtime::WasmtimeContext *Runtime::LockContext(ObjectID renderlet_id, std::unique_lock<std::mutex> &lock)
+{
+	// The renderlet lock is taken before the lookup lock is dropped, so Unload waits for it
+	std::shared_lock<std::shared_mutex> lookup(m_contexts_mutex);
+
+	const auto context = m_contexts.Get(renderlet_id);
+	if (context != nullptr)
+		lock = std::unique_lock<std::mutex>(*context->Lock);
+
+	return context;
+}
+
+ObjectID wander::Runtime::BuildVector(RenderOutput &output, ObjectID tree_id)
+{
+	const auto read = [&output](VectorLoader::CommandList &commands)
+	{
+		// RenderMany parsed on a worker, swapping hands the old storage back for its next frame
+		if (output.commands_read)
+			std::swap(commands, output.commands);
+		else
+			VectorLoader::Read(output.verts, output.vert_length, commands);
+	};
+
+	if (tree_id != -1)
+	{
+		const auto tree = m_render_trees.Get(tree_id);
+		if (tree == nullptr)
+			return -1;
+
+		auto &vector = m_vectors[tree_id];
+
+		read(vector.commands);
+		const auto &changes = vector.diff.Update(vector.commands);
+
+		// Static frames don't reach the PAL at all
+		if (!changes.changed.empty() || changes.resized)
+		{
+			auto buffer_id = (*tree)->NodeAt(0)->BufferID();
+
+			m_pal->UpdateVector(vector.commands, vector.diff, buffer_id);
+		}
+
+		PublishTree(tree_id);
+
+		return tree_id;
+	}
+
+	VectorOutput vector;
+	read(vector.commands);
+	vector.diff.Update(vector.commands);
+
+	std::vector<RenderTreeNode> nodes;
+
+	auto id = m_pal->CreateVector(vector.commands, vector.diff);
+
+	auto node = RenderTreeNode{id, BufferType::Texture2D, "", 0, 0};
+
+	nodes.push_back(node);
+
+	const auto new_tree_id = m_render_trees.Insert(std::make_unique<RenderTree>(nodes));
+	m_vectors[new_tree_id] = std::move(vector);
+
+	PublishTree(new_tree_id);
+
+	return new_tree_id;
+}
+
+ObjectID wander::Runtime::BuildVertexWithMaterial(RenderOutput &output, ObjectID layout_id)
+{
+	BufferDescriptor desc{BufferType::Vertex, BufferFormat::Custom, 0, 0, 0, layout_id};
+
+	auto id = CreateBuffer(desc, output.vert_length, output.verts);
+
+	desc = BufferDescriptor{BufferType::DynamicMaterial};
+
+	auto material_id = CreateBuffer(desc, output.colors_length, output.colors);
+
+	std::vector<RenderTreeNode> nodes;
+
+	for (const auto &range : output.nodes)
+	{
+		auto node = RenderTreeNode{id, material_id, BufferType::Vertex, range.metadata, range.offset, range.length};
+		node.SetVertexLayout(layout_id);
+
+		nodes.push_back(node);
+	}
+
+	const auto new_tree_id = InsertTree(nodes, output);
+
+	PublishTree(new_tree_id);
+
+	return new_tree_id;
+}
+
+bool Runtime::ReadVertexLayout(uint8_t *&header, size_t length, RenderOutput &output)
+{
+	// [stride][attribute count][semantic, format, offset]...
+	if (length < 2 * sizeof(uint32_t))
+		return false;
+
+	// Copied out, sections and v1/v2 headers only promise byte alignment
+	uint32_t fields[2];
+	memcpy(fields, header, sizeof(fields));
+
+	const auto [stride, count] = fields;
+	const auto attributes = header + sizeof(fields);
+
+	if ((2 + 3 * uint64_t{count}) * sizeof(uint32_t) > length)
+		return false;
+
+	header += (2 + 3 * static_cast<size_t>(count)) * sizeof(uint32_t);
+
+	// No attributes means the host keeps setting up its own
+	if (count == 0)
+		return true;
+
+	auto &layout = output.attributes;
+	layout.resize(count);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t attribute[3];
+		memcpy(attribute, attributes + i * sizeof(attribute), sizeof(attribute));
+
+		const auto [semantic, format, offset] = attribute;
+
+		if (semantic > static_cast<uint32_t>(VertexSemantic::Color) ||
+			format > static_cast<uint32_t>(VertexFormat::UNorm8x4))
+			return false;
+
+		layout[i] = {static_cast<VertexSemantic>(semantic), static_cast<VertexFormat>(format), offset};
+
+		if (uint64_t{offset} + VertexLayout::Size(layout[i].format) > stride)
+			return false;
+	}
+
+	output.stride = stride;
+	return true;
+}
+
+void Runtime::CreatePooledBuffer(RenderOutput &output, ObjectID tree_id)
+{
+	auto offset = 0;
+	if (!m_sub_buffers.empty())
+	{
+		const auto& sub = m_sub_buffers.back();
+		offset = sub.offset + sub.length;
+	}
+
+	// Arena outputs stay where the guest wrote them, the pin moves to the sub buffer
+	if (output.renderlet_id == -1)
+	{
+		if (m_staging_buffer == nullptr)
+			m_staging_buffer = std::make_unique<uint8_t[]>(600 * 1024 * 1024); // MB
+
+		memcpy(&m_staging_buffer[offset], output.verts, output.vert_length);
+	}
+
+	m_sub_buffers.emplace_back(
+		SubBuffer {
+			offset,
+			output.vert_length,
+			tree_id,
+			output.renderlet_id,
+			output.arena_offset
+		}
+	);
+
+	output.renderlet_id = -1;
+}
+
+bool Runtime::ParseOutput(uint8_t *output, size_t length, RenderOutput &parsed, bool read_vectors)
+{
+	// The total length counts itself, the words are copied out as the output may sit at any address
+	if (length >= sizeof(uint32_t))
+	{
+		uint32_t total;
+		memcpy(&total, output, sizeof(total));
+		length = std::min<size_t>(length, total);
+	}
+	if (length < 2 * sizeof(uint32_t))
+	{
+		return false;
+	}
+
+	length -= sizeof(uint32_t);
+	output += sizeof(uint32_t);
+
+	uint32_t version;
+	memcpy(&version, output, sizeof(version));
+	if (version == 3)
+	{
+		return ParseSections(output, length, parsed, read_vectors);
+	}
+	if (version != 1 && version != 2)
+	{
+		return false;
+	}
+
+	// [version][vert_length][vert_format], everything the guest states is checked against length
+	if (length < 3 * sizeof(uint32_t))
+	{
+		return false;
+	}
+
+	const auto end = output + length;
+	const auto remaining = [end](const uint8_t *at) { return static_cast<size_t>(end - at); };
+
+	parsed.vert_length = *reinterpret_cast<uint32_t *>(output + sizeof(uint32_t));
+	parsed.vert_format = *reinterpret_cast<uint32_t *>(output + 2 * sizeof(uint32_t));
+	parsed.verts = output + 3 * sizeof(uint32_t);
+	parsed.attributes.clear();
+	parsed.nodes.clear();
+	parsed.textures.clear();
+	parsed.commands_read = false;
+
+	if (version == 2 && !ReadVertexLayout(parsed.verts, remaining(parsed.verts), parsed))
+	{
+		return false;
+	}
+
+	if (parsed.vert_length > remaining(parsed.verts))
+	{
+		return false;
+	}
+
+	if (parsed.vert_format == 2)
+	{
+		if (read_vectors)
+		{
+			VectorLoader::Read(parsed.verts, parsed.vert_length, parsed.commands);
+			parsed.commands_read = true;
+		}
+		return true;
+	}
+
+	auto mats = parsed.verts + parsed.vert_length;
+
+	if (parsed.vert_format == 4)
+	{
+		if (remaining(mats) < sizeof(uint32_t))
+		{
+			return false;
+		}
+
+		parsed.colors_length = *reinterpret_cast<uint32_t *>(mats);
+		parsed.colors = mats + 4;
+
+		if (parsed.colors_length > remaining(parsed.colors))
+		{
+			return false;
+		}
+
+		mats = parsed.colors + parsed.colors_length;
+	}
+
+	if (remaining(mats) < sizeof(uint32_t))
+	{
+		return false;
+	}
+
+	auto mat_length = *reinterpret_cast<uint32_t *>(mats);
+	if (mat_length > remaining(mats + 4))
+	{
+		return false;
+	}
+
+	ReadNodes(std::string(mats + 4, mats + 4 + mat_length), parsed.nodes);
+
+	return true;
+}
+
+bool Runtime::ParseSections(uint8_t *block, size_t length, RenderOutput &parsed, bool read_vectors)
+{
+	constexpr auto count_of = static_cast<size_t>(ESection::Count);
+
+	if (length < 2 * sizeof(uint32_t))
+		return false;
+
+	// Records are copied out as they're read, sections only promise their declared alignment
+	uint32_t count;
+	memcpy(&count, block + sizeof(uint32_t), sizeof(count));
+
+	const auto table = block + 2 * sizeof(uint32_t);
+
+	if ((2 + 4 * uint64_t{count}) * sizeof(uint32_t) > length)
+		return false;
+
+	uint8_t *sections[count_of] = {};
+	uint32_t lengths[count_of] = {};
+
+	// One pass over the table, every section is checked before anything is read from it
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t entry[4];
+		memcpy(entry, table + i * sizeof(entry), sizeof(entry));
+
+		const auto [type, offset, size, alignment] = entry;
+
+		if (uint64_t{offset} + size > length)
+			return false;
+
+		if (alignment > 1 && ((alignment & (alignment - 1)) != 0 || offset % alignment != 0))
+			return false;
+
+		// Sections from newer writers are skipped
+		if (type == 0 || type >= count_of)
+			continue;
+
+		if (sections[type] != nullptr)
+			return false;
+
+		sections[type] = block + offset;
+		lengths[type] = size;
+	}
+
+	const auto section = [&](ESection type) { return sections[static_cast<size_t>(type)]; };
+	const auto section_length = [&](ESection type) { return lengths[static_cast<size_t>(type)]; };
+
+	// One payload per output, as with vert_format
+	const auto payloads = (section(ESection::Vertices) != nullptr) + (section(ESection::Indices) != nullptr) +
+		(section(ESection::Vector) != nullptr);
+	if (payloads != 1)
+		return false;
+
+	parsed.attributes.clear();
+	parsed.nodes.clear();
+	parsed.textures.clear();
+	parsed.commands_read = false;
+	parsed.stride = 0;
+
+	if (section(ESection::Textures) != nullptr &&
+		!ReadTextures(section(ESection::Textures), section_length(ESection::Textures), parsed))
+		return false;
+
+	if (auto layout = section(ESection::Layout))
+	{
+		if (!ReadVertexLayout(layout, section_length(ESection::Layout), parsed))
+			return false;
+	}
+
+	if (section(ESection::Vector) != nullptr)
+	{
+		parsed.vert_format = 2;
+		parsed.verts = section(ESection::Vector);
+		parsed.vert_length = section_length(ESection::Vector);
+
+		if (read_vectors)
+		{
+			VectorLoader::Read(parsed.verts, parsed.vert_length, parsed.commands);
+			parsed.commands_read = true;
+		}
+		return true;
+	}
+
+	if (section(ESection::Indices) != nullptr)
+	{
+		parsed.vert_format = 3;
+		parsed.verts = section(ESection::Indices);
+		parsed.vert_length = section_length(ESection::Indices);
+	}
+	else
+	{
+		parsed.vert_format = section(ESection::Colors) != nullptr ? 4 : 1;
+		parsed.verts = section(ESection::Vertices);
+		parsed.vert_length = section_length(ESection::Vertices);
+		parsed.colors = section(ESection::Colors);
+		parsed.colors_length = section_length(ESection::Colors);
+	}
+
+	const auto materials = section(ESection::Materials);
+	const auto text = materials != nullptr ?
+		std::string(materials, materials + section_length(ESection::Materials)) : std::string();
+
+	const auto records = section(ESection::Nodes);
+	if (records == nullptr)
+	{
+		ReadNodes(text, parsed.nodes);
+		return true;
+	}
+
+	// Binary ranges, the material lines only carry metadata
+	std::string line;
+	std::istringstream ss(text);
+	for (uint32_t i = 0; i < section_length(ESection::Nodes) / (2 * sizeof(uint32_t)); ++i)
+	{
+		if (!std::getline(ss, line))
+			line.clear();
+
+		uint32_t range[2];
+		memcpy(range, records + i * sizeof(range), sizeof(range));
+
+		parsed.nodes.push_back({line, static_cast<int>(range[0]), static_cast<int>(range[1])});
+	}
+
+	return true;
+}
+
+bool Runtime::ReadTextures(const uint8_t *records, size_t length, RenderOutput &parsed)
+{
+	while (length != 0)
+	{
+		// [node][width][height][flags] then width * height RGBA8 texels
+		uint32_t header[4];
+		if (length < sizeof(header))
+			return false;
+
+		memcpy(header, records, sizeof(header));
+		const auto [node, width, height, flags] = header;
+
+		if (width == 0 || height == 0 || width > MaxTextureSize || height > MaxTextureSize ||
+			uint64_t{width} * height * 4 > length - sizeof(header))
+			return false;
+
+		parsed.textures.push_back({static_cast<int>(node), m_texture_pipeline.Process(records + sizeof(header),
+			static_cast<int>(width), static_cast<int>(height), (flags & 1) != 0, m_config.texture_compression)});
+
+		const auto size = sizeof(header) + static_cast<size_t>(width) * height * 4;
+		records += size;
+		length -= size;
+	}
+
+	return true;
+}
+
+void Runtime::AttachTextures(const RenderOutput &output, std::vector<RenderTreeNode> &nodes,
+	std::vector<TextureAtlas::Allocation> &allocations)
+{
+	for (const auto &[node, texture] : output.textures)
+	{
+		// Textures for nodes that don't exist are dropped, so are further ones for the same node
+		if (node < 0 || node >= static_cast<int>(nodes.size()) || nodes[node].TextureID() != -1)
+			continue;
+
+		// Small textures share atlas pages, nodes drawn with the same page need no rebind
+		TextureAtlas::Allocation allocation;
+		if (m_atlas.Insert(*m_pal, m_pal_counters, texture, allocation))
+		{
+			nodes[node].SetTexture(allocation.page_id);
+			nodes[node].SetUVTransform(allocation.uv_transform);
+			allocations.push_back(allocation);
+			continue;
+		}
+
+		const BufferDescriptor desc{BufferType::Texture2D, texture->format, texture->width, texture->height, 0, -1,
+			texture->levels};
+		nodes[node].SetTexture(CreateTexture(desc, static_cast<int>(texture->data.size()), texture->data.data()));
+	}
+}
+
+ObjectID Runtime::InsertTree(std::vector<RenderTreeNode> &nodes, const RenderOutput &output)
+{
+	std::vector<TextureAtlas::Allocation> allocations;
+	AttachTextures(output, nodes, allocations);
+
+	const auto tree_id = m_render_trees.Insert(std::make_unique<RenderTree>(nodes));
+
+	if (!allocations.empty())
+		m_atlas_allocations[tree_id] = std::move(allocations);
+
+	return tree_id;
+}
+
+void Runtime::ReadNodes(const std::string &text, std::vector<RenderOutput::NodeRange> &nodes)
+{
+	// TODO - binary going to be more efficient
+	std::string line;
+	std::istringstream ss(text);
+	while (std::getline(ss, line))
+	{
+		auto values = split_fixed<5>(',', line);
+
+		int VertexOffset = atoi(values[1].data());
+		int VertexLength = atoi(values[2].data());
+
+		nodes.push_back({line, VertexOffset, VertexLength});
+	}
+}
+
+ObjectID Runtime::UploadOutput(RenderOutput &output, ObjectID tree_id, bool pool)
+{
+	RLT_TRACE_SCOPE("Runtime::UploadOutput");
+
+	ObjectID layout_id = -1;
+	if (!output.attributes.empty())
+	{
+		layout_id = m_pal->CreateVertexLayout(VertexLayout(output.attributes, output.stride));
+	}
+
+	BufferDescriptor desc { BufferType::Vertex, BufferFormat::Custom, 0, 0, 0, layout_id };
+
+	if (output.vert_format == 2)
+	{
+		return BuildVector(output, tree_id);
+	}
+	if (output.vert_format == 3)
+	{
+		desc = {BufferType::Index};
+	}
+	if (output.vert_format == 4)
+	{
+		return BuildVertexWithMaterial(output, layout_id);
+	}
+
+	auto id = pool ? -1 : CreateBuffer(desc, output.vert_length, output.verts);
+
+	std::vector<RenderTreeNode> nodes;
+
+	for (const auto &range : output.nodes)
+	{
+		auto node = RenderTreeNode{id, BufferType::Vertex, range.metadata, range.offset, range.length};
+		node.SetVertexLayout(layout_id);
+
+		nodes.push_back(node);
+	}
+
+	const auto new_tree_id = InsertTree(nodes, output);
+
+	if (pool)
+	{
+		CreatePooledBuffer(output, new_tree_id);
+	}
+
+	PublishTree(new_tree_id);
+
+	return new_tree_id;
+}
+
+#ifndef __EMSCRIPTEN__
+std::vector<wasmtime_val_t> Runtime::PopArgs(WasmtimeContext &context)
+{
+	std::vector<wasmtime_val_t> args(context.Params.size());
+
+	for (auto& [kind, of] : args)
+	{
+		switch (const auto [Type, Value] = context.Params.front(); Type)
+		{
+		case Param::Int32:
+			kind = WASMTIME_I32;
+			of.i32 = Value.I32;
+			break;
+		case Param::Int64:
+			kind = WASMTIME_I64;
+			of.i64 = Value.I64;
+			break;
+		case Param::Float32:
+			kind = WASMTIME_F32;
+			of.f32 = Value.F32;
+			break;
+		case Param::Float64:
+			kind = WASMTIME_F64;
+			of.f64 = Value.F64;
+			break;
+		}
+
+		context.Params.pop();
+	}
+
+	return args;
+}
+
+ERenderStatus Runtime::Call(WasmtimeContext &context, const wasmtime_func_t &func,
+	const std::vector<wasmtime_val_t> &args, int32_t &result, uint32_t budget_us, EEntryPoint entry)
+{
+	RLT_TRACE_SCOPE("Runtime::Call");
+
+	if (context.Poisoned)
+		return ERenderStatus::Trap;
+
+	const auto profiled = m_config.profiler == EProfiler::Guest;
+	auto &profile = context.Host->Profile;
+
+	if (budget_us != 0 || profiled)
+		std::call_once(m_ticker_once, [this] { m_ticker = std::thread(&Runtime::Tick, this); });
+
+	// Deadlines are relative to the current epoch, so every call sets its own
+	const auto ticks = budget_us != 0 ? (budget_us + EpochTickUs - 1) / EpochTickUs + 1 : NoDeadline;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	// SampleGuest runs every tick and counts down the budget itself
+	if (profiled)
+	{
+		profile.Ticks = budget_us != 0 ? ticks : 0;
+		profile.TimedOut = false;
+		profile.Last = start;
+		wasmtime_context_set_epoch_deadline(context.Context, 1);
+	}
+	else
+	{
+		wasmtime_context_set_epoch_deadline(context.Context, ticks);
+	}
+
+	wasmtime_val_t results[1];
+
+	wasm_trap_t *trap = nullptr;
+	wasmtime_error_t *error =
+		wasmtime_func_call(context.Context, &func, args.data(), args.size(), results, 1, &trap);
+
+	auto &stats = *context.Stats;
+	stats.calls[static_cast<int>(entry)].Add(elapsed_us(start));
+	stats.memory_pages.store(wasmtime_memory_size(context.Context, &context.Memory.of.memory), std::memory_order_relaxed);
+
+	if (error != NULL || trap != NULL)
+		stats.traps.fetch_add(1, std::memory_order_relaxed);
+
+	if (profiled && profile.TimedOut)
+	{
+		if (error != NULL)
+			wasmtime_error_delete(error);
+		if (trap != NULL)
+			wasm_trap_delete(trap);
+
+		context.Poisoned = true;
+		return ERenderStatus::Timeout;
+	}
+
+	if (error != NULL)
+	{
+		print_error("failed to call renderlet", error, NULL);
+		return ERenderStatus::Trap;
+	}
+
+	if (trap != NULL)
+	{
+		// The guest stopped mid-call, its instance can't be trusted again
+		context.Poisoned = true;
+
+		wasmtime_trap_code_t code;
+		if (wasmtime_trap_code(trap, &code) && code == WASMTIME_TRAP_CODE_INTERRUPT)
+		{
+			wasm_trap_delete(trap);
+			return ERenderStatus::Timeout;
+		}
+
+		print_error("renderlet trapped", NULL, trap);
+		return ERenderStatus::Trap;
+	}
+
+	result = results[0].of.i32;
+	return ERenderStatus::Ok;
+}
+
+ERenderStatus Runtime::Invoke(WasmtimeContext &context, const std::vector<wasmtime_val_t> &args, uint8_t *&output,
+	uint32_t budget_us)
+{
+	if (context.Host->Arena.pins == 0)
+		context.Host->Arena.Rewind();
+
+	context.Host->Stream.Clear();
+
+	int32_t offset;
+	const auto status = Call(context, context.Run.of.func, args, offset, budget_us, EEntryPoint::Render);
+	if (status != ERenderStatus::Ok)
+		return status;
+
+	// Streamed calls return nothing worth reading
+	if (context.Host->Stream.active)
+	{
+		output = nullptr;
+		return ERenderStatus::Ok;
+	}
+
+	// [total length][version]...
+	output = wasmtime_memory_data(context.Context, &context.Memory.of.memory) + offset;
+	return ERenderStatus::Ok;
+}
+
+bool Runtime::ReadOutput(WasmtimeContext &context, uint8_t *output, RenderOutput &parsed, bool read_vectors,
+	std::vector<uint8_t> *copy)
+{
+	RLT_TRACE_SCOPE("Runtime::ReadOutput");
+
+	const auto start = std::chrono::steady_clock::now();
+
+	auto valid = false;
+	size_t length = 0;
+
+	if (output == nullptr)
+	{
+		valid = FinishStream(context, parsed, read_vectors);
+		length = parsed.vert_length + parsed.colors_length;
 	}
+	else
+	{
+		length = OutputLength(context, output);
 
-	// don't (yet) support tex arrays
-	unsigned int texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+		if (copy != nullptr)
+		{
+			copy->assign(output, output + length);
+			output = copy->data();
+		}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, type, 
-		desc.Width(), desc.Height(), 0, type, format, data);
-	glGenerateMipmap(GL_TEXTURE_2D);
+		valid = ParseOutput(output, length, parsed, read_vectors);
+	}
 
-	m_texs.emplace_back(texture);
+	auto &stats = *context.Stats;
+	stats.parse.Add(elapsed_us(start));
 
-	return m_texs.size() - 1;
-}
+	if (valid)
+	{
+		stats.output_bytes.fetch_add(length, std::memory_order_relaxed);
+		stats.nodes.fetch_add(parsed.nodes.size(), std::memory_order_relaxed);
+	}
 
-void PalOpenGL::UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[])
-{
-	return;
+	return valid;
 }
 
-void PalOpenGL::DeleteBuffer(ObjectID buffer_id)
+size_t Runtime::OutputLength(WasmtimeContext &context, const uint8_t *output)
 {
-	glDeleteVertexArrays(1, &m_vaos[buffer_id]);
-	glDeleteBuffers(1, &m_vbos[buffer_id]);
-}
+	const auto memory = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
+	const auto size = wasmtime_memory_data_size(context.Context, &context.Memory.of.memory);
+	const auto offset = static_cast<size_t>(output - memory);
 
-ObjectID PalOpenGL::CreateVector(int length, const uint8_t data[])
-{
-	return -1;
-}
+	if (offset > size || size - offset < sizeof(uint32_t))
+		return 0;
 
-ObjectID PalOpenGL::UpdateVector(int length, const uint8_t data[], ObjectID buffer_id)
-{
-	return -1;
+	return std::min<size_t>(*reinterpret_cast<const uint32_t *>(output), size - offset);
 }
 
-void wander::PalOpenGL::DrawVector(ObjectID buffer_id, int slot, int width, int height)
+bool Runtime::PinArena(WasmtimeContext &context, uint8_t *output)
 {
+	const auto memory = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
+	const auto offset = static_cast<uint64_t>(output - memory);
 
-}
+	if (!context.Host->Arena.Contains(offset, *reinterpret_cast<uint32_t *>(output)))
+		return false;
 
-void PalOpenGL::DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned stride)
-{
-	glBindVertexArray(m_vaos[buffer_id]);
-	glDrawArrays(GL_TRIANGLES, offset, length);
-	glBindVertexArray(0);
+	++context.Host->Arena.pins;
+	return true;
 }
 
-void PalOpenGL::DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length,
-	unsigned int stride, ObjectID material_buffer_id,unsigned int material_stride)
+void Runtime::UnpinArena(ObjectID renderlet_id)
 {
-	DrawTriangleList(buffer_id, offset, length, stride);
-}
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
 
-void RenderTreeNode::RenderFixedStride(IRuntime* runtime, unsigned int stride) const
-{
-	static_cast<Runtime*>(runtime)->PalImpl()->DrawTriangleList(m_buffer_id, m_offset, m_length, stride);
+	if (context != nullptr && context->Host->Arena.pins != 0)
+		--context->Host->Arena.pins;
 }
 
-void RenderTreeNode::RenderFixedStrideWithMaterial(IRuntime *runtime, unsigned stride, unsigned material_stride) const
+void Runtime::Tick()
 {
-	static_cast<Runtime *>(runtime)->PalImpl()->DrawTriangleListMultiBuffer(
-		m_buffer_id, m_offset, m_length, stride, m_material_buffer_id, material_stride
-	);
+	while (m_ticking.load(std::memory_order_relaxed))
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(EpochTickUs));
+		wasmtime_engine_increment_epoch(m_engine);
+	}
 }
 
-void RenderTreeNode::RenderVector(IRuntime *runtime, int slot, int width, int height) const
+Runtime::GuestProfile::~GuestProfile()
 {
-	static_cast<Runtime*>(runtime)->PalImpl()->DrawVector(m_buffer_id, slot, width, height);
+	if (Profiler != nullptr)
+		wasmtime_guestprofiler_delete(Profiler);
 }
 
-void RenderTreeNode::SetPooledBuffer(ObjectID buffer_id, int offset)
+wasmtime_guestprofiler_t *Runtime::NewGuestProfiler(const CompiledModule &compiled)
 {
-	m_buffer_id = buffer_id;
-	m_offset += offset;
-}
+	wasm_name_t name;
+	wasm_name_new_from_string(&name, "renderlet");
 
-std::string RenderTreeNode::Metadata() const
-{
-	return m_metadata;
+	const wasmtime_guestprofiler_modules_t modules[] = { { &name, compiled.Module } };
+	const auto profiler = wasmtime_guestprofiler_new(&name, EpochTickUs * 1000ull, modules, 1);
+
+	wasm_name_delete(&name);
+	return profiler;
 }
 
-#ifdef __EMSCRIPTEN__
+wasmtime_error_t *Runtime::SampleGuest(wasmtime_context_t *context, void *data, uint64_t *epoch_deadline_delta,
+	wasmtime_update_deadline_kind_t *update_kind)
+{
+	auto &profile = *static_cast<GuestProfile *>(data);
 
-EM_ASYNC_JS(uintptr_t, init_renderlet, (const char *str), {
-	if (Window.renderlet_id === undefined){
-		Window.renderlet_id = 0;
-	}
-	else {
-		++Window.renderlet_id;
+	const auto now = std::chrono::steady_clock::now();
+	if (profile.Profiler != nullptr)
+	{
+		const auto delta = std::chrono::duration_cast<std::chrono::nanoseconds>(now - profile.Last).count();
+		wasmtime_guestprofiler_sample(profile.Profiler, profile.Store, delta);
 	}
-	
-	await WebAssembly.instantiateStreaming(fetch(UTF8ToString(str)), {}).then(function(obj) {
-		Window["Start_" + Window.renderlet_id] = obj.instance.exports.Start;
-		Window["Start_mem_" + Window.renderlet_id] = obj.instance.exports.memory;
-	});
-	return Window.renderlet_id;
-});
+	profile.Last = now;
 
+	if (profile.Ticks != 0 && --profile.Ticks == 0)
+	{
+		profile.TimedOut = true;
+		return wasmtime_error_new("renderlet ran past its budget");
+	}
 
-EM_ASYNC_JS(uintptr_t, run_renderlet, (int id), {
-	var offset = Window["Start_" + id]();
-
-	var length_output = new Uint8Array(Window["Start_mem_" + id].buffer, offset, 4);
-	var view = new DataView(length_output.buffer, offset, 4);
-	var length = view.getUint32(0, true);
+	*epoch_deadline_delta = 1;
+	*update_kind = WASMTIME_UPDATE_DEADLINE_CONTINUE;
+	return nullptr;
+}
+#endif
 
-	var output = new Uint8Array(Window["Start_mem_" + id].buffer, offset, length);
+ObjectID Runtime::Render(const ObjectID renderlet_id, ObjectID tree_id, bool pool)
+{
+	ObjectID result = -1;
+	RenderCall(renderlet_id, tree_id, pool, 0, result);
 
-	var heapSpace = _malloc(output.length);
-	HEAP8.set(output, heapSpace);
-	return heapSpace;
-});
+	return result;
+}
 
-EM_ASYNC_JS(void, delete_renderlet, (int id), {
-	Window["Start_" + id] = {};
-	Window["Start_mem_" + id] = {};
-});
+ERenderStatus Runtime::RenderWithBudget(ObjectID renderlet_id, ObjectID &tree_id, uint32_t budget_us)
+{
+	ObjectID result = -1;
+	const auto status = RenderCall(renderlet_id, tree_id, false, budget_us, result);
 
-#endif
+	// Anything else leaves tree_id alone, the previous frame's tree is still there to draw
+	if (status == ERenderStatus::Ok)
+		tree_id = result;
 
-ObjectID wander::Runtime::LoadFromFile(const std::wstring& path)
-{
-	return LoadFromFile(path, "Start");
+	return status;
 }
 
-ObjectID wander::Runtime::LoadFromFile(const std::wstring& path, const std::string& function)
+ERenderStatus Runtime::RenderCall(ObjectID renderlet_id, ObjectID tree_id, bool pool, uint32_t budget_us, ObjectID &result)
 {
+	RLT_TRACE_SCOPE("Runtime::Render");
+
 #ifndef __EMSCRIPTEN__
 
-	auto context = WasmtimeContext{};
+	// Held until the output is consumed, the guest memory belongs to the renderlet
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr)
+		return ERenderStatus::Invalid;
 
-	auto conf = wasm_config_new();
-	wasmtime_config_wasm_simd_set(conf, true);
-	wasmtime_config_wasm_bulk_memory_set(conf, true);
-	wasmtime_config_wasm_multi_value_set(conf, true);
-	wasmtime_config_wasm_multi_memory_set(conf, true);
-	wasmtime_config_wasm_reference_types_set(conf, true);
-	wasmtime_config_wasm_threads_set(conf, true);
-	wasmtime_config_cranelift_opt_level_set(conf, WASMTIME_OPT_LEVEL_NONE);
-	wasmtime_config_parallel_compilation_set(conf, true);
-	wasmtime_config_cranelift_debug_verifier_set(conf, false);
-
-	m_engine = wasm_engine_new_with_config(conf);
-	assert(m_engine != NULL);
-	context.Store = wasmtime_store_new(m_engine, NULL, NULL);
-	assert(context.Store != NULL);
-	context.Context = wasmtime_store_context(context.Store);
+	uint8_t *output;
+	const auto status = Invoke(*context, PopArgs(*context), output, budget_us);
+	if (status != ERenderStatus::Ok)
+		return status;
 
-	// Create a linker with WASI functions defined
-	context.Linker = wasmtime_linker_new(m_engine);
-	wasmtime_error_t *error = wasmtime_linker_define_wasi(context.Linker);
-	if (error != NULL)
-		exit_with_error("failed to link wasi", error, NULL);
+	RenderOutput parsed;
+	if (!ReadOutput(*context, output, parsed, false))
+		return ERenderStatus::Invalid;
 
-	wasm_byte_vec_t wasm;
-	// Load our input file to parse it next
-	FILE *file;
-	if (_wfopen_s(&file, path.c_str(), L"rb") || !file)
-	{
-		printf("> Error loading file!\n");
-		exit(1);
-	}
-	fseek(file, 0L, SEEK_END);
-	size_t file_size = ftell(file);
-	wasm_byte_vec_new_uninitialized(&wasm, file_size);
-	fseek(file, 0L, SEEK_SET);
-	if (fread(wasm.data, file_size, 1, file) != 1)
+	// Pooled vertex data in the arena is uploaded from there by UploadBufferPool
+	if (pool && output != nullptr && PinArena(*context, output))
 	{
-		printf("> Error loading module!\n");
-		exit(1);
+		parsed.renderlet_id = renderlet_id;
+		parsed.arena_offset = parsed.verts - wasmtime_memory_data(context->Context, &context->Memory.of.memory);
 	}
-	fclose(file);
-
-	error = wasmtime_module_new(m_engine, (uint8_t *)wasm.data, wasm.size, &context.Module);
-	if (!context.Module)
-		exit_with_error("failed to compile module", error, NULL);
-	wasm_byte_vec_delete(&wasm);
-
-
-	// Instantiate wasi
-	wasi_config_t *wasi_config = wasi_config_new();
-	assert(wasi_config);
-	wasi_config_inherit_argv(wasi_config);
-	wasi_config_inherit_env(wasi_config);
-	wasi_config_inherit_stdin(wasi_config);
-	wasi_config_inherit_stdout(wasi_config);
-	wasi_config_inherit_stderr(wasi_config);
-
-	error = wasmtime_context_set_wasi(context.Context, wasi_config);
-	if (error != NULL)
-		exit_with_error("failed to instantiate WASI", error, NULL);
-
-	error = wasmtime_linker_module(context.Linker, context.Context, "", 0, context.Module);
-	if (error != NULL)
-		exit_with_error("failed to instantiate module", error, NULL);
-
-	if (!wasmtime_linker_get(context.Linker, context.Context, "", 0, 
-		function.c_str(), function.length(), &context.Run))
-		return -1;
-
-	if (!wasmtime_linker_get(context.Linker, context.Context, "", 0, 
-		"memory", 6, &context.Memory))
-		return -1;
 
-	m_contexts.push_back(context);
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	m_params.push_back({});
+	result = UploadOutput(parsed, tree_id, pool);
 
-	return m_contexts.size() - 1;
+	// Formats that don't go to the pool leave the pin behind
+	if (parsed.renderlet_id != -1)
+		--context->Host->Arena.pins;
 
 #else
+	const auto output = reinterpret_cast<uint8_t *>(run_renderlet(renderlet_id));
 
-	//init_renderlet(path.c_str());
-	m_context_count = init_renderlet("demo.wasm") + 1;
+	RenderOutput parsed;
+	if (!ParseOutput(output, *reinterpret_cast<uint32_t *>(output), parsed, false))
+		return ERenderStatus::Invalid;
 
-	return m_context_count - 1;
-#endif
-}
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-void wander::Runtime::PushParam(ObjectID renderlet_id, float value)
-{
-	Param p;
-	p.Type = Param::Float32;
-	p.Value.F32 = value;
+	result = UploadOutput(parsed, tree_id, pool);
+#endif
 
-	m_params[renderlet_id].push(p);
+	return result != -1 ? ERenderStatus::Ok : ERenderStatus::Invalid;
 }
 
-void wander::Runtime::PushParam(ObjectID renderlet_id, double value)
+void Runtime::RenderMany(RenderRequest *requests, size_t count)
 {
-	Param p;
-	p.Type = Param::Float64;
-	p.Value.F64 = value;
+	RLT_TRACE_SCOPE("Runtime::RenderMany");
 
-	m_params[renderlet_id].push(p);
-}
+#ifndef __EMSCRIPTEN__
+	std::call_once(m_workers_once, [this] { m_workers = std::make_unique<WorkStealingPool>(); });
 
-void wander::Runtime::PushParam(ObjectID renderlet_id, uint32_t value)
-{
-	Param p;
-	p.Type = Param::Int32;
-	p.Value.I32 = value;
+	// One batch at a time, the staged outputs are reused across frames
+	std::lock_guard<std::mutex> batch_lock(m_batch_mutex);
 
-	m_params[renderlet_id].push(p);
-}
+	if (m_batch.size() < count)
+		m_batch.resize(count);
 
-void wander::Runtime::PushParam(ObjectID renderlet_id, uint64_t value)
-{
-	Param p;
-	p.Type = Param::Int64;
-	p.Value.I64 = value;
+	m_workers->Run(count, [this, requests](size_t i)
+	{
+		auto &staged = m_batch[i];
+		staged.valid = false;
+		staged.output.renderlet_id = -1;
 
-	m_params[renderlet_id].push(p);
-}
+		std::unique_lock<std::mutex> renderlet_lock;
+		const auto context = LockContext(requests[i].renderlet_id, renderlet_lock);
+		if (context == nullptr)
+			return;
 
-void wander::Runtime::ResetStack(ObjectID renderlet_id)
-{
-	m_params[renderlet_id] = {};
-}
+		uint8_t *output;
+		if (Invoke(*context, PopArgs(*context), output) != ERenderStatus::Ok)
+			return;
 
-ObjectID wander::Runtime::BuildVector(uint32_t length, uint8_t *data, ObjectID tree_id)
-{
-	if (tree_id != -1)
-	{
-		auto buffer_id = m_render_trees[tree_id]->NodeAt(0)->BufferID();
+		if (output == nullptr)
+		{
+			staged.valid = ReadOutput(*context, nullptr, staged.output, true);
 
-		m_pal->UpdateVector(length, data, buffer_id);
+			// The chunks go with the output, the stream gets the previous buffers back to reuse
+			staged.bytes.swap(context->Host->Stream.verts);
+			staged.colors.swap(context->Host->Stream.colors);
+			return;
+		}
 
-		return tree_id;
-	}
+		const auto memory = wasmtime_memory_data(context->Context, &context->Memory.of.memory);
 
-	std::vector<RenderTreeNode> nodes;
+		// Arena outputs are parsed in place, pinned so a later request for the same renderlet allocates past them
+		if (PinArena(*context, output))
+		{
+			staged.valid = ReadOutput(*context, output, staged.output, true);
+			staged.output.renderlet_id = requests[i].renderlet_id;
+			staged.output.arena_offset = staged.output.verts - memory;
+			return;
+		}
+
+		// Copied out, the same renderlet may come up again later in this batch
+		staged.valid = ReadOutput(*context, output, staged.output, true, &staged.bytes);
+	});
 
-	auto id = m_pal->CreateVector(length, data);
+	{
+		// Unload waits for this, parsed outputs may point into renderlet memory
+		std::shared_lock<std::shared_mutex> lookup(m_contexts_mutex);
 
-	auto node = RenderTreeNode{id, BufferType::Texture2D, "", 0, 0};
+		// Uploads happen here, in request order, whatever order the workers finished in
+		std::lock_guard<std::mutex> lock(m_mutex);
 
-	nodes.push_back(node);
+		for (size_t i = 0; i < count; ++i)
+		{
+			requests[i].result = m_batch[i].valid ? UploadOutput(m_batch[i].output, requests[i].tree_id, requests[i].pool) : -1;
+		}
+	}
 
-	m_render_trees.push_back(std::make_unique<RenderTree>(nodes));
-	return m_render_trees.size() - 1;
+	// Pins not handed on to the pool
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (m_batch[i].output.renderlet_id != -1)
+			UnpinArena(m_batch[i].output.renderlet_id);
+	}
+#else
+	for (size_t i = 0; i < count; ++i)
+	{
+		requests[i].result = Render(requests[i].renderlet_id, requests[i].tree_id, requests[i].pool);
+	}
+#endif
 }
 
-ObjectID wander::Runtime::BuildVertexWithMaterial(uint8_t* output)
+ObjectID Runtime::RenderTiled(ObjectID renderlet_id, uint32_t tiles, unsigned int stride)
 {
-	BufferDescriptor desc{BufferType::Vertex};
+	RLT_TRACE_SCOPE("Runtime::RenderTiled");
 
-	// +0 is version
-	auto vert_length = *reinterpret_cast<uint32_t *>(output + sizeof(uint32_t));
-	auto vert_format = *reinterpret_cast<uint32_t *>(output + 2 * sizeof(uint32_t));
-	auto verts = output + 3 * sizeof(uint32_t);
+#ifndef __EMSCRIPTEN__
+	if (tiles == 0)
+		return -1;
 
-	auto id = m_pal->CreateBuffer(desc, vert_length, verts);
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr)
+		return -1;
 
-	auto colors_length = *reinterpret_cast<uint32_t*>(verts + vert_length);
-	auto colors = verts + vert_length + 4;
-	desc = BufferDescriptor{BufferType::DynamicMaterial};
+	// Extra instances are made on first use and kept, the module is only compiled once
+	while (context->Tiles.size() + 1 < tiles)
+	{
+		auto tile = std::make_unique<WasmtimeContext>();
+		tile->Compiled = context->Compiled;
+		tile->Function = context->Function;
+		tile->Stats = context->Stats;
 
-	auto material_id = m_pal->CreateBuffer(desc, colors_length, colors);
+		if (!Instantiate(*tile))
+		{
+			wasmtime_store_delete(tile->Store);
+			return -1;
+		}
 
+		context->Tiles.push_back(std::move(tile));
+	}
 
-	auto mat_length = *reinterpret_cast<uint32_t *>(colors + colors_length);
-	auto mats = colors + colors_length + 4;
-	auto mat = std::string(mats, mats + mat_length);
+	const auto args = PopArgs(*context);
 
-	std::vector<RenderTreeNode> nodes;
+	std::vector<RenderOutput> outputs(tiles);
+	std::vector<char> valid(tiles, false);
 
-	// TODO - binary going to be more efficient
-	std::string line;
-	std::istringstream ss(mat);
-	while (std::getline(ss, line))
+	const auto run = [&](uint32_t tile)
 	{
-		auto values = split_fixed<5>(',', line);
+		auto &instance = tile == 0 ? *context : *context->Tiles[tile - 1];
 
-		int VertexOffset = atoi(values[1].data());
-		int VertexLength = atoi(values[2].data());
+		auto tile_args = args;
+		tile_args.resize(args.size() + 2);
+		tile_args[args.size()].kind = WASMTIME_I32;
+		tile_args[args.size()].of.i32 = static_cast<int32_t>(tile);
+		tile_args[args.size() + 1].kind = WASMTIME_I32;
+		tile_args[args.size() + 1].of.i32 = static_cast<int32_t>(tiles);
 
-		auto node = RenderTreeNode{id, material_id, BufferType::Vertex, line, VertexOffset, VertexLength};
+		uint8_t *output;
+		valid[tile] = Invoke(instance, tile_args, output) == ERenderStatus::Ok &&
+			ReadOutput(instance, output, outputs[tile], false);
+	};
 
-		nodes.push_back(node);
-	}
+	// Own threads rather than the RenderMany pool, whose workers may be waiting on this renderlet's lock
+	std::vector<std::thread> threads;
+	for (uint32_t tile = 1; tile < tiles; ++tile)
+		threads.emplace_back(run, tile);
 
-	m_render_trees.push_back(std::make_unique<RenderTree>(nodes));
+	run(0);
 
-	return m_render_trees.size() - 1;
-}
+	for (auto &thread : threads)
+		thread.join();
 
-void Runtime::CreatePooledBuffer(uint32_t length, uint8_t *data, ObjectID tree_id)
-{
-	auto offset = 0;
-	if (m_staging_buffer == nullptr)
-	{
-		m_staging_buffer = std::make_unique<uint8_t[]>(600 * 1024 * 1024); // MB
-	}
-	else
-	{
-		const auto& sub = m_sub_buffers.back();
-		offset = sub.offset + sub.length;
-	}
+	// Tiles must all produce plain vertex output in the same layout
+	const auto &first = outputs[0];
+	if (stride == 0)
+		stride = first.stride;
 
-	memcpy(&m_staging_buffer[offset], data, length);
+	if (stride == 0)
+		return -1;
 
-	m_sub_buffers.emplace_back(
-		SubBuffer {
-			offset,
-			length,
-			tree_id
-		}
-	);
-}
+	for (uint32_t tile = 0; tile < tiles; ++tile)
+	{
+		const auto &output = outputs[tile];
 
-ObjectID Runtime::Render(const ObjectID renderlet_id, ObjectID tree_id, bool pool)
-{
-#ifndef __EMSCRIPTEN__
+		if (!valid[tile] || output.vert_format != 1 || output.vert_length % stride != 0 ||
+			output.attributes.size() != first.attributes.size() ||
+			(!first.attributes.empty() &&
+				!(VertexLayout(output.attributes, output.stride) == VertexLayout(first.attributes, first.stride))))
+			return -1;
+	}
 
-	std::vector<wasmtime_val_t> args(m_params[renderlet_id].size());
+	RenderOutput joined;
+	joined.vert_format = 1;
+	joined.stride = first.stride;
+	joined.attributes = first.attributes;
 
-	for (auto& [kind, of] : args)
+	std::vector<uint8_t> verts;
+	auto base = 0;
+
+	// Node offsets are in vertices, each tile's move past the tiles before it
+	for (auto &output : outputs)
 	{
-		switch (const auto [Type, Value] = m_params[renderlet_id].front(); Type)
+		verts.insert(verts.end(), output.verts, output.verts + output.vert_length);
+
+		for (auto &texture : output.textures)
 		{
-		case Param::Int32:
-			kind = WASMTIME_I32;
-			of.i32 = Value.I32;
-			break;
-		case Param::Int64:
-			kind = WASMTIME_I64;
-			of.i64 = Value.I64;
-			break;
-		case Param::Float32:
-			kind = WASMTIME_F32;
-			of.f32 = Value.F32;
-			break;
-		case Param::Float64:
-			kind = WASMTIME_F64;
-			of.f64 = Value.F64;
-			break;
+			texture.node += static_cast<int>(joined.nodes.size());
+			joined.textures.push_back(std::move(texture));
+		}
+
+		for (auto &range : output.nodes)
+		{
+			range.offset += base;
+			joined.nodes.push_back(std::move(range));
 		}
 
-		m_params[renderlet_id].pop();
+		base += static_cast<int>(output.vert_length / stride);
 	}
 
-	auto &context = m_contexts[renderlet_id];
+	joined.verts = verts.data();
+	joined.vert_length = static_cast<uint32_t>(verts.size());
 
-	wasmtime_val_t results[1];
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	
-	wasm_trap_t *trap = nullptr;
-	wasmtime_error_t *error =
-		wasmtime_func_call(context.Context, &context.Run.of.func, args.data(), args.size(), results, 1, &trap);
+	return UploadOutput(joined, -1, false);
+#else
+	return tiles == 1 ? Render(renderlet_id) : -1;
+#endif
+}
 
-	if (error != NULL || trap != NULL)
-		exit_with_error("failed to call run", error, trap);
+ObjectID Runtime::RenderInstanced(ObjectID renderlet_id, const float *transforms, uint32_t count, ObjectID tree_id)
+{
+	RLT_TRACE_SCOPE("Runtime::RenderInstanced");
 
-	auto mem = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
-	auto offset = results[0].of.i32; 
+#ifndef __EMSCRIPTEN__
+	if (transforms == nullptr || count == 0)
+		return -1;
 
-	// CreateBuffer with this
-	auto output = mem + offset + 4;
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr)
+		return -1;
 
-#else
-	auto value = run_renderlet(renderlet_id);
+	uint8_t *output;
+	if (Invoke(*context, PopArgs(*context), output) != ERenderStatus::Ok)
+		return -1;
+
+	RenderOutput parsed;
+	if (!ReadOutput(*context, output, parsed, false))
+		return -1;
 
-	uint8_t *output = reinterpret_cast<uint8_t *>(value + 4);
+	std::lock_guard<std::mutex> lock(m_mutex);
 
+	return BuildInstanced(parsed, transforms, count, tree_id);
+#else
+	return -1;
 #endif
+}
 
-	BufferDescriptor desc { BufferType::Vertex };
+bool Runtime::InstancedGeometry::Matches(const RenderOutput &output) const
+{
+	if (verts.size() != output.vert_length || memcmp(verts.data(), output.verts, verts.size()) != 0 ||
+		stride != output.stride || attributes.size() != output.attributes.size() ||
+		ranges.size() != output.nodes.size() || textures.size() != output.textures.size())
+		return false;
 
-	auto version = *reinterpret_cast<uint32_t *>(output);
-	if (version != 1)
+	for (size_t i = 0; i < attributes.size(); ++i)
 	{
-		return -1;
+		const auto &a = attributes[i];
+		const auto &b = output.attributes[i];
+		if (a.semantic != b.semantic || a.format != b.format || a.offset != b.offset)
+			return false;
 	}
 
-	auto vert_length = *reinterpret_cast<uint32_t *>(output + sizeof(uint32_t));
-	auto vert_format = *reinterpret_cast<uint32_t *>(output + 2 * sizeof(uint32_t));
-	auto verts = output + 3 * sizeof(uint32_t);
-
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		const auto &a = ranges[i];
+		const auto &b = output.nodes[i];
+		if (a.offset != b.offset || a.length != b.length || a.metadata != b.metadata)
+			return false;
+	}
 
-	if (vert_format == 2)
+	for (size_t i = 0; i < textures.size(); ++i)
 	{
-		return BuildVector(vert_length, verts, tree_id);
+		if (textures[i].node != output.textures[i].node || textures[i].texture != output.textures[i].texture)
+			return false;
 	}
-	if (vert_format == 3)
+
+	return true;
+}
+
+ObjectID Runtime::BuildInstanced(RenderOutput &output, const float *transforms, uint32_t count, ObjectID tree_id)
+{
+	if (output.vert_format != 1)
+		return -1;
+
+	// Everything that ends up in the buffers and nodes, textures by their cached pointer, which
+	// the geometry entry keeps alive
+	const auto bytes = [](const void *data) { return static_cast<const uint8_t *>(data); };
+
+	auto hash = HashBytes(output.verts, output.vert_length);
+	hash = HashBytes(bytes(&output.stride), sizeof(output.stride), hash);
+
+	for (const auto &attribute : output.attributes)
+		hash = HashBytes(bytes(&attribute), sizeof(attribute), hash);
+
+	for (const auto &range : output.nodes)
 	{
-		desc = {BufferType::Index};
+		const int span[] = {range.offset, range.length};
+		hash = HashBytes(bytes(span), sizeof(span), hash);
+		hash = HashBytes(bytes(range.metadata.data()), range.metadata.size(), hash);
 	}
-	if (vert_format == 4)
+
+	for (const auto &[node, texture] : output.textures)
 	{
-		return BuildVertexWithMaterial(output);
+		const uint64_t record[] = {static_cast<uint64_t>(node), reinterpret_cast<uintptr_t>(texture.get())};
+		hash = HashBytes(bytes(record), sizeof(record), hash);
 	}
 
-	auto id = pool ? -1 : m_pal->CreateBuffer(desc, vert_length, verts);
+	const auto transforms_size = static_cast<size_t>(count) * 16 * sizeof(float);
+	if (transforms_size > static_cast<size_t>(std::numeric_limits<int>::max()))
+		return -1;
 
-	auto mat_length = *reinterpret_cast<uint32_t *>(verts + vert_length);
-	auto mats = verts + vert_length + 4;
-	auto mat = std::string(mats, mats + mat_length);
+	const auto transforms_length = static_cast<int>(transforms_size);
+	const auto transform_bytes = reinterpret_cast<const uint8_t *>(transforms);
 
-	std::vector<RenderTreeNode> nodes;
+	auto geometry = m_instanced_geometry.find(hash);
+	while (geometry != m_instanced_geometry.end() && !geometry->second.Matches(output))
+		geometry = m_instanced_geometry.find(++hash);
 
-	// TODO - binary going to be more efficient
-	std::string line;
-	std::istringstream ss(mat);
-	while (std::getline(ss, line))
+	// Same geometry and count as last frame, only the transforms change
+	const auto previous = m_instanced_trees.find(tree_id);
+	if (previous != m_instanced_trees.end() && geometry != m_instanced_geometry.end() &&
+		previous->second.hash == hash && previous->second.count == count)
 	{
-		auto values = split_fixed<5>(',', line);
+		UpdateBufferRange(previous->second.instance_buffer_id, 0, transforms_length, transform_bytes);
+		PublishTree(tree_id);
 
-		int VertexOffset = atoi(values[1].data());
-		int VertexLength = atoi(values[2].data());
+		return tree_id;
+	}
 
-		auto node = RenderTreeNode{id, BufferType::Vertex, line, VertexOffset, VertexLength};
+	if (geometry == m_instanced_geometry.end())
+	{
+		ObjectID layout_id = -1;
+		if (!output.attributes.empty())
+			layout_id = m_pal->CreateVertexLayout(VertexLayout(output.attributes, output.stride));
 
-		nodes.push_back(node);
+		const BufferDescriptor desc{BufferType::Vertex, BufferFormat::Custom, 0, 0, 0, layout_id};
+		const auto id = CreateBuffer(desc, output.vert_length, output.verts);
+		if (id == -1)
+			return -1;
+
+		InstancedGeometry created;
+		for (const auto &range : output.nodes)
+		{
+			created.nodes.emplace_back(id, BufferType::Vertex, range.metadata, range.offset, range.length);
+			created.nodes.back().SetVertexLayout(layout_id);
+		}
+
+		AttachTextures(output, created.nodes, created.allocations);
+
+		created.verts.assign(output.verts, output.verts + output.vert_length);
+		created.stride = output.stride;
+		created.attributes = output.attributes;
+		created.ranges = output.nodes;
+		created.textures = output.textures;
+
+		geometry = m_instanced_geometry.emplace(hash, std::move(created)).first;
 	}
-	
-	m_render_trees.push_back(std::make_unique<RenderTree>(nodes));
 
-	if (pool)
+	// Created empty so updates can write it in place, D3D11 needs a default usage buffer for that
+	const auto instance_buffer_id = CreateBuffer(BufferDescriptor{BufferType::Vertex}, transforms_length, nullptr);
+	if (instance_buffer_id == -1)
 	{
-		CreatePooledBuffer(vert_length, verts, m_render_trees.size() - 1);
+		if (geometry->second.refs == 0)
+			ReleaseGeometry(hash);
+
+		return -1;
 	}
 
-	return m_render_trees.size() - 1;
+	UpdateBufferRange(instance_buffer_id, 0, transforms_length, transform_bytes);
+
+	auto nodes = geometry->second.nodes;
+	for (auto &node : nodes)
+		node.SetInstances(instance_buffer_id, count);
+
+	const auto new_tree_id = m_render_trees.Insert(std::make_unique<RenderTree>(nodes));
+
+	++geometry->second.refs;
+	m_instanced_trees[new_tree_id] = {hash, instance_buffer_id, count};
+
+	PublishTree(new_tree_id);
+
+	return new_tree_id;
 }
 
 const float* const Runtime::ExecuteFloat4(ObjectID renderlet_id, const std::string& function)
 {
-	std::vector<wasmtime_val_t> args(m_params[renderlet_id].size());
-
-	for (auto &[kind, of] : args)
-	{
-		switch (const auto [Type, Value] = m_params[renderlet_id].front(); Type)
-		{
-		case Param::Int32:
-			kind = WASMTIME_I32;
-			of.i32 = Value.I32;
-			break;
-		case Param::Int64:
-			kind = WASMTIME_I64;
-			of.i64 = Value.I64;
-			break;
-		case Param::Float32:
-			kind = WASMTIME_F32;
-			of.f32 = Value.F32;
-			break;
-		case Param::Float64:
-			kind = WASMTIME_F64;
-			of.f64 = Value.F64;
-			break;
-		}
+	RLT_TRACE_SCOPE("Runtime::ExecuteFloat4");
 
-		m_params[renderlet_id].pop();
-	}
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
 
-	auto& context = m_contexts[renderlet_id];
+	return context != nullptr ? CallFloat4(*context, function, EEntryPoint::Float4) : nullptr;
+}
 
-	wasmtime_val_t results[1];
+const float *Runtime::CallFloat4(WasmtimeContext &context, const std::string &function, EEntryPoint entry)
+{
+	const auto args = PopArgs(context);
 
 	wasmtime_extern_t expression{};
 
-	if (!wasmtime_linker_get(context.Linker, context.Context, "", 0, 
+	if (!wasmtime_instance_export_get(context.Context, &context.Instance, 
 		function.c_str(), function.length(), &expression))
 		return nullptr;
 
-	wasm_trap_t *trap = nullptr;
-	wasmtime_error_t *error =
-		wasmtime_func_call(context.Context, &expression.of.func, args.data(), args.size(), results, 1, &trap);
-
-	if (error != NULL || trap != NULL)
-		exit_with_error("failed to call expression", error, trap);
+	int32_t offset;
+	if (Call(context, expression.of.func, args, offset, 0, entry) != ERenderStatus::Ok)
+		return nullptr;
 
 	auto mem = wasmtime_memory_data(context.Context, &context.Memory.of.memory);
-	auto offset = results[0].of.i32;
 
 	return reinterpret_cast<float*>(mem + offset);
 }
@@ -1289,93 +6109,291 @@ const float* const Runtime::ExecuteFloat4(ObjectID renderlet_id, const std::stri
 
 void Runtime::ExecuteMaterial(ObjectID renderlet_id, const RenderTreeNode* node, const std::string &function)
 {
-	const auto output = reinterpret_cast<const uint32_t*>(ExecuteFloat4(renderlet_id, function));
+	RLT_TRACE_SCOPE("Runtime::ExecuteMaterial");
+
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+	if (context == nullptr)
+		return;
 
-	m_pal->UpdateBuffer(node->MaterialBufferID(), output[0], reinterpret_cast<const uint8_t*>(output) + sizeof(uint32_t));
+	const auto output = reinterpret_cast<const uint32_t*>(CallFloat4(*context, function, EEntryPoint::Material));
+	if (output == nullptr)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	UpdateBuffer(node->MaterialBufferID(), output[0], reinterpret_cast<const uint8_t*>(output) + sizeof(uint32_t));
+
+	if (m_deferred)
+		m_deferred->Submit();
 }
 
 void wander::Runtime::ExecuteBuffer(ObjectID renderlet_id, const std::string& function, uint32_t* length, const uint8_t** data)
 {
-	const auto output = reinterpret_cast<const uint32_t *>(ExecuteFloat4(renderlet_id, function));
+	RLT_TRACE_SCOPE("Runtime::ExecuteBuffer");
+
+	std::unique_lock<std::mutex> renderlet_lock;
+	const auto context = LockContext(renderlet_id, renderlet_lock);
+
+	const auto output = context != nullptr ?
+		reinterpret_cast<const uint32_t *>(CallFloat4(*context, function, EEntryPoint::Buffer)) : nullptr;
+	if (output == nullptr)
+	{
+		*length = 0;
+		*data = nullptr;
+		return;
+	}
+
 	*length = output[0];
 	*data = reinterpret_cast<const uint8_t*>(&output[1]);
 }
 
 void Runtime::UploadBufferPool(unsigned int stride)
 {
-	const auto& last = m_sub_buffers.back();
+	RLT_TRACE_SCOPE("Runtime::UploadBufferPool");
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if (m_sub_buffers.empty())
+		return;
+
+	// Taken whole, pooled renders from here on start the next pool
+	std::vector<SubBuffer> subs;
+	subs.swap(m_sub_buffers);
+	const auto staging = std::move(m_staging_buffer);
+
+	const auto& last = subs.back();
 	const auto length = last.offset + last.length;
 
+	const auto in_arena = std::any_of(subs.begin(), subs.end(),
+		[](const SubBuffer &sub) { return sub.renderlet_id != -1; });
+
 	const BufferDescriptor desc{BufferType::Vertex};
-	const auto id = m_pal->CreateBuffer(desc, length, m_staging_buffer.get());
+	const auto id = CreateBuffer(desc, length, in_arena ? nullptr : staging.get());
+
+#ifndef __EMSCRIPTEN__
+	if (in_arena)
+	{
+		lock.unlock();
+
+		// Guest memory is read under the renderlet's lock, taken before m_mutex as everywhere else
+		for (const auto &sub : subs)
+		{
+			std::unique_lock<std::mutex> renderlet_lock;
+			const auto context = sub.renderlet_id != -1 ? LockContext(sub.renderlet_id, renderlet_lock) : nullptr;
+
+			// Unloaded renderlets leave their range empty
+			if (sub.renderlet_id != -1 && context == nullptr)
+				continue;
+
+			const auto data = context != nullptr ?
+				wasmtime_memory_data(context->Context, &context->Memory.of.memory) + sub.arena_offset :
+				&staging[sub.offset];
+
+			{
+				std::lock_guard<std::mutex> pal_lock(m_mutex);
+				UpdateBufferRange(id, sub.offset, static_cast<int>(sub.length), data);
+			}
+
+			if (context != nullptr)
+				--context->Host->Arena.pins;
+		}
+
+		lock.lock();
+	}
+#endif
 
 	auto offset = 0;
 
-	for (const auto& sub: m_sub_buffers)
+	for (const auto& sub: subs)
 	{
-		const auto* tree = m_render_trees[sub.tree_id].get();
-
-		for (auto i = 0; i < tree->Length(); ++i)
+		// Trees destroyed before the upload keep their place in the pool
+		if (const auto tree = m_render_trees.Get(sub.tree_id))
 		{
-			const_cast<RenderTreeNode*>(tree->NodeAt(i))->SetPooledBuffer(id, offset);
+			for (auto i = 0; i < (*tree)->Length(); ++i)
+			{
+				const_cast<RenderTreeNode*>((*tree)->NodeAt(i))->SetPooledBuffer(id, offset);
+			}
+
+			if (m_deferred)
+				m_deferred->RecordTree(sub.tree_id, **tree);
 		}
 
 		offset += sub.length / stride;
 	}
 
-	m_staging_buffer.reset(nullptr);
-	m_sub_buffers.clear();
+	if (m_deferred)
+		m_deferred->Submit();
+}
+
+void Runtime::PublishTree(ObjectID tree_id)
+{
+	if (!m_deferred)
+		return;
+
+	// One batch per render call, the render thread sees the buffers and the tree together
+	m_deferred->RecordTree(tree_id, **m_render_trees.Get(tree_id));
+	m_deferred->Submit();
 }
 
 const RenderTree *wander::Runtime::GetRenderTree(ObjectID tree_id)
 {
-	return m_render_trees[tree_id].get();
+	if (m_deferred)
+		return m_deferred->DrawnTree(tree_id);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const auto tree = m_render_trees.Get(tree_id);
+	return tree != nullptr ? tree->get() : nullptr;
+}
+
+const VertexLayout *wander::Runtime::GetVertexLayout(ObjectID layout_id)
+{
+	if (m_deferred)
+		return m_deferred->VertexLayoutAt(layout_id);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_pal->VertexLayoutAt(layout_id);
+}
+
+VectorUpdateStats wander::Runtime::GetVectorUpdateStats(ObjectID tree_id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const auto it = m_vectors.find(tree_id);
+	if (it == m_vectors.end())
+		return {0, 0};
+
+	const auto &changes = it->second.diff.Changes();
+	return {static_cast<uint32_t>(changes.changed.size()), changes.unchanged};
 }
 
 void wander::Runtime::DestroyRenderTree(ObjectID tree_id)
 {
-	for (auto i = 0; i < m_render_trees[tree_id]->Length(); ++i)
+	RLT_TRACE_SCOPE("Runtime::DestroyRenderTree");
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const auto tree = m_render_trees.Get(tree_id);
+	if (tree == nullptr)
+		return;
+
+	// Instanced trees own their transforms, the geometry goes with the last tree using it
+	const auto instanced = m_instanced_trees.find(tree_id);
+	if (instanced != m_instanced_trees.end())
+	{
+		m_pal->DeleteBuffer(instanced->second.instance_buffer_id);
+		ReleaseGeometry(instanced->second.hash);
+
+		m_instanced_trees.erase(instanced);
+	}
+	else
+	{
+		for (auto i = 0; i < (*tree)->Length(); ++i)
+			DeleteNodeResources(*(*tree)->NodeAt(i));
+	}
+
+	// Atlas slots go back once no tree uses them, the pages stay
+	const auto allocations = m_atlas_allocations.find(tree_id);
+	if (allocations != m_atlas_allocations.end())
+	{
+		for (const auto &allocation : allocations->second)
+			m_atlas.Release(allocation);
+
+		m_atlas_allocations.erase(allocations);
+	}
+
+	m_render_trees.Erase(tree_id);
+	m_vectors.erase(tree_id);
+
+	if (m_deferred)
 	{
-		const auto node = m_render_trees[tree_id]->NodeAt(i);
-		if (node->Type() == BufferType::Vertex)
-			m_pal->DeleteBuffer(node->BufferID());
-		// TODO - other resource types
+		m_deferred->RecordDestroyTree(tree_id);
+		m_deferred->Submit();
 	}
+}
+
+void Runtime::DeleteNodeResources(const RenderTreeNode &node)
+{
+	// Nodes share buffers, deleting an ID twice is a no-op
+	m_pal->DeleteBuffer(node.BufferID());
+
+	if (node.MaterialBufferID() != -1)
+		m_pal->DeleteBuffer(node.MaterialBufferID());
+
+	if (node.TextureID() != -1 && !m_atlas.IsPage(node.TextureID()))
+		m_pal->DeleteBuffer(node.TextureID());
+}
+
+void Runtime::ReleaseGeometry(uint64_t hash)
+{
+	const auto geometry = m_instanced_geometry.find(hash);
+	if (geometry == m_instanced_geometry.end() || (geometry->second.refs != 0 && --geometry->second.refs != 0))
+		return;
+
+	for (const auto &node : geometry->second.nodes)
+		DeleteNodeResources(node);
+
+	for (const auto &allocation : geometry->second.allocations)
+		m_atlas.Release(allocation);
+
+	m_instanced_geometry.erase(geometry);
+}
 
-	m_render_trees[tree_id]->Clear();
+void wander::Runtime::DrainPalCommands()
+{
+	if (m_deferred)
+		m_deferred->Drain();
 }
 
 void wander::Runtime::Unload(ObjectID renderlet_id)
 {
-	if (renderlet_id >= 0 && m_contexts[renderlet_id].Module != nullptr)
+	std::unique_lock<std::shared_mutex> lookup(m_contexts_mutex);
+
+	const auto context = m_contexts.Get(renderlet_id);
+	if (context == nullptr)
+		return;
+
+	// Wait out a call already running on this renderlet, no new one starts while lookup is held
+	context->Lock->lock();
+	context->Lock->unlock();
+
+	// Kept in the global stats, all but the memory it no longer has
+	{
+		std::lock_guard<std::mutex> lock(m_stats_mutex);
+
+		context->Stats->Read(m_unloaded_stats);
+		m_unloaded_stats.memory_pages = 0;
+	}
+
+	// The compiled module stays cached for the next load of the same path
+	if (context->Store != nullptr)
 	{
-		ResetStack(renderlet_id);
-		wasmtime_module_delete(m_contexts[renderlet_id].Module);
-		wasmtime_store_delete(m_contexts[renderlet_id].Store);
-		wasmtime_linker_delete(m_contexts[renderlet_id].Linker);
-		m_contexts[renderlet_id].Module = nullptr;
-		m_contexts[renderlet_id].Store = nullptr;
-		m_contexts[renderlet_id].Linker = nullptr;
+		for (const auto &tile : context->Tiles)
+		{
+			wasmtime_store_delete(tile->Store);
+		}
+
+		wasmtime_store_delete(context->Store);
 	}
+
+	m_contexts.Erase(renderlet_id);
 }
 
 void wander::Runtime::Release()
 {
 #ifndef __EMSCRIPTEN__
-	for (auto i = 0; i < m_render_trees.size(); ++i)
-	{
-		DestroyRenderTree(i);
-	}
+	m_render_trees.ForEach([this](ObjectID tree_id, std::unique_ptr<RenderTree> &) { DestroyRenderTree(tree_id); });
+	m_contexts.ForEach([this](ObjectID renderlet_id, WasmtimeContext &) { Unload(renderlet_id); });
 
-	m_render_trees.clear();
-
-	for (auto i = 0; i < m_contexts.size(); ++i)
+	m_ticking = false;
+	if (m_ticker.joinable())
 	{
-		Unload(i);
+		m_ticker.join();
 	}
 
-	m_contexts.clear();
-	m_params.clear();
+	m_modules.clear();
 
 	if (m_engine)
 	{
@@ -1387,6 +6405,9 @@ void wander::Runtime::Release()
 		delete_renderlet(i);
 	}
 #endif
+	// Deletes recorded above still have to reach the real PAL
+	DrainPalCommands();
+
 	m_pal->Release();
 }
 
@@ -1414,6 +6435,8 @@ IPal* wander::Factory::CreatePal(EPalType type, ARGs &&...args)
 	case EPalType::D3D11:
 		return construct<PalD3D11, ARGs...>(std::forward<ARGs>(args)...);
 #endif
+	case EPalType::Software:
+		return construct<PalSoftware, ARGs...>(std::forward<ARGs>(args)...);
 	case EPalType::OpenGL:
 	default:
 		return construct<PalOpenGL, ARGs...>(std::forward<ARGs>(args)...);
@@ -1426,9 +6449,26 @@ IRuntime* wander::Factory::CreateRuntime(IPal *pal)
 	return new Runtime(static_cast<Pal *>(pal));
 }
 
+IRuntime* wander::Factory::CreateRuntime(IPal *pal, ERuntimeMode mode)
+{
+	RuntimeConfig config;
+	config.mode = mode;
+
+	return new Runtime(static_cast<Pal *>(pal), config);
+}
+
+IRuntime* wander::Factory::CreateRuntime(IPal *pal, const RuntimeConfig &config)
+{
+	return new Runtime(static_cast<Pal *>(pal), config);
+}
+
 
 template class wander::IPal *__cdecl wander::Factory::CreatePal<void *>(enum wander::EPalType, void *&&);
 
+template class wander::IPal *__cdecl wander::Factory::CreatePal<int, int>(enum wander::EPalType, int &&, int &&);
+template class wander::IPal *__cdecl wander::Factory::CreatePal<int &, int &>(enum wander::EPalType, int &, int &);
+template class wander::IPal *__cdecl wander::Factory::CreatePal<int, int, int>(enum wander::EPalType, int &&, int &&, int &&);
+
 #ifdef _WIN32
 
 template class wander::IPal *__cdecl wander::Factory::CreatePal<struct ID3D11Device *&, struct ID3D11DeviceContext *&>
@@ -1511,3 +6551,146 @@ std::streampos CByteArrayStreambuf::seekpos(std::streampos sp, std::ios_base::op
 
 	return m_current - m_begin;
 }
+
+#if defined(RLT_TRACE)
+std::mutex Tracer::s_mutex;
+std::vector<std::unique_ptr<Tracer::Ring>> Tracer::s_rings;
+std::vector<Tracer::Ring *> Tracer::s_free;
+uint32_t Tracer::s_threads = 0;
+const uint64_t Tracer::s_base_ticks = Tracer::Now();
+const uint64_t Tracer::s_base_ns = Tracer::SteadyNs();
+thread_local Tracer::Ring *Tracer::s_ring = nullptr;
+thread_local bool Tracer::s_exited = false;
+
+Tracer::Owner::~Owner()
+{
+	// The ring may go to another thread, this one must not write to it any more
+	s_ring = nullptr;
+	s_exited = true;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_free.push_back(ring);
+}
+
+Tracer::Ring *Tracer::ThisThread()
+{
+	if (s_ring != nullptr)
+		return s_ring;
+
+	if (s_exited)
+		return nullptr;
+
+	thread_local Owner owner;
+
+	if (owner.ring == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+
+		if (!s_free.empty())
+		{
+			owner.ring = s_free.back();
+			s_free.pop_back();
+		}
+		else
+		{
+			s_rings.push_back(std::make_unique<Ring>());
+			owner.ring = s_rings.back().get();
+		}
+
+		owner.ring->thread = ++s_threads;
+	}
+
+	s_ring = owner.ring;
+	return s_ring;
+}
+
+void Tracer::Record(const char *name, uint64_t start, uint64_t end)
+{
+	const auto thread_ring = ThisThread();
+	if (thread_ring == nullptr)
+		return;
+
+	auto &ring = *thread_ring;
+
+	const auto head = ring.head.load(std::memory_order_relaxed);
+	auto &slot = ring.slots[head % RingSize];
+
+	// Plain stores on x86, the fences only keep the compiler from reordering them
+	slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.start.store(start, std::memory_order_relaxed);
+	slot.duration.store(end - start, std::memory_order_relaxed);
+	slot.thread.store(ring.thread, std::memory_order_relaxed);
+
+	slot.sequence.store(2 * head + 2, std::memory_order_release);
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+std::string Tracer::Export()
+{
+	// Ticks per ns from the startup pair to now, measured over at least 10 ms
+	auto now_ns = SteadyNs();
+	if (now_ns - s_base_ns < 10000000)
+	{
+		std::this_thread::sleep_for(std::chrono::nanoseconds(10000000 - (now_ns - s_base_ns)));
+		now_ns = SteadyNs();
+	}
+
+	const auto now_ticks = Now();
+	const auto ns_per_tick = now_ticks > s_base_ticks ?
+		static_cast<double>(now_ns - s_base_ns) / static_cast<double>(now_ticks - s_base_ticks) : 1.0;
+
+	const auto to_ns = [ns_per_tick](uint64_t ticks)
+	{
+		const auto since = static_cast<double>(static_cast<int64_t>(ticks - s_base_ticks)) * ns_per_tick;
+		return static_cast<uint64_t>(static_cast<double>(s_base_ns) + since);
+	};
+
+	std::ostringstream json;
+	json << "{\"traceEvents\":[";
+
+	auto first = true;
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	for (const auto &ring : s_rings)
+	{
+		const auto head = ring->head.load(std::memory_order_acquire);
+		const auto begin = head > RingSize ? head - RingSize : 0;
+
+		// Slots the owner is writing, or has already moved past, are dropped
+		std::vector<Span> spans;
+		for (auto i = begin; i < head; ++i)
+		{
+			const auto &slot = ring->slots[i % RingSize];
+
+			const auto sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence != 2 * i + 2)
+				continue;
+
+			const Span span = {slot.name.load(std::memory_order_relaxed), slot.start.load(std::memory_order_relaxed),
+				slot.duration.load(std::memory_order_relaxed), slot.thread.load(std::memory_order_relaxed)};
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+				spans.push_back(span);
+		}
+
+		for (const auto &span : spans)
+		{
+			const auto start_ns = to_ns(span.start);
+			const auto duration_ns = static_cast<uint64_t>(static_cast<double>(span.duration) * ns_per_tick);
+
+			json << (first ? "" : ",") << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" <<
+				span.thread << ",\"ts\":" << start_ns / 1000 << "." << std::setfill('0') << std::setw(3) <<
+				start_ns % 1000 << ",\"dur\":" << duration_ns / 1000 << "." << std::setw(3) <<
+				duration_ns % 1000 << "}";
+			first = false;
+		}
+	}
+
+	json << "]}";
+	return json.str();
+}
+#endif
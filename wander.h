@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -12,7 +13,8 @@ typedef int ObjectID;
 enum class EPalType
 {
 	D3D11,
-	OpenGL
+	OpenGL,
+	Software
 };
 
 class Object
@@ -48,7 +50,88 @@ enum class BufferFormat
 	R32F,
 	RG32F,
 	RGB32F,
-	RGBA32F
+	RGBA32F,
+	BC1, // RGB, 8 bytes per 4x4 block
+	BC3  // RGBA, 16 bytes per 4x4 block
+};
+
+// Attribute locations in GL are the semantic values
+enum class VertexSemantic : uint32_t
+{
+	Position,
+	Normal,
+	TexCoord,
+	Color
+};
+
+// Instanced draws feed each instance a column-major 4x4 transform, as four float4 attributes from
+// this location in GL, and from input slot 1 in D3D11 for host layouts with per-instance elements
+constexpr uint32_t InstanceTransformLocation = 4;
+
+enum class VertexFormat : uint32_t
+{
+	Float,
+	Float2,
+	Float3,
+	Float4,
+	UNorm8x4
+};
+
+struct VertexAttribute
+{
+	VertexSemantic semantic;
+	VertexFormat format;
+	uint32_t offset; // bytes from the start of the vertex
+};
+
+// Vertex layout declared by a renderlet in its output header
+class VertexLayout
+{
+public:
+	VertexLayout(const std::vector<VertexAttribute> &attributes, uint32_t stride) :
+		m_attributes(attributes), m_stride(stride)
+	{
+	}
+
+	const std::vector<VertexAttribute> &Attributes() const
+	{
+		return m_attributes;
+	}
+
+	uint32_t Stride() const
+	{
+		return m_stride;
+	}
+
+	static constexpr uint32_t Size(VertexFormat format)
+	{
+		return format == VertexFormat::UNorm8x4 ? 4 : (static_cast<uint32_t>(format) + 1) * 4;
+	}
+
+	static constexpr int Components(VertexFormat format)
+	{
+		return format == VertexFormat::UNorm8x4 ? 4 : static_cast<int>(format) + 1;
+	}
+
+	bool operator==(const VertexLayout &other) const
+	{
+		if (m_stride != other.m_stride || m_attributes.size() != other.m_attributes.size())
+			return false;
+
+		for (size_t i = 0; i < m_attributes.size(); ++i)
+		{
+			const auto &a = m_attributes[i];
+			const auto &b = other.m_attributes[i];
+			if (a.semantic != b.semantic || a.format != b.format || a.offset != b.offset)
+				return false;
+		}
+
+		return true;
+	}
+
+private:
+	std::vector<VertexAttribute> m_attributes;
+	uint32_t m_stride;
 };
 
 class BufferDescriptor
@@ -56,9 +139,9 @@ class BufferDescriptor
 public:
 	BufferDescriptor(BufferType type, 
 		BufferFormat format = BufferFormat::Custom,
-		int width = 0, int height = 0, int depth = 0) :
+		int width = 0, int height = 0, int depth = 0, ObjectID layout_id = -1, int levels = 1) :
 		m_type(type), m_format(format),
-		m_width(width), m_height(height), m_depth(depth)
+		m_width(width), m_height(height), m_depth(depth), m_layout_id(layout_id), m_levels(levels)
 	{
 	}
 
@@ -87,12 +170,54 @@ public:
 		return m_depth;
 	}
 
+	// Layout from Pal::CreateVertexLayout, -1 when the host sets up attributes itself
+	ObjectID LayoutID() const
+	{
+		return m_layout_id;
+	}
+
+	// Texture mip levels, the data holds each one after the other, largest first
+	int Levels() const
+	{
+		return m_levels;
+	}
+
 private:
 	BufferType m_type;
 	BufferFormat m_format;
 	int m_width;
 	int m_height;
 	int m_depth;
+	ObjectID m_layout_id;
+	int m_levels;
+};
+
+
+class IFramebuffer
+{
+public:
+	virtual int Width() const = 0;
+	virtual int Height() const = 0;
+
+	// Colors are packed RGBA8, red in the lowest byte
+	virtual void Clear(uint32_t color, float depth = 1.0f) = 0;
+
+	// Column-major 4x4 matrix applied to vertex positions, same layout as glUniformMatrix4fv
+	virtual void SetTransform(const float transform[16]) = 0;
+
+	// Applied to texture coordinates of later draws, set it to RenderTreeNode::UVTransform() as
+	// a host shader would for atlas packed textures
+	virtual void SetUVTransform(const float transform[4]) = 0;
+
+	// Copies Width() * Height() * 4 bytes, top row first
+	virtual void ReadPixels(uint8_t rgba[]) = 0;
+};
+
+
+struct PalStateStats
+{
+	uint32_t issued;
+	uint32_t elided;
 };
 
 
@@ -100,19 +225,34 @@ class IPal : public Object
 {
 public:
 	virtual EPalType Type() = 0;
+
+	// CPU-side render target, only available on the Software PAL
+	virtual IFramebuffer* Framebuffer() = 0;
+
+	// Call once per frame, and again after the host changes bindings behind the PAL's back
+	// Forgets cached API state and starts a new set of state stats
+	virtual void BeginFrame() = 0;
+
+	// State changes sent to the API versus skipped as redundant since BeginFrame
+	virtual PalStateStats GetStateStats() = 0;
 };
 
 class RenderTreeNode
 {
 public:
 	RenderTreeNode(ObjectID buffer_id, const BufferType& buffer_type, const std::string& metadata, int offset, int length) :
-		m_buffer_id(buffer_id), m_material_buffer_id(-1), m_buffer_type(buffer_type), m_metadata(metadata),
+		m_buffer_id(buffer_id), m_material_buffer_id(-1), m_layout_id(-1), m_texture_id(-1), m_buffer_type(buffer_type), m_metadata(metadata),
 		m_offset(offset), m_length(length) { }
 
 	RenderTreeNode(ObjectID buffer_id, ObjectID material_buffer_id, const BufferType& buffer_type, const std::string& metadata, int offset, int length) :
-		m_buffer_id(buffer_id), m_material_buffer_id(material_buffer_id), m_buffer_type(buffer_type), m_metadata(metadata),
+		m_buffer_id(buffer_id), m_material_buffer_id(material_buffer_id), m_layout_id(-1), m_texture_id(-1), m_buffer_type(buffer_type), m_metadata(metadata),
 		m_offset(offset), m_length(length) { }
 
+	// Draws with the stride of the vertex layout declared by the renderlet, nodes without one are skipped
+	// Nodes with a material buffer still go through RenderFixedStrideWithMaterial
+	void Render(IRuntime *runtime) const;
+
+	// Instanced nodes draw InstanceCount() copies
 	void RenderFixedStride(IRuntime* runtime, unsigned int stride) const;
 
 	void RenderFixedStrideWithMaterial(IRuntime *runtime, unsigned int stride, unsigned int material_stride) const;
@@ -121,6 +261,35 @@ public:
 
 	void SetPooledBuffer(ObjectID buffer_id, int offset);
 
+	void SetVertexLayout(ObjectID layout_id);
+
+	// Binds the texture the renderlet sent for this node to slot for the host's shader, no-op without one
+	void BindTexture(IRuntime *runtime, int slot) const;
+
+	void SetTexture(ObjectID texture_id);
+
+	// Scale u, scale v, offset u, offset v for the node's texture coordinates, identity unless
+	// the texture was packed into a shared atlas page
+	const float* UVTransform() const
+	{
+		return m_uv_transform;
+	}
+
+	void SetUVTransform(const float transform[4]);
+
+	// Buffer of InstanceCount() transforms from RenderInstanced, -1 and 0 for nodes that aren't instanced
+	ObjectID InstanceBufferID() const
+	{
+		return m_instance_buffer_id;
+	}
+
+	uint32_t InstanceCount() const
+	{
+		return m_instance_count;
+	}
+
+	void SetInstances(ObjectID instance_buffer_id, uint32_t count);
+
 	std::string Metadata() const;
 
 	// This should be private
@@ -134,6 +303,18 @@ public:
 		return m_material_buffer_id;
 	}
 
+	// -1 when the renderlet didn't declare a layout
+	ObjectID VertexLayoutID() const
+	{
+		return m_layout_id;
+	}
+
+	// -1 when the renderlet sent no texture for this node
+	ObjectID TextureID() const
+	{
+		return m_texture_id;
+	}
+
 	BufferType Type() const
 	{
 		return m_buffer_type;
@@ -142,10 +323,15 @@ public:
 private:
 	ObjectID m_buffer_id;
 	ObjectID m_material_buffer_id;
+	ObjectID m_layout_id;
+	ObjectID m_texture_id;
 	BufferType m_buffer_type;
 	std::string m_metadata;
 	int m_offset;
 	int m_length;
+	float m_uv_transform[4] = {1.0f, 1.0f, 0.0f, 0.0f};
+	ObjectID m_instance_buffer_id = -1;
+	uint32_t m_instance_count = 0;
 };
 
 
@@ -177,7 +363,206 @@ private:
 	std::vector<RenderTreeNode> m_nodes;
 };
 
+// A frame's nodes sorted by a 64-bit render key, so binds only change where the key does
+// Key, high to low: vertex layout (8 bits), host material (12), texture (16), buffer (16), depth (12)
+// Storage is kept across frames, once it has grown to the frame's size nothing allocates
+class DrawList
+{
+public:
+	struct Draw
+	{
+		uint64_t key;
+		const RenderTreeNode *node;
+	};
+
+	void Clear()
+	{
+		m_draws.clear();
+	}
+
+	// material is the host's own state for the node, such as its shader or texture choice
+	// depth in [0, 1] orders draws with the same state front to back
+	void Add(const RenderTreeNode *node, uint32_t material = 0, float depth = 0.0f)
+	{
+		m_draws.push_back({Key(*node, material, depth), node});
+	}
+
+	// Stable, an LSD radix sort over only the key bits that differ between draws
+	void Sort();
+
+	static uint64_t Key(const RenderTreeNode &node, uint32_t material, float depth);
+
+	static uint32_t Material(uint64_t key)
+	{
+		return static_cast<uint32_t>(key >> 44) & 0xFFF;
+	}
+
+	size_t Size() const
+	{
+		return m_draws.size();
+	}
+
+	const Draw *begin() const
+	{
+		return m_draws.data();
+	}
+
+	const Draw *end() const
+	{
+		return m_draws.data() + m_draws.size();
+	}
+
+private:
+	std::vector<Draw> m_draws;
+	std::vector<Draw> m_scratch;
+	std::vector<uint64_t> m_order; // [compact key:32][index:32]
+	std::vector<uint64_t> m_order_scratch;
+};
+
+
+struct VectorUpdateStats
+{
+	uint32_t changed;
+	uint32_t unchanged;
+};
+
+
+enum class ERuntimeMode
+{
+	// PAL calls happen inside Render, on the calling thread
+	Immediate,
+	// PAL calls are recorded by Render and replayed by DrainPalCommands on the render thread
+	Deferred
+};
+
 
+enum class ERenderStatus
+{
+	Ok,
+	// Ran past its budget and was stopped
+	Timeout,
+	// Trapped or failed to call, the error goes to stderr
+	// After a Timeout or Trap every call on the renderlet returns Trap until IRuntime::Reset
+	Trap,
+	// Unknown renderlet or malformed output
+	Invalid
+};
+
+enum class ETextureCompression
+{
+	None,
+	// BC1 for opaque textures, BC3 when any texel has alpha
+	BC
+};
+
+enum class EProfiler
+{
+	None,
+	// Names JIT code for perf through /tmp/perf-<pid>.map
+	PerfMap,
+	// jit-<pid>.dump for perf inject --jit, which also keeps the machine code for annotation
+	JitDump,
+	// Samples each renderlet's wasm stack every epoch tick, written out by WriteProfile
+	Guest
+};
+
+struct RuntimeConfig
+{
+	ERuntimeMode mode = ERuntimeMode::Immediate;
+
+	// Map each instance's initial memory copy-on-write from the module image instead of copying it
+	bool memory_init_cow = true;
+
+	// Virtual address space per linear memory and its guard region, 0 keeps the wasmtime defaults
+	// Memories never move, outputs are read in place, so a renderlet can't grow past its reservation
+	uint64_t memory_reservation = 0;
+	uint64_t memory_guard_size = 0;
+
+	// Run a renderlet's init once per module, later instances restore the pages and exported globals it
+	// left instead. Non-exported globals can't be snapshotted, so only turn this on for renderlets whose
+	// init leaves none changed besides LLVM's __stack_pointer (C, C++, Rust); runtimes that keep heap roots
+	// in internal globals, like AssemblyScript's, would corrupt their heap. Off runs init per instance
+	bool snapshot_init = false;
+
+	// Block compression for textures sent by renderlets, the PAL's API must support the formats
+	ETextureCompression texture_compression = ETextureCompression::None;
+
+	// Profiling of renderlet code, the engine is set up by the first load
+	EProfiler profiler = EProfiler::None;
+};
+
+// Instantiation latency, over the most recent 1024 instantiations
+struct InstantiationStats
+{
+	uint32_t count; // since the runtime was created
+	uint32_t p50_us;
+	uint32_t p90_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+};
+
+// Latencies in power of two buckets, bucket i counts calls under 2^i us, the last also takes slower ones
+struct LatencyHistogram
+{
+	static constexpr int Buckets = 24;
+
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[Buckets];
+
+	// Upper bound of the bucket holding the pth percentile, 0 without calls
+	uint64_t Percentile(uint32_t p) const;
+};
+
+enum class EEntryPoint
+{
+	// Render, RenderWithBudget, RenderMany, RenderTiled and RenderInstanced
+	Render,
+	Float4,
+	Material,
+	Buffer,
+	Count
+};
+
+struct RenderletStats
+{
+	LatencyHistogram calls[static_cast<int>(EEntryPoint::Count)]; // time in guest code, by EEntryPoint
+	LatencyHistogram parse; // reading outputs
+	uint64_t traps; // calls that trapped or ran out of budget
+	uint64_t output_bytes;
+	uint64_t nodes;
+	uint64_t memory_pages; // 64 KiB linear memory pages after the last call
+};
+
+struct RuntimeStats
+{
+	// Every renderlet so far, unloaded ones included, memory_pages counts loaded ones only
+	RenderletStats renderlets;
+
+	// PAL buffers and textures created and updated by the runtime, and their bytes
+	uint64_t pal_creates;
+	uint64_t pal_create_bytes;
+	uint64_t pal_updates;
+	uint64_t pal_update_bytes;
+
+	uint64_t texture_cache_hits;
+	uint64_t texture_cache_misses;
+	uint64_t module_cache_hits;
+	uint64_t module_cache_misses;
+};
+
+struct RenderRequest
+{
+	ObjectID renderlet_id;
+	ObjectID tree_id = -1;
+	bool pool = false;
+
+	ObjectID result = -1; // tree ID, as returned by Render
+};
+
+// Calls on different renderlets may run concurrently, guest code runs in parallel
+// and PAL work is serialized; pointers returned for a renderlet stay valid until its next call
 class IRuntime : public Object
 {
 public:
@@ -192,6 +577,27 @@ public:
 
 	virtual ObjectID Render(ObjectID renderlet_id, ObjectID tree_id = -1, bool pool = false) = 0;
 
+	// Render with the guest call stopped after budget_us, rounded up to the 1 ms epoch tick
+	// tree_id is only replaced on Ok, otherwise the previous frame's tree is left as it was
+	virtual ERenderStatus RenderWithBudget(ObjectID renderlet_id, ObjectID &tree_id, uint32_t budget_us) = 0;
+
+	// Runs the renderlets in parallel, then uploads in request order on the calling thread
+	// Same as calling Render for each request in turn, results land in RenderRequest::result
+	// A renderlet listed twice runs twice, in no particular order
+	virtual void RenderMany(RenderRequest* requests, size_t count) = 0;
+
+	// Runs tiles instances of the renderlet at once, each called with the pushed params plus
+	// (uint32_t tile, uint32_t tiles), and joins their vertex output into one tree
+	// stride is in bytes, 0 uses the declared vertex layout; vertex output (format 1) only
+	virtual ObjectID RenderTiled(ObjectID renderlet_id, uint32_t tiles, unsigned int stride = 0) = 0;
+
+	// Runs the renderlet once and draws its output count times, with count column-major 4x4
+	// transforms (see InstanceTransformLocation); vertex output (format 1) only
+	// Geometry is kept per distinct output, identical outputs from any renderlet share buffers
+	// Returns tree_id itself when its output and count are unchanged, only the transforms are updated
+	virtual ObjectID RenderInstanced(ObjectID renderlet_id, const float *transforms, uint32_t count,
+		ObjectID tree_id = -1) = 0;
+
 	virtual const float* const ExecuteFloat4(ObjectID renderlet_id, const std::string &function) = 0;
 
 	virtual void ExecuteMaterial(ObjectID renderlet_id, const RenderTreeNode* node, const std::string &function) = 0;
@@ -200,9 +606,41 @@ public:
 
 	virtual void UploadBufferPool(unsigned int stride) = 0;
 
+	// In deferred mode this returns the render thread's copy, updated by DrainPalCommands
 	virtual const RenderTree* GetRenderTree(ObjectID tree_id) = 0;
 	virtual void DestroyRenderTree(ObjectID tree_id) = 0;
 
+	// Deferred mode only: applies everything submitted since the last drain, once per frame on the render thread
+	// Render, DestroyRenderTree, ExecuteMaterial and UploadBufferPool then run on other threads
+	virtual void DrainPalCommands() = 0;
+
+	// Loads and RenderTiled tiles both instantiate, loading a path again skips compilation
+	virtual InstantiationStats GetInstantiationStats() = 0;
+
+	// Counted with relaxed atomics as calls go, cheap enough to leave on; reading never waits on a call
+	// so a call in flight may be partly counted. Zeroed stats for unknown renderlets
+	virtual RenderletStats GetStats(ObjectID renderlet_id) = 0;
+	virtual RuntimeStats GetGlobalStats() = 0;
+
+	// Chrome trace JSON (chrome://tracing, Perfetto) of the runtime's and PAL's phases, the newest spans
+	// of every thread; builds without RLT_TRACE record nothing and return an empty trace
+	virtual std::string ExportTrace() = 0;
+
+	// Guest profiler only: writes the stacks sampled from a renderlet since it loaded or was last written
+	// as Firefox profiler JSON (profiler.firefox.com, which has a flame graph), then starts over
+	virtual bool WriteProfile(ObjectID renderlet_id, const std::wstring& path) = 0;
+
+	// Puts a renderlet back to its state after init on a fresh instance, restored from the snapshot
+	// with RuntimeConfig::snapshot_init, which also releases memory later calls grew
+	// The way back after a Timeout or Trap poisoned the renderlet
+	virtual bool Reset(ObjectID renderlet_id) = 0;
+
+	// Layout of RenderTreeNode::VertexLayoutID(), for binding host shaders
+	virtual const VertexLayout* GetVertexLayout(ObjectID layout_id) = 0;
+
+	// Command counts of the last vector Render into tree_id, compared with the frame before
+	virtual VectorUpdateStats GetVectorUpdateStats(ObjectID tree_id) = 0;
+
 	virtual void Unload(ObjectID renderlet_id) = 0;
 };
 
@@ -214,6 +652,8 @@ public:
 	static IPal* CreatePal(EPalType type, ARGs &&...args);
 
 	static IRuntime* CreateRuntime(IPal *pal);
+	static IRuntime* CreateRuntime(IPal *pal, ERuntimeMode mode);
+	static IRuntime* CreateRuntime(IPal *pal, const RuntimeConfig &config);
 };
 
 
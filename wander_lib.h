@@ -2,12 +2,32 @@
 
 #include "wander.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <fstream>
 #include <iostream>
 #include <ostream>
 #include <queue>
+#include <unordered_map>
 #include <utility>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <cstring>
+
+// Trace timestamps read the TSC directly, steady_clock costs more than a whole span should
+#if defined(RLT_TRACE) && (defined(__x86_64__) || defined(_M_X64))
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define RLT_TRACE_TSC
+#endif
 
 #ifndef __EMSCRIPTEN__
 // TODO - this should only be a private dependency
@@ -33,6 +53,7 @@ struct IDXGISwapChain;
 struct IDXGISwapChain1;
 
 typedef unsigned int GLuint;
+typedef unsigned int GLenum;
 
 namespace wander
 {
@@ -63,6 +84,113 @@ private:
 	const uint8_t *m_current;
 };
 
+#if defined(RLT_TRACE)
+// Spans go to a ring per thread that only that thread writes, so recording one takes no lock
+// Rings of exited threads are reused by new ones, RenderTiled starts threads on every call
+class Tracer
+{
+public:
+	struct Span
+	{
+		const char *name; // static strings only
+		uint64_t start; // ticks of Now()
+		uint64_t duration;
+		uint32_t thread;
+	};
+
+	static constexpr size_t RingSize = 16384;
+
+	// Invariant TSC ticks on x86-64, nanoseconds elsewhere; Export converts to time
+	static uint64_t Now()
+	{
+#if defined(RLT_TRACE_TSC)
+		return __rdtsc();
+#else
+		return SteadyNs();
+#endif
+	}
+
+	static uint64_t SteadyNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void Record(const char *name, uint64_t start, uint64_t end);
+
+	// Chrome trace JSON of the newest RingSize spans of each thread
+	static std::string Export();
+
+private:
+	// A seqlock per slot: sequence is odd while the owner writes span index i, 2 * i + 2 once it's done.
+	// Export keeps a copy only when it read that same value before and after, so it never sees a torn span
+	struct Slot
+	{
+		std::atomic<uint64_t> sequence{0};
+		std::atomic<const char *> name{nullptr};
+		std::atomic<uint64_t> start{0};
+		std::atomic<uint64_t> duration{0};
+		std::atomic<uint32_t> thread{0};
+	};
+
+	struct Ring
+	{
+		Slot slots[RingSize];
+		std::atomic<uint64_t> head{0}; // spans written, wraps over the oldest
+		uint32_t thread = 0;
+	};
+
+	// Returns the thread's ring to the free list when the thread exits
+	struct Owner
+	{
+		Ring *ring = nullptr;
+		~Owner();
+	};
+
+	// nullptr once the thread's Owner is gone, spans from later thread exit destructors are dropped
+	static Ring *ThisThread();
+
+	// Trivial, so the fast path doesn't go through a thread_local guard; cleared by ~Owner
+	static thread_local Ring *s_ring;
+	static thread_local bool s_exited;
+
+	static std::mutex s_mutex;
+	static std::vector<std::unique_ptr<Ring>> s_rings;
+	static std::vector<Ring *> s_free;
+	static uint32_t s_threads;
+
+	// Now() and SteadyNs() read together at startup, Export scales ticks against a second pair
+	static const uint64_t s_base_ticks;
+	static const uint64_t s_base_ns;
+};
+
+class TraceScope
+{
+public:
+	explicit TraceScope(const char *name) : m_name(name), m_start(Tracer::Now())
+	{
+	}
+
+	~TraceScope()
+	{
+		Tracer::Record(m_name, m_start, Tracer::Now());
+	}
+
+	TraceScope(const TraceScope &) = delete;
+	TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+	const char *m_name;
+	uint64_t m_start;
+};
+
+#define RLT_TRACE_JOIN2(a, b) a##b
+#define RLT_TRACE_JOIN(a, b) RLT_TRACE_JOIN2(a, b)
+#define RLT_TRACE_SCOPE(name) ::wander::TraceScope RLT_TRACE_JOIN(rlt_trace_, __LINE__)(name)
+#else
+#define RLT_TRACE_SCOPE(name)
+#endif
+
 
 class IBinaryStream
 {
@@ -175,6 +303,30 @@ private:
 	int m_length;
 };
 
+inline uint64_t HashBytes(const uint8_t *data, size_t length, uint64_t seed = 0xcbf29ce484222325ull)
+{
+	constexpr uint64_t Prime = 0x100000001b3ull;
+
+	auto hash = seed ^ length;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * Prime;
+		hash ^= hash >> 29;
+	}
+
+	for (; i < length; ++i)
+	{
+		hash = (hash ^ data[i]) * Prime;
+	}
+
+	hash ^= hash >> 32;
+	return hash * Prime;
+}
+
 class VectorLoader
 {
 public:
@@ -254,256 +406,1704 @@ public:
 		BlendMode blendMode;
 	};
 
-	typedef std::tuple<EPathType, std::vector<Point>> Path;
-	typedef std::vector<Path> PathList;
-	typedef std::tuple<RenderPaint, PathList> Command;
+	// Verbs and points of a single paint, as ranges into CommandList
+	struct CommandSpan
+	{
+		uint32_t first_verb;
+		uint32_t verb_count;
+		uint32_t first_point;
+		uint32_t point_count;
+	};
+
+	// Flat command stream, every array is contiguous so parsing a frame doesn't allocate once warmed up
+	struct CommandList
+	{
+		std::vector<RenderPaint> paints;
+		std::vector<CommandSpan> commands;
+		std::vector<EPathType> verbs;
+		std::vector<Point> points;
+
+		size_t Size() const
+		{
+			return commands.size();
+		}
+
+		void Clear()
+		{
+			paints.clear();
+			commands.clear();
+			verbs.clear();
+			points.clear();
+		}
+	};
+
+	static uint64_t HashPaint(const RenderPaint &paint)
+	{
+		return HashBytes(reinterpret_cast<const uint8_t *>(&paint), sizeof(paint));
+	}
+
+	static uint64_t HashPath(const CommandList &command_list, const CommandSpan &span)
+	{
+		const auto verbs = HashBytes(reinterpret_cast<const uint8_t *>(command_list.verbs.data() + span.first_verb),
+			span.verb_count * sizeof(EPathType));
+
+		return HashBytes(reinterpret_cast<const uint8_t *>(command_list.points.data() + span.first_point),
+			span.point_count * sizeof(Point), verbs);
+	}
+
+	static constexpr uint32_t PointCount(EPathType type)
+	{
+		return type == EPathType::Quad ? 2 : type == EPathType::Cubic ? 3 : type == EPathType::Close ? 0 : 1;
+	}
 
-	static auto Read(uint8_t *p_data, uint32_t length) -> std::vector<Command>
+	// Single validating pass over the wire format, reusing the capacity of command_list
+	// Returns false if the stream is truncated or malformed, commands parsed up to that point are kept
+	static bool Read(const uint8_t *p_data, uint32_t length, CommandList &command_list)
 	{
-		BinaryMemoryStream ms(p_data, length);
+		command_list.Clear();
 
-		std::vector<Command> command_list;
+		const auto *current = p_data;
+		const auto *const end = p_data + length;
 
-		while (ms)
+		const auto read = [&current, end](void *value, size_t size)
+		{
+			if (static_cast<size_t>(end - current) < size)
+				return false;
+			memcpy(value, current, size);
+			current += size;
+			return true;
+		};
+
+		while (current < end)
 		{
-			RenderPaint p{};
-			ms >> p;
+			RenderPaint paint{};
+			int32_t path_size = 0;
 
-			int path_size = 0;
-			ms >> path_size;
+			if (!read(&paint, sizeof(paint)) || !read(&path_size, sizeof(path_size)))
+				return false;
 
 			if (path_size == 0)
 				break;
 
-			PathList path_list(path_size);
+			if (path_size < 0)
+				return false;
 
-			for (auto& path : path_list)
+			CommandSpan span{static_cast<uint32_t>(command_list.verbs.size()), 0,
+				static_cast<uint32_t>(command_list.points.size()), 0};
+
+			for (auto i = 0; i < path_size; ++i)
 			{
-				EPathType type;
-				ms >> type;
+				EPathType type{};
+				int32_t points_size = 0;
+
+				if (!read(&type, sizeof(type)) || !read(&points_size, sizeof(points_size)))
+					return false;
 
-				int points_size = 0;
-				ms >> points_size;
+				if (type < EPathType::Move || type > EPathType::Close ||
+					points_size < static_cast<int32_t>(PointCount(type)))
+					return false;
 
-				std::vector<Point> points(points_size);
+				const auto bytes = static_cast<size_t>(points_size) * sizeof(Point);
+				if (static_cast<size_t>(end - current) < bytes)
+					return false;
 
-				for (auto& point: points)
-				{
-					ms >> point.x;
-					ms >> point.y;
-				}
+				// Extra trailing points are skipped, spans only hold what the verb consumes
+				const auto first = command_list.points.size();
+				command_list.points.resize(first + PointCount(type));
+				memcpy(command_list.points.data() + first, current, PointCount(type) * sizeof(Point));
+				current += bytes;
 
-				std::get<0>(path) = type;
-				std::get<1>(path) = points;
+				command_list.verbs.push_back(type);
 			}
 
-			command_list.emplace_back(p, path_list);
+			span.verb_count = static_cast<uint32_t>(command_list.verbs.size()) - span.first_verb;
+			span.point_count = static_cast<uint32_t>(command_list.points.size()) - span.first_point;
+
+			command_list.paints.push_back(paint);
+			command_list.commands.push_back(span);
 		}
-		return command_list;
-	}
 
-	std::vector<Command> m_command_list;
+		return true;
+	}
 };
 
-class Pal : public IPal
+// Content-addressed cache for objects built from vector commands (paths, paints, meshes)
+// Entries not looked up since the previous Sweep are evicted, so a cache follows one command stream
+template <typename T>
+class VectorObjectCache
 {
-public:  // TODO: Replace with std::span
-	virtual ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) = 0;
-	virtual ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) = 0;
-	virtual void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) = 0;
-	virtual void DeleteBuffer(ObjectID buffer_id) = 0;
-
-	virtual ObjectID CreateVector(int length, const uint8_t data[]) = 0;
-	virtual ObjectID UpdateVector(int length, const uint8_t data[], ObjectID buffer_id) = 0;
+public:
+	T *Find(uint64_t key)
+	{
+		const auto it = m_entries.find(key);
+		if (it == m_entries.end())
+		{
+			++m_misses;
+			return nullptr;
+		}
 
-	virtual void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride) = 0;
-	virtual void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
-		ObjectID material_buffer_id, unsigned int material_stride) = 0;
+		++m_hits;
+		it->second.generation = m_generation;
+		return &it->second.value;
+	}
 
-	virtual void DrawVector(ObjectID buffer_id, int slot, int width, int height) = 0;
-};
+	T *Insert(uint64_t key, T value)
+	{
+		auto &entry = m_entries[key];
+		entry.value = std::move(value);
+		entry.generation = m_generation;
+		return &entry.value;
+	}
 
+	void Sweep()
+	{
+		for (auto it = m_entries.begin(); it != m_entries.end();)
+		{
+			if (it->second.generation != m_generation)
+				it = m_entries.erase(it);
+			else
+				++it;
+		}
 
-#ifdef _WIN32
+		++m_generation;
+	}
 
-class PalD3D11 : public Pal
-{
-public:
-	PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context);
-	PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context, IDXGISwapChain* swapchain);
+	void Clear()
+	{
+		m_entries.clear();
+	}
 
-	virtual ~PalD3D11();
+	size_t Size() const
+	{
+		return m_entries.size();
+	}
 
-	void Release() override{};
+	uint64_t Hits() const
+	{
+		return m_hits;
+	}
 
-	EPalType Type() override
+	uint64_t Misses() const
 	{
-		return EPalType::D3D11;
+		return m_misses;
 	}
 
-	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
-	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
-	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
-	void DeleteBuffer(ObjectID buffer_id) override;
+private:
+	struct Entry
+	{
+		T value{};
+		uint32_t generation = 0;
+	};
 
-	ObjectID CreateVector(int length, const uint8_t data[]) override;
-	ObjectID UpdateVector(int length, const uint8_t data[], ObjectID buffer_id) override;
+	std::unordered_map<uint64_t, Entry> m_entries;
+	uint32_t m_generation = 0;
+	uint64_t m_hits = 0;
+	uint64_t m_misses = 0;
+};
 
-	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride) override;
-	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
-		ObjectID material_buffer_id, unsigned int material_stride) override;
+struct VectorChangeSet
+{
+	std::vector<uint32_t> changed; // command indices, in stream order
+	uint32_t unchanged = 0;
+	bool resized = false; // command count differs from the previous stream
+};
 
-	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
-	
+// Per-command diff of a vector stream against the previous frame of the same tree
+// Commands are compared by position, using paint and path hashes
+class VectorDiff
+{
+public:
+	const VectorChangeSet &Update(const VectorLoader::CommandList &commands)
+	{
+		const auto previous = m_paint_hashes.size();
 
-private:
-	std::vector<ID3D11Buffer*> m_buffers;
-	std::vector<ID3D11Texture2D*> m_textures;
+		m_changes.changed.clear();
+		m_changes.unchanged = 0;
+		m_changes.resized = previous != commands.Size();
 
-	ID3D11Device* m_device;
-	ID3D11DeviceContext* m_device_context;
-	IDXGISwapChain *m_swapchain;
+		m_paint_hashes.resize(commands.Size());
+		m_path_hashes.resize(commands.Size());
 
-#if defined(RLT_RIVE) && defined(_WIN32)
-	std::unique_ptr<rive::pls::PLSRenderContext> m_plsContext;
-	std::vector<std::vector<VectorLoader::Command>> m_vector_commands;
-	std::vector<ID3D11Texture2D *> m_vector_textures;
-	std::vector<ID3D11ShaderResourceView*> m_vector_srvs;
-#endif
-};
+		for (size_t c = 0; c < commands.Size(); ++c)
+		{
+			const auto paint = VectorLoader::HashPaint(commands.paints[c]);
+			const auto path = VectorLoader::HashPath(commands, commands.commands[c]);
 
-#endif
+			if (c < previous && paint == m_paint_hashes[c] && path == m_path_hashes[c])
+			{
+				++m_changes.unchanged;
+				continue;
+			}
 
+			m_paint_hashes[c] = paint;
+			m_path_hashes[c] = path;
+			m_changes.changed.push_back(static_cast<uint32_t>(c));
+		}
 
-class PalOpenGL : public Pal
-{
-public:
-	PalOpenGL(void* context) : m_context(context) {}
+		return m_changes;
+	}
 
-	void Release() override{};
+	const VectorChangeSet &Changes() const
+	{
+		return m_changes;
+	}
 
-	EPalType Type() override
+	uint64_t PaintHash(size_t command) const
 	{
-		return EPalType::OpenGL;
+		return m_paint_hashes[command];
 	}
 
-	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
-	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
-	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
-	void DeleteBuffer(ObjectID buffer_id) override;
+	uint64_t PathHash(size_t command) const
+	{
+		return m_path_hashes[command];
+	}
 
-	ObjectID CreateVector(int length, const uint8_t data[]) override;
-	ObjectID UpdateVector(int length, const uint8_t data[], ObjectID buffer_id) override;
+private:
+	std::vector<uint64_t> m_paint_hashes;
+	std::vector<uint64_t> m_path_hashes;
+	VectorChangeSet m_changes;
+};
 
-	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride) override;
-	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
-		ObjectID material_buffer_id, unsigned int material_stride) override;
+// Flattens vector commands into triangles for PALs without a native path renderer
+// Fills are emitted as fans plus a bounding quad, and must be resolved with a non-zero stencil test
+class VectorTessellator
+{
+public:
+	struct Draw
+	{
+		uint32_t color;
+		bool stroke;
+		int first; // fill fans or stroke triangles
+		int count;
+		int cover_first; // 2 triangles covering the fill, -1 for strokes
+	};
 
-	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
+	struct Mesh
+	{
+		std::vector<VectorLoader::Point> vertices;
+		std::vector<Draw> draws;
+	};
+
+	explicit VectorTessellator(float tolerance = 0.25f) : m_tolerance(tolerance) {}
+
+	Mesh Tessellate(const VectorLoader::CommandList &commands);
+
+	// Appends the triangles of a single command to mesh
+	void Append(const VectorLoader::CommandList &commands, size_t command, Mesh &mesh);
 
 private:
-	std::vector<GLuint> m_vbos;
-	std::vector<GLuint> m_vaos;
-	std::vector<GLuint> m_texs;
+	typedef std::vector<VectorLoader::Point> Contour;
 
-	void *m_context;
-};
+	void Flatten(const VectorLoader::CommandList &commands, const VectorLoader::CommandSpan &span);
+	void Fill(Mesh &mesh) const;
+	void Stroke(Mesh &mesh, const VectorLoader::RenderPaint &paint) const;
 
+	void Join(Mesh &mesh, VectorLoader::Point p, VectorLoader::Point d0, VectorLoader::Point d1,
+		float half_width, VectorLoader::StrokeJoin join) const;
+	void Cap(Mesh &mesh, VectorLoader::Point p, VectorLoader::Point d, float half_width,
+		VectorLoader::StrokeCap cap) const;
+	void Arc(Mesh &mesh, VectorLoader::Point center, VectorLoader::Point from, float angle, float radius) const;
 
-class Runtime : public IRuntime
+	float m_tolerance;
+	std::vector<Contour> m_contours;
+	std::vector<bool> m_closed;
+};
+
+// Builds mip chains and block compresses renderlet textures on the CPU, results are
+// cached by content so a renderlet sending the same texture every frame pays once
+class TexturePipeline
 {
 public:
-
-	struct Param
+	struct Texture
 	{
-		enum
-		{
-			Int32,
-			Int64,
-			Float32,
-			Float64
-		} Type;
-
-		union 
-		{
-			uint32_t I32;
-			uint64_t I64;
-			float F32;
-			double F64;
-		} Value;
+		BufferFormat format;
+		int width;
+		int height;
+		int levels;
+		std::vector<uint8_t> data; // every level, largest first, tightly packed
 	};
 
-	Runtime(Pal* pal) : m_pal(pal)
-	{
-	}
-
-	ObjectID LoadFromFile(const std::wstring &path) override;
-	ObjectID LoadFromFile(const std::wstring &path, const std::string& function) override;
+	// rgba is width * height RGBA8 texels, top row first
+	std::shared_ptr<const Texture> Process(const uint8_t *rgba, int width, int height, bool mips,
+		ETextureCompression compression);
 
-	void PushParam(ObjectID renderlet_id, float value) override;
-	void PushParam(ObjectID renderlet_id, double value) override;
-	void PushParam(ObjectID renderlet_id, uint32_t value) override;
-	void PushParam(ObjectID renderlet_id, uint64_t value) override;
-	void ResetStack(ObjectID renderlet_id) override;
+	// Bytes in one level, 0 for formats that aren't textures
+	static size_t LevelSize(BufferFormat format, int width, int height);
 
-	ObjectID Render(ObjectID renderlet_id, ObjectID tree_id = -1, bool pool = false) override;
-	const float* const ExecuteFloat4(ObjectID renderlet_id, const std::string& function) override;
-	void ExecuteMaterial(ObjectID renderlet_id, const RenderTreeNode* node, const std::string& function) override;
-	void ExecuteBuffer(ObjectID renderlet_id, const std::string& function, uint32_t* length, const uint8_t** data) override;
+	// 2x2 box filter, dst is max(width / 2, 1) by max(height / 2, 1)
+	static void Downsample(const uint8_t *src, int width, int height, uint8_t *dst);
 
-	// void UploadBufferPool(ObjectID pool_id);
-	void UploadBufferPool(unsigned int stride) override;
+	static void EncodeBC1(const uint8_t *rgba, int width, int height, uint8_t *dst);
+	static void EncodeBC3(const uint8_t *rgba, int width, int height, uint8_t *dst);
 
-	const RenderTree* GetRenderTree(ObjectID tree_id) override;
-	void DestroyRenderTree(ObjectID tree_id) override;
+	// Back to width * height RGBA8 texels, for PALs without hardware decoding
+	static void DecodeBC(BufferFormat format, const uint8_t *src, int width, int height, uint8_t *rgba);
 
-	void Release() override;
-	void Unload(ObjectID renderlet_id) override;
+	uint64_t Hits() const
+	{
+		return m_hits.load(std::memory_order_relaxed);
+	}
 
-	Pal* PalImpl() const
+	uint64_t Misses() const
 	{
-		return m_pal;
+		return m_misses.load(std::memory_order_relaxed);
 	}
 
 private:
+	static void ColorBlock(const uint8_t block[64], uint8_t out[8]);
+	static void AlphaBlock(const uint8_t block[64], uint8_t out[8]);
+	static void DecodeColorBlock(const uint8_t in[8], bool alpha_mode, uint8_t block[64]);
+	static void DecodeAlphaBlock(const uint8_t in[8], uint8_t block[64]);
 
-	ObjectID BuildVector(uint32_t length, uint8_t* data, ObjectID tree_id);
-	ObjectID BuildVertexWithMaterial(uint8_t* output);
-	void CreatePooledBuffer(uint32_t length, uint8_t* data, ObjectID tree_id);
+	static constexpr size_t CacheBytes = 64 * 1024 * 1024;
 
-#ifndef __EMSCRIPTEN__
-	struct WasmtimeContext
+	// The key is only a hash, a hit is confirmed against the settings and texels it was built from
+	struct CacheEntry
 	{
-		wasmtime_store_t* Store = nullptr;
-		wasmtime_context_t* Context = nullptr;
-		wasmtime_linker_t* Linker = nullptr;
-		wasmtime_module_t* Module = nullptr;
-		wasmtime_extern_t Run {};
-		wasmtime_extern_t Memory {};
+		std::shared_ptr<const Texture> texture;
+		uint64_t settings[2];
+		std::vector<uint8_t> source;
 	};
 
-	wasm_engine_t* m_engine = nullptr;
-#else
-	struct WasmtimeContext{};
-	int m_context_count = 0;
-#endif
+	std::unordered_map<uint64_t, CacheEntry> m_cache;
+	std::deque<uint64_t> m_order; // oldest first, evicted past CacheBytes
+	size_t m_cache_bytes = 0;
+	std::mutex m_mutex;
 
-	struct SubBuffer
-	{
-		int offset;
-		uint32_t length;
-		ObjectID tree_id;
-	};
+	std::atomic<uint64_t> m_hits{0};
+	std::atomic<uint64_t> m_misses{0};
+};
 
-	std::vector<SubBuffer> m_sub_buffers;
-	std::unique_ptr<unsigned char[]> m_staging_buffer;
+// Stats counters, relaxed atomics; a renderlet's are written by whichever thread holds its lock
+// (and RenderTiled's tile threads), so adds almost never contend and readers never block a call
+struct AtomicHistogram
+{
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> total_us{0};
+	std::atomic<uint64_t> max_us{0};
+	std::atomic<uint64_t> buckets[LatencyHistogram::Buckets]{};
+
+	void Add(uint64_t us);
+
+	// Adds into histogram
+	void Read(LatencyHistogram &histogram) const;
+};
+
+struct RenderletCounters
+{
+	AtomicHistogram calls[static_cast<int>(EEntryPoint::Count)];
+	AtomicHistogram parse;
+	std::atomic<uint64_t> traps{0};
+	std::atomic<uint64_t> output_bytes{0};
+	std::atomic<uint64_t> nodes{0};
+	std::atomic<uint64_t> memory_pages{0};
+
+	// Adds into stats
+	void Read(RenderletStats &stats) const;
+};
+
+struct PalCounters
+{
+	std::atomic<uint64_t> creates{0};
+	std::atomic<uint64_t> create_bytes{0};
+	std::atomic<uint64_t> updates{0};
+	std::atomic<uint64_t> update_bytes{0};
+
+	void Create(size_t bytes)
+	{
+		creates.fetch_add(1, std::memory_order_relaxed);
+		create_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void Update(size_t bytes)
+	{
+		updates.fetch_add(1, std::memory_order_relaxed);
+		update_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+};
+
+class Pal;
+
+// Packs small single level textures into shared pages, one set of pages per format. Slots are
+// refcounted by texture, the pipeline hands out the same texture for the same content, so a
+// renderlet sending its icons every frame keeps their slots without uploading them again.
+class TextureAtlas
+{
+public:
+	struct Allocation
+	{
+		ObjectID page_id;
+		float uv_transform[4]; // scale u, scale v, offset u, offset v
+		const TexturePipeline::Texture *texture;
+	};
+
+	static constexpr int PageSize = 1024;
+	static constexpr int MaxSize = 256; // larger textures get their own
+
+	// False when the texture isn't a candidate, or no page could be made for it
+	bool Insert(Pal &pal, PalCounters &counters, const std::shared_ptr<const TexturePipeline::Texture> &texture,
+		Allocation &allocation);
+	void Release(const Allocation &allocation);
+
+	bool IsPage(ObjectID texture_id) const;
+
+private:
+	struct Rect
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+	};
+
+	// Top edge of the packed area over [x, x + width)
+	struct Segment
+	{
+		int x;
+		int y;
+		int width;
+	};
+
+	struct Page
+	{
+		ObjectID id;
+		BufferFormat format;
+		std::vector<Segment> skyline;
+		std::vector<Rect> free; // released slots, reused before the skyline grows
+		int live = 0;
+	};
+
+	struct Entry
+	{
+		std::shared_ptr<const TexturePipeline::Texture> texture;
+		size_t page;
+		Rect rect;
+		uint32_t refs;
+	};
+
+	static bool Place(Page &page, int width, int height, Rect &rect);
+
+	std::vector<Page> m_pages; // kept once made, emptied pages start over
+	std::unordered_map<const TexturePipeline::Texture *, Entry> m_entries;
+};
+
+enum class HandleType : uint32_t
+{
+	Buffer,
+	Texture,
+	Vector,
+	RenderTree,
+	Renderlet
+};
+
+// Slot storage addressed by generational handles, freed slots are recycled oldest first once
+// MinFree of them are waiting, so a slot comes back at most every MinFree erases and a stale ID
+// only aliases after MinFree * 1024 erases rather than 1024 reuses of the one slot
+// IDs pack [type:3][generation:10][index:18] with the sign bit clear, so -1 stays invalid and
+// IDs of another type, or of a freed slot, are rejected without touching the stored value
+// Slots live in fixed size chunks that never move, pointers from Get survive later inserts
+template <typename T>
+class HandlePool
+{
+public:
+	explicit HandlePool(HandleType type) : m_type(static_cast<uint32_t>(type))
+	{
+	}
+
+	ObjectID Insert(T value)
+	{
+		uint32_t index;
+
+		if (m_free.size() >= MinFree || (!m_free.empty() && m_count > IndexMask))
+		{
+			index = m_free.front();
+			m_free.pop_front();
+		}
+		else
+		{
+			if (m_count > IndexMask)
+				return -1;
+
+			if ((m_count & ChunkMask) == 0)
+				m_chunks.push_back(std::make_unique<Slot[]>(ChunkSize));
+
+			index = m_count++;
+		}
+
+		auto &slot = SlotAt(index);
+		slot.value = std::move(value);
+		slot.live = true;
+		++m_size;
+
+		return static_cast<ObjectID>((m_type << TypeShift) | (slot.generation << IndexBits) | index);
+	}
+
+	T *Get(ObjectID id)
+	{
+		return Valid(id) ? &SlotAt(id & IndexMask).value : nullptr;
+	}
+
+	const T *Get(ObjectID id) const
+	{
+		return Valid(id) ? &SlotAt(id & IndexMask).value : nullptr;
+	}
+
+	// Stale IDs are ignored, so double deletes are harmless
+	bool Erase(ObjectID id)
+	{
+		if (!Valid(id))
+			return false;
+
+		const auto index = static_cast<uint32_t>(id) & IndexMask;
+		auto &slot = SlotAt(index);
+
+		// Drop the value now so freed slots don't hold on to memory
+		slot.value = T{};
+		slot.live = false;
+		slot.generation = (slot.generation + 1) & GenerationMask;
+
+		m_free.push_back(index);
+		--m_size;
+		return true;
+	}
+
+	// f(ObjectID, T&) for every live slot, f may erase the slot it is given
+	template <typename F>
+	void ForEach(F &&f)
+	{
+		for (uint32_t index = 0; index < m_count; ++index)
+		{
+			auto &slot = SlotAt(index);
+			if (slot.live)
+				f(static_cast<ObjectID>((m_type << TypeShift) | (slot.generation << IndexBits) | index), slot.value);
+		}
+	}
+
+	// Generations survive, IDs handed out before a Clear stay stale
+	void Clear()
+	{
+		ForEach([this](ObjectID id, T &) { Erase(id); });
+	}
+
+	size_t Size() const
+	{
+		return m_size;
+	}
+
+	static HandleType TypeOf(ObjectID id)
+	{
+		return static_cast<HandleType>(static_cast<uint32_t>(id) >> TypeShift);
+	}
+
+	static uint32_t IndexOf(ObjectID id)
+	{
+		return static_cast<uint32_t>(id) & IndexMask;
+	}
+
+private:
+	static constexpr uint32_t IndexBits = 18;
+	static constexpr uint32_t IndexMask = (1u << IndexBits) - 1;
+	static constexpr uint32_t GenerationMask = (1u << 10) - 1;
+	static constexpr uint32_t TypeShift = IndexBits + 10;
+	static constexpr uint32_t ChunkBits = 6;
+	static constexpr uint32_t ChunkSize = 1u << ChunkBits;
+	static constexpr uint32_t ChunkMask = ChunkSize - 1;
+	static constexpr size_t MinFree = 1024;
+
+	struct Slot
+	{
+		T value{};
+		uint32_t generation = 0;
+		bool live = false;
+	};
+
+	Slot &SlotAt(uint32_t index)
+	{
+		return m_chunks[index >> ChunkBits][index & ChunkMask];
+	}
+
+	const Slot &SlotAt(uint32_t index) const
+	{
+		return m_chunks[index >> ChunkBits][index & ChunkMask];
+	}
+
+	bool Valid(ObjectID id) const
+	{
+		if (id < 0)
+			return false;
+
+		const auto handle = static_cast<uint32_t>(id);
+		const auto index = handle & IndexMask;
+
+		if ((handle >> TypeShift) != m_type || index >= m_count)
+			return false;
+
+		const auto &slot = SlotAt(index);
+		return slot.live && slot.generation == ((handle >> IndexBits) & GenerationMask);
+	}
+
+	std::vector<std::unique_ptr<Slot[]>> m_chunks;
+	uint32_t m_count = 0; // slots handed out so far, free or live
+	std::deque<uint32_t> m_free; // oldest first
+	size_t m_size = 0;
+	uint32_t m_type;
+};
+
+class Pal : public IPal
+{
+public:  // TODO: Replace with std::span
+	virtual ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) = 0;
+	virtual ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) = 0;
+	virtual void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) = 0;
+
+	// Fills part of a buffer created with null data, offset and length in bytes
+	virtual void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]) = 0;
+
+	// Writes a region of level 0 of a texture created with null data, x, y and the size are block
+	// aligned for compressed formats
+	virtual void UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+		const uint8_t data[]) = 0;
+
+	// Frees buffers, textures and vectors alike, the ID carries its type
+	virtual void DeleteBuffer(ObjectID buffer_id) = 0;
+
+	// Streams are parsed and diffed by the runtime, PALs only rebuild what diff reports as changed
+	virtual ObjectID CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff) = 0;
+	virtual ObjectID UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id) = 0;
+
+	// layout_id is -1 when the host has set up vertex attributes itself
+	virtual void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id) = 0;
+	virtual void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id) = 0;
+
+	// instance_buffer_id holds instance_count column-major 4x4 float transforms
+	virtual void DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id) = 0;
+
+	virtual void DrawVector(ObjectID buffer_id, int slot, int width, int height) = 0;
+
+	virtual void BindTexture(ObjectID texture_id, int slot) = 0;
+
+	// PALs without a state cache have nothing to report
+	void BeginFrame() override {}
+
+	PalStateStats GetStateStats() override
+	{
+		return {0, 0};
+	}
+
+	// Equal layouts share an ID, so API objects built for a layout are shared by all its buffers
+	virtual ObjectID CreateVertexLayout(const VertexLayout &layout);
+	virtual const VertexLayout* VertexLayoutAt(ObjectID layout_id) const;
+
+protected:
+	std::deque<VertexLayout> m_vertex_layouts; // deque, VertexLayoutAt pointers survive later layouts
+};
+
+
+#ifdef _WIN32
+
+class PalD3D11 : public Pal
+{
+public:
+	PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context);
+	PalD3D11(ID3D11Device* device, ID3D11DeviceContext* context, IDXGISwapChain* swapchain);
+
+	virtual ~PalD3D11();
+
+	void Release() override{};
+
+	EPalType Type() override
+	{
+		return EPalType::D3D11;
+	}
+
+	IFramebuffer* Framebuffer() override
+	{
+		return nullptr;
+	}
+
+	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
+	void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]) override;
+	void UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+		const uint8_t data[]) override;
+	void DeleteBuffer(ObjectID buffer_id) override;
+
+	ObjectID CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff) override;
+	ObjectID UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id) override;
+
+	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id) override;
+	void DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id) override;
+	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id) override;
+
+	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
+	void BindTexture(ObjectID texture_id, int slot) override;
+	
+
+private:
+	HandlePool<ID3D11Buffer*> m_buffers{HandleType::Buffer};
+	struct Texture
+	{
+		ID3D11Texture2D *texture;
+		ID3D11ShaderResourceView *view;
+	};
+
+	HandlePool<Texture> m_textures{HandleType::Texture};
+
+	ID3D11Device* m_device;
+	ID3D11DeviceContext* m_device_context;
+	IDXGISwapChain *m_swapchain;
+
+#if defined(RLT_RIVE) && defined(_WIN32)
+	// rive objects built per vector buffer, defined in wander.cpp to keep rive headers private
+	struct VectorState;
+
+	void BuildVector(ObjectID buffer_id, const VectorLoader::CommandList &commands, const VectorDiff &diff);
+
+	std::unique_ptr<rive::pls::PLSRenderContext> m_plsContext;
+	std::unique_ptr<VectorState> m_vector_state;
+#endif
+};
+
+#endif
+
+
+// Shadows GL bindings so redundant calls never reach the driver
+// Anything bound outside of this cache must be followed by Invalidate
+class GLStateCache
+{
+public:
+	GLStateCache()
+	{
+		Invalidate();
+	}
+
+	void BindVertexArray(GLuint vao);
+	void BindArrayBuffer(GLuint vbo);
+	void UseProgram(GLuint program);
+	void ActiveTexture(int unit);
+	void BindTexture2D(GLuint texture);
+
+	// GL unbinds deleted objects, the shadow has to follow
+	void DeleteVertexArray(GLuint vao);
+	void DeleteArrayBuffer(GLuint vbo);
+	void DeleteTexture2D(GLuint texture);
+
+	void Invalidate();
+
+	PalStateStats Stats() const
+	{
+		return m_stats;
+	}
+
+	void ResetStats()
+	{
+		m_stats = {0, 0};
+	}
+
+private:
+	static constexpr GLuint Unknown = ~0u;
+	static constexpr int TextureUnits = 16;
+
+	bool Changed(GLuint &shadow, GLuint value)
+	{
+		if (shadow == value)
+		{
+			++m_stats.elided;
+			return false;
+		}
+
+		shadow = value;
+		++m_stats.issued;
+		return true;
+	}
+
+	GLuint m_vao;
+	GLuint m_array_buffer;
+	GLuint m_program;
+	GLuint m_active_unit;
+	GLuint m_textures[TextureUnits];
+
+	PalStateStats m_stats = {0, 0};
+};
+
+class PalOpenGL : public Pal
+{
+public:
+	PalOpenGL(void* context) : m_context(context) {}
+
+	void Release() override{};
+
+	EPalType Type() override
+	{
+		return EPalType::OpenGL;
+	}
+
+	IFramebuffer* Framebuffer() override
+	{
+		return nullptr;
+	}
+
+	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
+	void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]) override;
+	void UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+		const uint8_t data[]) override;
+	void DeleteBuffer(ObjectID buffer_id) override;
+
+	ObjectID CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff) override;
+	ObjectID UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id) override;
+
+	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id) override;
+	void DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id) override;
+	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id) override;
+
+	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
+	void BindTexture(ObjectID texture_id, int slot) override;
+
+	void BeginFrame() override;
+	PalStateStats GetStateStats() override;
+
+private:
+	struct VectorBuffer
+	{
+		// One mesh per command so only changed commands are re-tessellated
+		std::vector<VectorTessellator::Mesh> meshes;
+		std::vector<int> base_vertex;
+		GLuint vbo = 0;
+		GLuint vao = 0;
+
+		// Render target for slot != -1
+		GLuint fbo = 0;
+		GLuint texture = 0;
+		GLuint stencil = 0;
+		int width = 0;
+		int height = 0;
+	};
+
+	// One VAO per vertex layout, repointed when the drawn buffer changes
+	struct LayoutArrays
+	{
+		GLuint vao = 0;
+		GLuint vbo = 0;
+	};
+
+	void TessellateVector(VectorBuffer &vector, const VectorLoader::CommandList &commands, const VectorDiff &diff);
+	bool CreateVectorProgram();
+	void BindVertexLayout(ObjectID layout_id, GLuint vbo);
+
+	struct Buffer
+	{
+		GLuint vbo = 0;
+		GLuint vao = 0; // 0 for buffers created with a layout
+	};
+
+	HandlePool<Buffer> m_buffers{HandleType::Buffer};
+	HandlePool<GLuint> m_texs{HandleType::Texture};
+	std::vector<LayoutArrays> m_layout_arrays;
+
+	HandlePool<VectorBuffer> m_vectors{HandleType::Vector};
+	GLuint m_vector_program = 0;
+	int m_vector_viewport = -1;
+	int m_vector_color = -1;
+
+	GLStateCache m_state;
+
+	void *m_context;
+};
+
+
+class WorkStealingPool;
+
+// CPU rasterizer for GPU-less hosts (thumbnails, server-side previews)
+// Positions are the first 3 floats of each vertex, texture coordinates floats 6 and 7 and colors float 8
+// when the stride carries them. The texture bound to slot 0 is sampled nearest, level 0 only, and
+// modulates the color; alpha is dropped, there is no blending
+class PalSoftware : public Pal, public IFramebuffer
+{
+public:
+	PalSoftware(int width, int height) : PalSoftware(width, height, 0) {}
+	PalSoftware(int width, int height, int threads);
+	~PalSoftware();
+
+	void Release() override{};
+
+	EPalType Type() override
+	{
+		return EPalType::Software;
+	}
+
+	IFramebuffer* Framebuffer() override
+	{
+		return this;
+	}
+
+	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
+	void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]) override;
+	void UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+		const uint8_t data[]) override;
+	void DeleteBuffer(ObjectID buffer_id) override;
+
+	ObjectID CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff) override;
+	ObjectID UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id) override;
+
+	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id) override;
+	void DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id) override;
+	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id) override;
+
+	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
+	void BindTexture(ObjectID texture_id, int slot) override;
+
+	int Width() const override
+	{
+		return m_width;
+	}
+
+	int Height() const override
+	{
+		return m_height;
+	}
+
+	void Clear(uint32_t color, float depth = 1.0f) override;
+	void SetTransform(const float transform[16]) override;
+	void SetUVTransform(const float transform[4]) override;
+	void ReadPixels(uint8_t rgba[]) override;
+
+private:
+	static constexpr int TileSize = 64;
+
+	// Triangles closer than this in w are clipped, the near plane of the clip space
+	static constexpr float NearW = 1e-5f;
+
+	struct Vertex
+	{
+		float clip[4];
+		float color[3];
+		float uv[2];
+	};
+
+	// Edge functions and attributes are stored as screen-space planes: a * x + b * y + c
+	struct Triangle
+	{
+		float edge[3][3];
+		float depth[3];
+		float inv_w[3];
+		float color[3][3]; // premultiplied by 1/w for perspective correction
+		float uv[2][3]; // same
+		ObjectID texture_id;
+		int min_x, min_y, max_x, max_y;
+	};
+
+	// RGBA8 texels, converted or decoded from the format the texture was created with
+	struct Texture
+	{
+		int width = 0;
+		int height = 0;
+		std::vector<uint32_t> texels;
+	};
+
+	void Rasterize(const uint8_t* vertices, unsigned int stride,
+		const uint8_t* colors, unsigned int color_stride, int length);
+	void ClipTriangle(const Vertex vertices[3]);
+	void SetupTriangle(const Vertex vertices[3]);
+	void RasterizeTile(int tile);
+	void Flush();
+
+	int m_width;
+	int m_height;
+	int m_threads;
+	int m_tiles_x;
+	int m_tiles_y;
+
+	float m_transform[16];
+	float m_uv_transform[4];
+
+	std::vector<uint32_t> m_color;
+	std::vector<float> m_depth;
+
+	std::vector<Triangle> m_triangles;
+	std::vector<std::vector<uint32_t>> m_bins;
+	std::vector<int> m_busy_tiles; // tiles with triangles in the current flush
+
+	// Kept for the PAL's lifetime, flushes run once per thumbnail; null with a single thread
+	std::unique_ptr<WorkStealingPool> m_workers;
+
+	HandlePool<std::vector<uint8_t>> m_buffers{HandleType::Buffer};
+	HandlePool<Texture> m_textures{HandleType::Texture};
+	ObjectID m_texture_id = -1; // slot 0
+};
+
+
+// Fixed set of threads for RenderMany, each with its own deque of work
+// Owners pop from the back, idle threads steal from the front of the others
+class WorkStealingPool
+{
+public:
+	// Defaults to one thread per core, the caller of Run makes up the last one
+	explicit WorkStealingPool(unsigned int thread_count = std::thread::hardware_concurrency());
+	~WorkStealingPool();
+
+	// Calls f(i) for every i in [0, count) and returns once all of them are done
+	void Run(size_t count, const std::function<void(size_t)> &f);
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<size_t> items;
+	};
+
+	bool Pop(size_t queue, size_t &item);
+	bool Steal(size_t thief, size_t &item);
+	void Work(size_t queue);
+	void Loop(size_t queue);
+
+	std::vector<std::thread> m_threads;
+	std::vector<std::unique_ptr<Queue>> m_queues; // one per thread, the last is the caller's
+
+	const std::function<void(size_t)> *m_job = nullptr;
+	std::mutex m_run_mutex;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	uint64_t m_generation = 0;
+	unsigned int m_active = 0;
+	bool m_exit = false;
+};
+
+// Records PAL work on the thread running renderlets and replays it on the render thread
+// Creates hand out proxy IDs right away, the render thread maps them to the real PAL's IDs on replay
+// Batches move between the two threads through atomic stacks, so neither side ever blocks; in a
+// steady state one batch is recorded while the other is drained
+class DeferredPal : public Pal
+{
+public:
+	explicit DeferredPal(Pal *pal);
+	~DeferredPal();
+
+	void Release() override
+	{
+		m_pal->Release();
+	}
+
+	EPalType Type() override
+	{
+		return m_pal->Type();
+	}
+
+	IFramebuffer* Framebuffer() override
+	{
+		return m_pal->Framebuffer();
+	}
+
+	void BeginFrame() override
+	{
+		m_pal->BeginFrame();
+	}
+
+	PalStateStats GetStateStats() override
+	{
+		return m_pal->GetStateStats();
+	}
+
+	// Recording thread
+	ObjectID CreateBuffer(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	ObjectID CreateTexture(BufferDescriptor desc, int length, const uint8_t data[]) override;
+	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]) override;
+	void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]) override;
+	void UpdateTextureRegion(ObjectID texture_id, BufferFormat format, int x, int y, int width, int height,
+		const uint8_t data[]) override;
+	void DeleteBuffer(ObjectID buffer_id) override;
+
+	ObjectID CreateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff) override;
+	ObjectID UpdateVector(const VectorLoader::CommandList &commands, const VectorDiff &diff, ObjectID buffer_id) override;
+
+	ObjectID CreateVertexLayout(const VertexLayout &layout) override;
+
+	void RecordTree(ObjectID tree_id, const RenderTree &tree);
+	void RecordDestroyTree(ObjectID tree_id);
+
+	// Hands the recorded batch to the render thread
+	void Submit();
+
+	// Render thread
+	void Drain();
+
+	const RenderTree* DrawnTree(ObjectID tree_id) const;
+	const VertexLayout* VertexLayoutAt(ObjectID layout_id) const override;
+
+	void DrawTriangleList(ObjectID buffer_id, int offset, int length, unsigned int stride, ObjectID layout_id) override;
+	void DrawTriangleListInstanced(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID instance_buffer_id, uint32_t instance_count, ObjectID layout_id) override;
+	void DrawTriangleListMultiBuffer(ObjectID buffer_id, int offset, int length, unsigned int stride,
+		ObjectID material_buffer_id, unsigned int material_stride, ObjectID layout_id) override;
+
+	void DrawVector(ObjectID buffer_id, int slot, int width, int height) override;
+	void BindTexture(ObjectID texture_id, int slot) override;
+
+private:
+	struct Command
+	{
+		enum Kind
+		{
+			CreateBuffer,
+			CreateTexture,
+			UpdateBuffer,
+			UpdateBufferRange,
+			UpdateTextureRegion,
+			DeleteBuffer,
+			CreateVector,
+			UpdateVector,
+			CreateVertexLayout,
+			SetTree,
+			DestroyTree
+		} kind;
+
+		ObjectID id; // proxy ID, or tree ID for tree commands
+		BufferDescriptor desc;
+		size_t first; // into the batch array matching kind, NoBytes for buffers created without data
+		size_t length;
+		size_t offset = 0; // UpdateBufferRange only
+		int x = 0; // UpdateTextureRegion only, size and format are in desc
+		int y = 0;
+	};
+
+	static constexpr size_t NoBytes = SIZE_MAX;
+
+	struct VectorSnapshot
+	{
+		VectorLoader::CommandList commands;
+		VectorDiff diff;
+	};
+
+	// Arrays are cleared but keep their capacity, recycled batches don't allocate
+	struct Batch
+	{
+		std::vector<Command> commands;
+		std::vector<uint8_t> bytes;
+		std::vector<VectorSnapshot> vectors;
+		std::vector<std::vector<RenderTreeNode>> trees;
+		std::vector<VertexLayout> layouts;
+		size_t vector_count = 0;
+		size_t tree_count = 0;
+		Batch *next = nullptr;
+
+		void Clear();
+	};
+
+	ObjectID RecordBytes(Command::Kind kind, ObjectID id, BufferDescriptor desc, int length, const uint8_t data[]);
+	ObjectID RecordVector(Command::Kind kind, ObjectID id, const VectorLoader::CommandList &commands, const VectorDiff &diff);
+	void Replay(const Batch &batch);
+
+	ObjectID Translate(ObjectID proxy_id) const;
+	void Map(ObjectID proxy_id, ObjectID real_id);
+
+	static void Push(std::atomic<Batch *> &stack, Batch *batch);
+
+	Pal *m_pal;
+
+	// Recording thread
+	HandlePool<char> m_proxies{HandleType::Buffer};
+	Batch *m_recording;
+
+	std::atomic<Batch *> m_submitted{nullptr}; // newest first
+	std::atomic<Batch *> m_free{nullptr};
+
+	// Render thread
+	std::vector<std::pair<ObjectID, ObjectID>> m_real; // by proxy slot: proxy ID, real ID
+	std::unordered_map<ObjectID, std::unique_ptr<RenderTree>> m_trees;
+};
+
+class Runtime : public IRuntime
+{
+public:
+
+	struct Param
+	{
+		enum
+		{
+			Int32,
+			Int64,
+			Float32,
+			Float64
+		} Type;
+
+		union 
+		{
+			uint32_t I32;
+			uint64_t I64;
+			float F32;
+			double F64;
+		} Value;
+	};
+
+	Runtime(Pal* pal, const RuntimeConfig &config = {}) : m_config(config), m_pal(pal)
+	{
+		if (config.mode == ERuntimeMode::Deferred)
+		{
+			m_deferred = std::make_unique<DeferredPal>(pal);
+			m_pal = m_deferred.get();
+		}
+	}
+
+	ObjectID LoadFromFile(const std::wstring &path) override;
+	ObjectID LoadFromFile(const std::wstring &path, const std::string& function) override;
+
+	void PushParam(ObjectID renderlet_id, float value) override;
+	void PushParam(ObjectID renderlet_id, double value) override;
+	void PushParam(ObjectID renderlet_id, uint32_t value) override;
+	void PushParam(ObjectID renderlet_id, uint64_t value) override;
+	void ResetStack(ObjectID renderlet_id) override;
+
+	ObjectID Render(ObjectID renderlet_id, ObjectID tree_id = -1, bool pool = false) override;
+	ERenderStatus RenderWithBudget(ObjectID renderlet_id, ObjectID &tree_id, uint32_t budget_us) override;
+
+	InstantiationStats GetInstantiationStats() override;
+	RenderletStats GetStats(ObjectID renderlet_id) override;
+	RuntimeStats GetGlobalStats() override;
+	std::string ExportTrace() override;
+	bool WriteProfile(ObjectID renderlet_id, const std::wstring& path) override;
+
+	bool Reset(ObjectID renderlet_id) override;
+	void RenderMany(RenderRequest* requests, size_t count) override;
+	ObjectID RenderTiled(ObjectID renderlet_id, uint32_t tiles, unsigned int stride = 0) override;
+	ObjectID RenderInstanced(ObjectID renderlet_id, const float *transforms, uint32_t count,
+		ObjectID tree_id = -1) override;
+	const float* const ExecuteFloat4(ObjectID renderlet_id, const std::string& function) override;
+	void ExecuteMaterial(ObjectID renderlet_id, const RenderTreeNode* node, const std::string& function) override;
+	void ExecuteBuffer(ObjectID renderlet_id, const std::string& function, uint32_t* length, const uint8_t** data) override;
+
+	// void UploadBufferPool(ObjectID pool_id);
+	void UploadBufferPool(unsigned int stride) override;
+
+	const RenderTree* GetRenderTree(ObjectID tree_id) override;
+	void DestroyRenderTree(ObjectID tree_id) override;
+
+	void DrainPalCommands() override;
+
+	const VertexLayout* GetVertexLayout(ObjectID layout_id) override;
+
+	VectorUpdateStats GetVectorUpdateStats(ObjectID tree_id) override;
+
+	void Release() override;
+	void Unload(ObjectID renderlet_id) override;
+
+	Pal* PalImpl() const
+	{
+		return m_pal;
+	}
+
+private:
+
+	struct VectorOutput
+	{
+		VectorLoader::CommandList commands;
+		VectorDiff diff;
+	};
+
+	// One call's output, parsed without touching the PAL so it can run outside m_mutex
+	struct RenderOutput
+	{
+		struct NodeRange
+		{
+			std::string metadata;
+			int offset;
+			int length;
+		};
+
+		uint32_t vert_format = 0;
+		uint32_t vert_length = 0;
+		uint8_t* verts = nullptr;
+		uint32_t colors_length = 0; // vertex + material format only
+		uint8_t* colors = nullptr;
+
+		uint32_t stride = 0;
+		std::vector<VertexAttribute> attributes; // empty without a declared layout
+
+		// Processed as they're parsed, node is the index of the node drawing with it
+		struct NodeTexture
+		{
+			int node;
+			std::shared_ptr<const TexturePipeline::Texture> texture;
+		};
+
+		std::vector<NodeTexture> textures;
+
+		// Set when verts sit in the renderlet's pinned output arena, pooled uploads read them from there
+		ObjectID renderlet_id = -1;
+		uint64_t arena_offset = 0;
+
+		std::vector<NodeRange> nodes;
+		VectorLoader::CommandList commands;
+		bool commands_read = false; // vector format, parsed ahead of the upload
+	};
+
+	// RenderMany's copy of a guest output, the pointers in output point into bytes (and colors
+	// for streamed outputs), or into guest memory when the output was in the renderlet's arena
+	struct StagedOutput
+	{
+		std::vector<uint8_t> bytes;
+		std::vector<uint8_t> colors;
+		RenderOutput output;
+		bool valid = false;
+		bool pinned = false;
+	};
+
+	ERenderStatus RenderCall(ObjectID renderlet_id, ObjectID tree_id, bool pool, uint32_t budget_us, ObjectID &result);
+
+	// output points at [total length], length is how much of it can be read
+	bool ParseOutput(uint8_t* output, size_t length, RenderOutput& parsed, bool read_vectors);
+
+	// Version 3 blocks: [version][section count][type, offset, length, alignment]..., offsets from version
+	enum class ESection : uint32_t
+	{
+		Vertices = 1,
+		Indices,
+		Layout,    // as in version 2 headers
+		Nodes,     // u32 vertex offset and length per node, metadata from the matching material line
+		Materials, // material lines, nodes are read from these when there's no Nodes section
+		Colors,    // vertex + material format
+		Textures,  // [node][width][height][flags] and RGBA8 texels per texture, flag 1 builds mips
+		Vector,    // vector command stream
+		Count
+	};
+
+	bool ParseSections(uint8_t* block, size_t length, RenderOutput& parsed, bool read_vectors);
+	static void ReadNodes(const std::string &text, std::vector<RenderOutput::NodeRange> &nodes);
+
+	// Texture records, false when one runs past length or is larger than MaxTextureSize
+	bool ReadTextures(const uint8_t *records, size_t length, RenderOutput &parsed);
+	void AttachTextures(const RenderOutput &output, std::vector<RenderTreeNode> &nodes,
+		std::vector<TextureAtlas::Allocation> &allocations);
+
+	// Inserts a tree for nodes with the output's textures attached
+	ObjectID InsertTree(std::vector<RenderTreeNode> &nodes, const RenderOutput &output);
+	ObjectID UploadOutput(RenderOutput& output, ObjectID tree_id, bool pool);
+
+	ObjectID BuildVector(RenderOutput& output, ObjectID tree_id);
+	ObjectID BuildVertexWithMaterial(RenderOutput& output, ObjectID layout_id);
+	ObjectID BuildInstanced(RenderOutput &output, const float *transforms, uint32_t count, ObjectID tree_id);
+
+	// Buffers and textures a node owns, atlas pages are left to the atlas
+	void DeleteNodeResources(const RenderTreeNode &node);
+	void ReleaseGeometry(uint64_t hash);
+
+	// Version 2 headers carry a vertex layout after vert_format, advances header past it
+	// False when the layout runs past length or an attribute past the stride
+	bool ReadVertexLayout(uint8_t *&header, size_t length, RenderOutput &output);
+	void CreatePooledBuffer(RenderOutput &output, ObjectID tree_id);
+
+	// Deferred mode: queue the tree's current nodes for the render thread
+	void PublishTree(ObjectID tree_id);
+
+#ifndef __EMSCRIPTEN__
+	// Compiled once per path, imports are resolved up front so instantiating is just the store work
+	struct CompiledModule
+	{
+		wasmtime_module_t* Module = nullptr;
+		wasmtime_linker_t* Linker = nullptr;
+		wasmtime_instance_pre_t* Pre = nullptr;
+
+		// State right after the optional init export, taken by the first instance and
+		// restored into later ones: the pages init wrote, the memory size and mutable globals
+		std::mutex SnapshotMutex;
+		bool Snapshotted = false;
+		uint64_t SnapshotSize = 0;
+		std::vector<uint32_t> SnapshotPages;
+		std::vector<uint8_t> SnapshotData; // SnapshotPage bytes per entry of SnapshotPages
+		std::vector<std::pair<std::string, wasmtime_val_t>> SnapshotGlobals;
+
+		~CompiledModule();
+	};
+
+	static constexpr size_t SnapshotPage = 4096;
+
+	// Output space handed out by the wander.alloc_output import, in pages the host grew itself.
+	// Allocators that take their heap from what memory.grow returns (wasi-libc's sbrk, Rust's
+	// dlmalloc) never hand those out, so outputs can be read in place after the call; allocators
+	// keeping their own break, like Emscripten's sbrk, treat them as heap and must not be mixed with it.
+	// Rewound before each call unless an output still in it waits for an upload.
+	struct OutputArena
+	{
+		struct Chunk
+		{
+			uint64_t offset; // in guest memory
+			uint64_t size;
+		};
+
+		std::vector<Chunk> chunks;
+		size_t current = 0;
+		uint64_t used = 0; // in the current chunk
+		uint32_t pins = 0;
+
+		// Guest offset of size bytes, 0 when memory can't grow
+		uint64_t Allocate(wasmtime_context_t *context, const wasmtime_memory_t &memory, uint64_t size);
+		bool Contains(uint64_t offset, uint64_t length) const;
+
+		void Rewind()
+		{
+			current = 0;
+			used = 0;
+		}
+	};
+
+	static constexpr uint64_t WasmPage = 65536;
+	static constexpr uint64_t ArenaChunkPages = 16;
+
+	// wander.emit_chunk(kind, ptr, len) kinds
+	enum class EChunk : int32_t
+	{
+		Format,   // u32 vert_format, vertex (1) when never sent
+		Layout,   // [stride][count][semantic, format, offset]..., as in version 2 headers
+		Vertices, // appended to the vertex data
+		Colors,   // appended to the colors, vertex + material format only
+		Nodes,    // material lines, a line may be split across chunks
+		Textures  // whole texture records, as in version 3 Textures sections
+	};
+
+	// Output sent in chunks during the call instead of returned in one block. Chunks are
+	// copied out as they arrive, the guest can reuse one buffer however large the output.
+	struct OutputStream
+	{
+		bool active = false; // something was emitted this call
+		RenderOutput output;
+		std::vector<uint8_t> verts;
+		std::vector<uint8_t> colors;
+		std::string partial; // node text after the last complete line
+
+		void Clear();
+	};
+
+	// Guest profiler of a renderlet's main instance, sampled by SampleGuest as its deadline passes
+	struct GuestProfile
+	{
+		wasmtime_guestprofiler_t* Profiler = nullptr;
+		wasmtime_store_t* Store = nullptr;
+		std::chrono::steady_clock::time_point Last;
+		uint64_t Ticks = 0; // left in the call's budget, 0 without one
+		bool TimedOut = false;
+
+		GuestProfile() = default;
+		GuestProfile(const GuestProfile&) = delete;
+		GuestProfile& operator=(const GuestProfile&) = delete;
+		~GuestProfile();
+	};
+
+	// Store data, both imports find their state here
+	struct HostData
+	{
+		OutputArena Arena;
+		OutputStream Stream;
+		GuestProfile Profile;
+	};
+
+	struct WasmtimeContext
+	{
+		wasmtime_store_t* Store = nullptr;
+		wasmtime_context_t* Context = nullptr;
+		std::shared_ptr<CompiledModule> Compiled;
+		wasmtime_instance_t Instance {};
+		wasmtime_extern_t Run {};
+		wasmtime_extern_t Memory {};
+		std::string Function;
+		std::queue<Param> Params;
+
+		// Store data, heap allocated so the store's pointer survives moving the context
+		std::unique_ptr<HostData> Host;
+
+		// Instances 1..K-1 for RenderTiled, sharing Compiled and Stats, only used under Lock
+		std::vector<std::unique_ptr<WasmtimeContext>> Tiles;
+
+		std::shared_ptr<RenderletCounters> Stats;
+
+		// Set by a trap or timeout, which can leave __stack_pointer and the guest heap mid-update;
+		// calls fail until Reset swaps in a fresh instance
+		bool Poisoned = false;
+
+		// Stores aren't thread safe, every call into the renderlet holds this
+		std::unique_ptr<std::mutex> Lock;
+	};
+
+	// One engine for all renderlets, engines are thread safe
+	wasm_engine_t* m_engine = nullptr;
+	std::once_flag m_engine_once;
+
+	std::unordered_map<std::wstring, std::shared_ptr<CompiledModule>> m_modules; // by path
+	std::mutex m_modules_mutex;
+#else
+	struct WasmtimeContext
+	{
+		std::queue<Param> Params;
+		std::unique_ptr<std::mutex> Lock;
+		std::shared_ptr<RenderletCounters> Stats;
+	};
+	int m_context_count = 0;
+#endif
+
+	// Returns the renderlet with its lock held by lock, or nullptr for stale IDs
+	WasmtimeContext* LockContext(ObjectID renderlet_id, std::unique_lock<std::mutex> &lock);
+	const float* CallFloat4(WasmtimeContext &context, const std::string &function, EEntryPoint entry);
+
+	// PAL uploads from the runtime, counted for GetGlobalStats
+	ObjectID CreateBuffer(const BufferDescriptor &desc, int length, const uint8_t data[]);
+	ObjectID CreateTexture(const BufferDescriptor &desc, int length, const uint8_t data[]);
+	void UpdateBuffer(ObjectID buffer_id, int length, const uint8_t data[]);
+	void UpdateBufferRange(ObjectID buffer_id, int offset, int length, const uint8_t data[]);
+
+#ifndef __EMSCRIPTEN__
+	std::shared_ptr<CompiledModule> Compile(const std::wstring &path);
+
+	// wander.alloc_output(size) -> ptr, see OutputArena for which guest allocators it is safe with
+	static wasm_trap_t *AllocOutput(void *env, wasmtime_caller_t *caller,
+		const wasmtime_val_t *args, size_t nargs, wasmtime_val_t *results, size_t nresults);
+
+	// wander.emit_chunk(kind, ptr, len), env is the runtime
+	static wasm_trap_t *EmitChunk(void *env, wasmtime_caller_t *caller,
+		const wasmtime_val_t *args, size_t nargs, wasmtime_val_t *results, size_t nresults);
+
+	// Points parsed at the chunks of a streamed call, valid until the renderlet's next call
+	bool FinishStream(WasmtimeContext &context, RenderOutput &parsed, bool read_vectors);
+
+	// Parses the output of the last call, null for streamed calls, and counts it in the renderlet's stats
+	// With copy set the output is copied there and parsed from the copy
+	bool ReadOutput(WasmtimeContext &context, uint8_t *output, RenderOutput &parsed, bool read_vectors,
+		std::vector<uint8_t> *copy = nullptr);
+
+	// Store and instance for context.Compiled, the caller deletes the store if this fails
+	bool Instantiate(WasmtimeContext &context);
+
+	// Runs init and snapshots the result for the first instance of a module, restores it for the rest
+	bool Initialize(WasmtimeContext &context);
+	bool TakeSnapshot(WasmtimeContext &context, const wasmtime_func_t &init);
+	bool RestoreSnapshot(WasmtimeContext &context);
+
+	// The output's stated length, cut short at the end of guest memory
+	size_t OutputLength(WasmtimeContext &context, const uint8_t *output);
+
+	// Pins the arena when the output at output is in it, so it stays put until UnpinArena
+	bool PinArena(WasmtimeContext &context, uint8_t *output);
+	void UnpinArena(ObjectID renderlet_id);
+
+	// Runs the entry point, output points at the result in guest memory, or is null when the call streamed
+	std::vector<wasmtime_val_t> PopArgs(WasmtimeContext &context);
+	ERenderStatus Invoke(WasmtimeContext &context, const std::vector<wasmtime_val_t> &args, uint8_t *&output,
+		uint32_t budget_us = 0);
+
+	// Traps are reported instead of exiting, budget_us of 0 means no deadline
+	ERenderStatus Call(WasmtimeContext &context, const wasmtime_func_t &func, const std::vector<wasmtime_val_t> &args,
+		int32_t &result, uint32_t budget_us, EEntryPoint entry);
+
+	// Advances the engine epoch every EpochTickUs, started by the first budgeted or profiled call
+	void Tick();
+
+	// Epoch deadline callback of every store under EProfiler::Guest, which then also enforces budgets
+	static wasmtime_error_t *SampleGuest(wasmtime_context_t *context, void *data, uint64_t *epoch_deadline_delta,
+		wasmtime_update_deadline_kind_t *update_kind);
+	static wasmtime_guestprofiler_t *NewGuestProfiler(const CompiledModule &compiled);
+
+	static constexpr uint32_t EpochTickUs = 1000;
+	static constexpr uint64_t NoDeadline = 1ull << 40; // ticks, decades at EpochTickUs
+
+	std::thread m_ticker;
+	std::atomic<bool> m_ticking{true};
+	std::once_flag m_ticker_once;
+
+	// Started by the first RenderMany
+	std::unique_ptr<WorkStealingPool> m_workers;
+	std::once_flag m_workers_once;
+#endif
+
+	TexturePipeline m_texture_pipeline;
+	static constexpr uint32_t MaxTextureSize = 16384;
+
+	// Under m_mutex, slots are released with the trees using them
+	TextureAtlas m_atlas;
+	std::unordered_map<ObjectID, std::vector<TextureAtlas::Allocation>> m_atlas_allocations; // by tree
+
+	// RenderInstanced geometry by output content hash, under m_mutex; trees only own their transforms.
+	// A colliding output probes the following keys
+	struct InstancedGeometry
+	{
+		std::vector<RenderTreeNode> nodes;
+		std::vector<TextureAtlas::Allocation> allocations;
+
+		// What the entry was built from, the hash only finds it
+		std::vector<uint8_t> verts;
+		uint32_t stride = 0;
+		std::vector<VertexAttribute> attributes;
+		std::vector<RenderOutput::NodeRange> ranges;
+
+		// Compared by address, held so a texture evicted from the pipeline cache can't be replaced
+		// by a different one at the same address while this entry exists
+		std::vector<RenderOutput::NodeTexture> textures;
+		uint32_t refs = 0;
+
+		bool Matches(const RenderOutput &output) const;
+	};
+
+	struct InstancedTree
+	{
+		uint64_t hash;
+		ObjectID instance_buffer_id;
+		uint32_t count;
+	};
+
+	std::unordered_map<uint64_t, InstancedGeometry> m_instanced_geometry;
+	std::unordered_map<ObjectID, InstancedTree> m_instanced_trees;
+
+	std::vector<StagedOutput> m_batch; // by request
+	std::mutex m_batch_mutex;
+
+	struct SubBuffer
+	{
+		int offset;
+		uint32_t length;
+		ObjectID tree_id;
+		ObjectID renderlet_id; // -1 when the data is in m_staging_buffer
+		uint64_t arena_offset;
+	};
+
+	std::vector<SubBuffer> m_sub_buffers;
+	std::unique_ptr<unsigned char[]> m_staging_buffer;
+
+	RuntimeConfig m_config;
+
+	// Ring of the latest instantiation times
+	static constexpr size_t InstantiationSamples = 1024;
+	std::vector<uint32_t> m_instantiation_us;
+	uint32_t m_instantiation_count = 0;
+	std::mutex m_stats_mutex;
+
+	RenderletStats m_unloaded_stats{}; // under m_stats_mutex
+	PalCounters m_pal_counters;
+	std::atomic<uint64_t> m_module_hits{0};
+	std::atomic<uint64_t> m_module_misses{0};
+
+	// Slots don't move, so contexts are used after the lookup lock is released
+	HandlePool<WasmtimeContext> m_contexts{HandleType::Renderlet};
+	std::shared_mutex m_contexts_mutex;
 
-	std::vector<WasmtimeContext> m_contexts;
-	std::vector<std::queue<Param>> m_params;
+	// PAL, trees and the buffer pool are shared by all renderlets, guest code runs outside this
+	std::mutex m_mutex;
 
-	std::vector<std::unique_ptr<RenderTree>> m_render_trees;
+	// Trees stay heap allocated, hosts keep the pointers from GetRenderTree
+	HandlePool<std::unique_ptr<RenderTree>> m_render_trees{HandleType::RenderTree};
+	std::unordered_map<ObjectID, VectorOutput> m_vectors; // by tree
 
 	Pal* m_pal;
+	std::unique_ptr<DeferredPal> m_deferred; // m_pal points here in deferred mode
 };
 
 }